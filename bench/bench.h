@@ -0,0 +1,349 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Helpers shared by the benchmarks, timing, percentiles and a minimal
+ * blocking MQTT 3.1.1 client for the ones run against a live broker, all
+ * inline so each benchmark stays a single file.
+ */
+
+#define BENCH_HOST  "127.0.0.1"
+#define BENCH_PORT  "1883"
+
+static inline double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline int bench_cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Percentile of an array of samples, sorted in place */
+static inline double bench_percentile(double *samples, size_t nr, double p) {
+    qsort(samples, nr, sizeof(*samples), bench_cmp_double);
+    size_t i = (size_t) (p / 100 * (nr - 1) + 0.5);
+    return samples[i];
+}
+
+/* CPU time spent by a process so far in seconds, -1 if it can't be read */
+static inline double bench_cpu(pid_t pid) {
+    char path[32], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    // The fields after the command, which may contain spaces
+    char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                     "%lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (utime + stime) / (double) sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * Client connection, packets are read in a buffer and handed out whole, a
+ * packet stays valid till the next read
+ */
+struct bench_client {
+    int fd;
+    size_t len;
+    size_t pos;
+    unsigned char buf[1 << 16];
+};
+
+static inline int bench_write(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Next packet already buffered, return 0 if there's none */
+static inline int bench_next(struct bench_client *c, unsigned char *header,
+                             unsigned char **body, size_t *len) {
+    size_t i = c->pos + 1, n = 0, mul = 1;
+    for (; i < c->len; i++, mul *= 128) {
+        n += (c->buf[i] & 127) * mul;
+        if (!(c->buf[i] & 128))
+            break;
+    }
+    if (i >= c->len || c->len - i - 1 < n)
+        return 0;
+    *header = c->buf[c->pos];
+    *body = c->buf + i + 1;
+    *len = n;
+    c->pos = i + 1 + n;
+    return 1;
+}
+
+/* Read what the socket has, blocking till something comes, -1 on close */
+static inline int bench_fill(struct bench_client *c) {
+    memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+    c->len -= c->pos;
+    c->pos = 0;
+    if (c->len == sizeof(c->buf))
+        return -1;
+    ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+    if (n <= 0)
+        return -1;
+    c->len += n;
+    return 0;
+}
+
+static inline int bench_wait(struct bench_client *c, unsigned char *header,
+                             unsigned char **body, size_t *len) {
+    while (!bench_next(c, header, body, len))
+        if (bench_fill(c) < 0)
+            return -1;
+    return 0;
+}
+
+/* Encode the fixed header of a packet, return its length */
+static inline size_t bench_header(unsigned char *buf, unsigned char byte,
+                                  size_t len) {
+    size_t n = 0;
+    buf[n++] = byte;
+    do {
+        buf[n] = len % 128;
+        len /= 128;
+        if (len > 0)
+            buf[n] |= 128;
+    } while (buf[n++] & 128);
+    return n;
+}
+
+static inline size_t bench_string(unsigned char *buf, const char *str) {
+    size_t len = strlen(str);
+    buf[0] = len >> 8;
+    buf[1] = len & 0xFF;
+    memcpy(buf + 2, str, len);
+    return len + 2;
+}
+
+/* Pack a PUBLISH in a buffer, return its length */
+static inline size_t bench_pack_publish(unsigned char *buf, const char *topic,
+                                        const void *payload, size_t size,
+                                        unsigned qos, unsigned short pkt_id) {
+    size_t len = 2 + strlen(topic) + (qos > 0 ? 2 : 0) + size;
+    size_t n = bench_header(buf, 0x30 | qos << 1, len);
+    n += bench_string(buf + n, topic);
+    if (qos > 0) {
+        buf[n++] = pkt_id >> 8;
+        buf[n++] = pkt_id & 0xFF;
+    }
+    memcpy(buf + n, payload, size);
+    return n + size;
+}
+
+/* Pack an ack, PUBACK, PUBREC, PUBREL or PUBCOMP, 4 bytes */
+static inline size_t bench_pack_ack(unsigned char *buf, unsigned char byte,
+                                    unsigned short pkt_id) {
+    buf[0] = byte;
+    buf[1] = 2;
+    buf[2] = pkt_id >> 8;
+    buf[3] = pkt_id & 0xFF;
+    return 4;
+}
+
+static inline int bench_socket(const char *host, const char *port) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                              .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+    return fd;
+}
+
+/*
+ * Connect a client and wait for its CONNACK, return the session present
+ * flag, or -1 on error
+ */
+static inline int bench_connect(struct bench_client *c, const char *host,
+                                const char *port, const char *id,
+                                bool clean) {
+    unsigned char buf[512], header, *body;
+    size_t len;
+    c->len = c->pos = 0;
+    if ((c->fd = bench_socket(host, port)) < 0)
+        return -1;
+    size_t n = bench_header(buf, 0x10, 12 + strlen(id));
+    n += bench_string(buf + n, "MQTT");
+    buf[n++] = 4;
+    buf[n++] = clean ? 2 : 0;
+    buf[n++] = 0;
+    buf[n++] = 60;
+    n += bench_string(buf + n, id);
+    if (bench_write(c->fd, buf, n) < 0 ||
+        bench_wait(c, &header, &body, &len) < 0 || header != 0x20 ||
+        len != 2 || body[1] != 0) {
+        close(c->fd);
+        return -1;
+    }
+    return body[0] & 1;
+}
+
+/* Subscribe to a filter and wait for the SUBACK */
+static inline int bench_subscribe(struct bench_client *c, const char *filter,
+                                  unsigned qos) {
+    unsigned char buf[512], header, *body;
+    size_t len;
+    size_t n = bench_header(buf, 0x82, 5 + strlen(filter));
+    buf[n++] = 0;
+    buf[n++] = 1;
+    n += bench_string(buf + n, filter);
+    buf[n++] = qos;
+    if (bench_write(c->fd, buf, n) < 0 ||
+        bench_wait(c, &header, &body, &len) < 0)
+        return -1;
+    return header == 0x90 && len == 3 && body[2] != 0x80 ? 0 : -1;
+}
+
+static inline void bench_disconnect(struct bench_client *c) {
+    bench_write(c->fd, "\xe0\x00", 2);
+    close(c->fd);
+}
+
+/* Packet id of a QoS > 0 PUBLISH as received */
+static inline unsigned short bench_publish_id(const unsigned char *body) {
+    size_t topic = body[0] << 8 | body[1];
+    return body[2 + topic] << 8 | body[3 + topic];
+}
+
+/*
+ * Publish messages on a topic keeping a window of them in flight, while a
+ * client subscribed to it acks each one as it comes, both going through the
+ * full exchange of their QoS, PUBACK or PUBREC, PUBREL and PUBCOMP. Return
+ * the seconds taken for every message to be both acked to the publisher and
+ * delivered, -1 if a connection is lost or stalls.
+ */
+static inline double bench_pipeline(struct bench_client *pub,
+                                     struct bench_client *sub,
+                                     const char *topic, unsigned qos,
+                                     size_t messages, size_t window,
+                                     size_t size) {
+    static unsigned char out[1 << 20], payload[4096];
+    unsigned char header, *body;
+    size_t sent = 0, acked = 0, delivered = 0, n, len;
+    struct pollfd fds[2] = { { pub->fd, POLLIN, 0 }, { sub->fd, POLLIN, 0 } };
+    memset(payload, 'x', size);
+    double start = bench_now();
+    while (acked < messages || delivered < messages) {
+        // Fill the window up in a single write
+        for (n = 0; sent < messages && sent - acked < window &&
+             n + size + 64 < sizeof(out); sent++)
+            n += bench_pack_publish(out + n, topic, payload, size, qos,
+                                    sent % 65535 + 1);
+        if (n > 0 && bench_write(pub->fd, out, n) < 0)
+            goto err;
+        if (poll(fds, 2, 5000) <= 0)
+            goto err;
+        if (fds[0].revents) {
+            if (bench_fill(pub) < 0)
+                goto err;
+            for (n = 0; bench_next(pub, &header, &body, &len); ) {
+                if (header >> 4 == 5)
+                    n += bench_pack_ack(out + n, 0x62, body[0] << 8 | body[1]);
+                else if (header >> 4 == 4 || header >> 4 == 7)
+                    acked++;
+            }
+            if (n > 0 && bench_write(pub->fd, out, n) < 0)
+                goto err;
+        }
+        if (fds[1].revents) {
+            if (bench_fill(sub) < 0)
+                goto err;
+            for (n = 0; bench_next(sub, &header, &body, &len); ) {
+                if (header >> 4 == 3) {
+                    n += bench_pack_ack(out + n, qos == 1 ? 0x40 : 0x50,
+                                        bench_publish_id(body));
+                    delivered += qos == 1;
+                } else if (header >> 4 == 6) {
+                    n += bench_pack_ack(out + n, 0x70, body[0] << 8 | body[1]);
+                    delivered++;
+                }
+            }
+            if (n > 0 && bench_write(sub->fd, out, n) < 0)
+                goto err;
+        }
+    }
+    return bench_now() - start;
+err:
+    fprintf(stderr, "Connection lost or stalled, %zu sent, %zu acked, "
+            "%zu delivered\n", sent, acked, delivered);
+    return -1;
+}
+
+/*
+ * Start a broker with a configuration written to a file, wait till it
+ * accepts connections, return its pid or -1
+ */
+static inline pid_t bench_broker_start(const char *binary, const char *port,
+                                       const char *path, const char *conf) {
+    FILE *fp = fopen(path, "w");
+    if (!fp || fputs(conf, fp) < 0 || fclose(fp) < 0)
+        return -1;
+    // Nothing buffered must be written twice
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Its startup banner would get in the way of the results
+        if (!freopen("/dev/null", "w", stdout))
+            _exit(EXIT_FAILURE);
+        execl(binary, binary, "-p", port, "-c", path, (char *) NULL);
+        _exit(EXIT_FAILURE);
+    }
+    struct timespec pause = { 0, 10000000 };
+    for (int i = 0; pid > 0 && i < 500; i++) {
+        int fd = bench_socket(BENCH_HOST, port);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+static inline void bench_broker_stop(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,65 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bench.h"
+#include "config.h"
+#include "core.h"
+
+/*
+ * Subscription churn of a single session holding many subscriptions, each
+ * round unsubscribes a plain topic or a wildcard filter and subscribes it
+ * again, lookups included as the SUBSCRIBE and UNSUBSCRIBE handlers do them.
+ * Filter i is "s/i/+", matching plain topic i "s/i/t" besides.
+ */
+
+#define PLAIN_ROUNDS    200000
+#define WILDCARD_ROUNDS 20000
+
+static const size_t sizes[][2] = {
+    { 10, 10 }, { 100, 100 }, { 1000, 1000 }, { 10000, 1000 }
+};
+
+static void run(size_t plain, size_t wildcards) {
+    struct sol *sol = calloc(1, sizeof(*sol));
+    struct sol_client *c = calloc(1, sizeof(*c));
+    char buf[64];
+    unsigned seed = 42;
+    trie_init(&sol->topics);
+    trie_init(&sol->filters);
+    for (size_t i = 0; i < plain; i++) {
+        snprintf(buf, sizeof(buf), "s/%zu/t/", i);
+        struct topic *t = topic_create(topic_name(buf, strlen(buf)));
+        sol_topic_put(sol, t);
+        topic_add_subscriber(t, c, 0);
+    }
+    for (size_t i = 0; i < wildcards; i++) {
+        snprintf(buf, sizeof(buf), "s/%zu/+", i);
+        sol_wildcard_add(sol, buf, c, 0);
+    }
+    double start = bench_now();
+    for (size_t r = 0; r < PLAIN_ROUNDS; r++) {
+        snprintf(buf, sizeof(buf), "s/%u/t/", rand_r(&seed) % (unsigned) plain);
+        struct topic *t = sol_topic_get(sol, buf);
+        topic_del_subscriber(session_subscription(c, t));
+        t = sol_topic_get(sol, buf);
+        if (!session_subscription(c, t))
+            topic_add_subscriber(t, c, 0);
+    }
+    double plain_time = bench_now() - start;
+    start = bench_now();
+    for (size_t r = 0; r < WILDCARD_ROUNDS; r++) {
+        snprintf(buf, sizeof(buf), "s/%u/+",
+                 rand_r(&seed) % (unsigned) wildcards);
+        sol_wildcard_del(sol, buf, c);
+        sol_wildcard_add(sol, buf, c, 0);
+    }
+    double wildcard_time = bench_now() - start;
+    printf("%6zu plain / %5zu wildcards   plain %7.0f ns   wildcard %7.0f ns\n",
+           plain, wildcards, plain_time * 1e9 / PLAIN_ROUNDS,
+           wildcard_time * 1e9 / WILDCARD_ROUNDS);
+}
+
+int main(void) {
+    config_set_default();
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+        run(sizes[i][0], sizes[i][1]);
+    return 0;
+}
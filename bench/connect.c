@@ -0,0 +1,79 @@
+#define _POSIX_C_SOURCE 200809L
+#include <getopt.h>
+#include "bench.h"
+
+/*
+ * Connection churn against a running broker, while a number of idle clients
+ * keep their connections open, each cycle opens a socket, sends a CONNECT,
+ * waits for the CONNACK and closes it with a DISCONNECT, the accept and the
+ * bookkeeping of a connection in and out of the broker. Given the pid of the
+ * broker, its CPU time per cycle is printed too.
+ *
+ *   bench_connect [-a host] [-p port] [-o open connections] [-n cycles]
+ *                 [-P broker pid]
+ */
+
+int main(int argc, char **argv) {
+    const char *host = BENCH_HOST, *port = BENCH_PORT;
+    size_t open = 1000, cycles = 10000;
+    pid_t pid = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:o:n:P:")) != -1) {
+        switch (opt) {
+            case 'a': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'o': open = strtoul(optarg, NULL, 10); break;
+            case 'n': cycles = strtoul(optarg, NULL, 10); break;
+            case 'P': pid = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-a host] [-p port] [-o open] "
+                        "[-n cycles] [-P pid]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (cycles == 0) {
+        fprintf(stderr, "At least one cycle\n");
+        return EXIT_FAILURE;
+    }
+    int *idle = malloc(open * sizeof(*idle));
+    static struct bench_client c;
+    double *samples = malloc(cycles * sizeof(*samples));
+    char id[32];
+    for (size_t i = 0; i < open; i++) {
+        snprintf(id, sizeof(id), "bench-idle-%zu", i);
+        if (bench_connect(&c, host, port, id, true) < 0) {
+            fprintf(stderr, "Unable to open connection %zu to %s:%s\n",
+                    i, host, port);
+            return EXIT_FAILURE;
+        }
+        idle[i] = c.fd;
+    }
+    double cpu = pid ? bench_cpu(pid) : 0;
+    double start = bench_now();
+    for (size_t i = 0; i < cycles; i++) {
+        double cycle = bench_now();
+        snprintf(id, sizeof(id), "bench-churn-%zu", i);
+        if (bench_connect(&c, host, port, id, true) < 0) {
+            fprintf(stderr, "Connection lost at cycle %zu\n", i);
+            return EXIT_FAILURE;
+        }
+        bench_disconnect(&c);
+        samples[i] = bench_now() - cycle;
+    }
+    double elapsed = bench_now() - start;
+    printf("%zu open, %zu cycles: %.1f us per connection, p50 %.1f us, "
+           "p99 %.1f us", open, cycles, elapsed * 1e6 / cycles,
+           bench_percentile(samples, cycles, 50) * 1e6,
+           bench_percentile(samples, cycles, 99) * 1e6);
+    if (pid)
+        printf(", broker cpu %.1f us/connection",
+               (bench_cpu(pid) - cpu) * 1e6 / cycles);
+    printf("\n");
+    for (size_t i = 0; i < open; i++) {
+        c.fd = idle[i];
+        bench_disconnect(&c);
+    }
+    free(idle);
+    free(samples);
+    return EXIT_SUCCESS;
+}
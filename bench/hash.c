@@ -0,0 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bench.h"
+#include "hash.h"
+
+/*
+ * Time per hash of the string hashes of the broker, over random keys with
+ * the lengths of client ids, 8 to 23 bytes, and of topic names, 20 to 60
+ * bytes. FNV-1a, the usual simple byte at a time hash, is there as a point
+ * of comparison.
+ */
+
+#define KEYS    4096
+#define ROUNDS  1000
+
+struct keys {
+    const char *name;
+    size_t min;
+    size_t max;
+    char *str[KEYS];
+    size_t len[KEYS];
+};
+
+static struct hash_key key;
+
+static uint64_t fnv1a(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static uint64_t crc32c(const void *buf, size_t len) {
+    return hash_crc32c(buf, len, 0);
+}
+
+static uint64_t murmur(const void *buf, size_t len) {
+    return hash64(buf, len, 42);
+}
+
+static uint64_t siphash(const void *buf, size_t len) {
+    return hash_keyed(buf, len, &key);
+}
+
+static const struct {
+    const char *name;
+    uint64_t (*hash)(const void *, size_t);
+} hashes[] = {
+    { "FNV-1a", fnv1a },
+    { "crc32c", crc32c },
+    { "hash64", murmur },
+    { "siphash-1-3", siphash },
+};
+
+static void keys_init(struct keys *k, unsigned seed) {
+    for (size_t i = 0; i < KEYS; i++) {
+        k->len[i] = k->min + rand_r(&seed) % (k->max - k->min + 1);
+        k->str[i] = malloc(k->len[i] + 1);
+        for (size_t j = 0; j < k->len[i]; j++)
+            k->str[i][j] = 'a' + rand_r(&seed) % 26;
+        k->str[i][k->len[i]] = '\0';
+    }
+}
+
+static double time_hash(uint64_t (*hash)(const void *, size_t),
+                        const struct keys *k) {
+    volatile uint64_t sink = 0;
+    double start = bench_now();
+    for (size_t r = 0; r < ROUNDS; r++)
+        for (size_t i = 0; i < KEYS; i++)
+            sink += hash(k->str[i], k->len[i]);
+    (void) sink;
+    return (bench_now() - start) * 1e9 / (ROUNDS * KEYS);
+}
+
+int main(void) {
+    static struct keys ids = { "id 8-23 B", 8, 23, { 0 }, { 0 } };
+    static struct keys topics = { "topic 20-60 B", 20, 60, { 0 }, { 0 } };
+    hash_key_init(&key);
+    keys_init(&ids, 1);
+    keys_init(&topics, 2);
+    printf("%-12s %13s %13s\n", "ns per hash", ids.name, topics.name);
+    for (size_t i = 0; i < sizeof(hashes) / sizeof(*hashes); i++)
+        printf("%-12s %13.1f %13.1f\n", hashes[i].name,
+               time_hash(hashes[i].hash, &ids),
+               time_hash(hashes[i].hash, &topics));
+    return 0;
+}
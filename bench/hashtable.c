@@ -0,0 +1,118 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bench.h"
+#include "hashtable.h"
+
+/*
+ * HashTable keyed by client ids, 22 bytes like the ones generated by most
+ * client libraries. Times per insert into a table growing from empty, per
+ * lookup of a present id, a reconnection, and per lookup of an absent one,
+ * the CONNECT of a new client. Lookups use copies of the ids, cold for the
+ * table, as they come from packets.
+ *
+ * Then the latency of each CONNECT-like lookup and insert of a million new
+ * ids, the table growing from empty, where a growth moving every entry at
+ * once would stall the one operation crossing the max load.
+ */
+
+#define ID_LEN      22
+#define OPERATIONS  1000000
+
+static const size_t sizes[] = { 10000, 1000000 };
+
+/* The table only points to the ids, they're released by the benchmark */
+static int keep_entry(struct hashtable_entry *entry) {
+    (void) entry;
+    return 0;
+}
+
+static void make_id(char *buf, size_t i, unsigned salt) {
+    unsigned long long x = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    snprintf(buf, ID_LEN + 1, "%06x%016llx", salt & 0xFFFFFF, x);
+}
+
+static void run(size_t nr) {
+    char *ids = malloc(nr * (ID_LEN + 1));
+    char *copies = malloc(nr * (ID_LEN + 1));
+    char *absent = malloc(nr * (ID_LEN + 1));
+    size_t *order = malloc(nr * sizeof(*order));
+    // Small tables are measured over as many operations as the largest
+    size_t reps = OPERATIONS / nr;
+    unsigned seed = 42;
+    for (size_t i = 0; i < nr; i++) {
+        make_id(ids + i * (ID_LEN + 1), i, 0x5011);
+        make_id(absent + i * (ID_LEN + 1), i, 0xAB5E);
+        order[i] = i;
+    }
+    for (size_t i = nr - 1; i > 0; i--) {
+        size_t j = rand_r(&seed) % (i + 1), tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    // Copies of the ids in the order they'll be looked up
+    for (size_t i = 0; i < nr; i++)
+        memcpy(copies + i * (ID_LEN + 1), ids + order[i] * (ID_LEN + 1),
+               ID_LEN + 1);
+    HashTable *table = NULL;
+    double insert = 0, hit, miss, start;
+    for (size_t r = 0; r < reps; r++) {
+        hashtable_release(table);
+        table = hashtable_create(keep_entry);
+        start = bench_now();
+        for (size_t i = 0; i < nr; i++)
+            hashtable_put(table, ids + i * (ID_LEN + 1),
+                          ids + i * (ID_LEN + 1));
+        insert += bench_now() - start;
+    }
+    size_t hits = 0, misses = 0;
+    start = bench_now();
+    for (size_t r = 0; r < reps; r++)
+        for (size_t i = 0; i < nr; i++)
+            hits += hashtable_get(table, copies + i * (ID_LEN + 1)) != NULL;
+    hit = bench_now() - start;
+    start = bench_now();
+    for (size_t r = 0; r < reps; r++)
+        for (size_t i = 0; i < nr; i++)
+            misses += hashtable_get(table, absent + i * (ID_LEN + 1)) == NULL;
+    miss = bench_now() - start;
+    size_t ops = nr * reps;
+    printf("%8zu ids   insert %5.0f ns   hit %5.0f ns   miss %5.0f ns\n",
+           nr, insert * 1e9 / ops, hit * 1e9 / ops, miss * 1e9 / ops);
+    if (hits != ops || misses != ops)
+        fprintf(stderr, "%zu hits, %zu misses of %zu\n", hits, misses, ops);
+    hashtable_release(table);
+    free(ids);
+    free(copies);
+    free(absent);
+    free(order);
+}
+
+static void growth(size_t nr) {
+    char *ids = malloc(nr * (ID_LEN + 1));
+    double *samples = malloc(nr * sizeof(*samples));
+    for (size_t i = 0; i < nr; i++)
+        make_id(ids + i * (ID_LEN + 1), i, 0x6E0);
+    HashTable *table = hashtable_create(keep_entry);
+    for (size_t i = 0; i < nr; i++) {
+        char *id = ids + i * (ID_LEN + 1);
+        double start = bench_now();
+        if (!hashtable_get(table, id))
+            hashtable_put(table, id, id);
+        samples[i] = bench_now() - start;
+    }
+    printf("%8zu ids   lookup+insert max %.0f us, p99.9 %.1f us, "
+           "p99 %.1f us, p50 %.0f ns\n", nr,
+           bench_percentile(samples, nr, 100) * 1e6,
+           bench_percentile(samples, nr, 99.9) * 1e6,
+           bench_percentile(samples, nr, 99) * 1e6,
+           bench_percentile(samples, nr, 50) * 1e9);
+    hashtable_release(table);
+    free(ids);
+    free(samples);
+}
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+        run(sizes[i]);
+    growth(1000000);
+    return 0;
+}
@@ -0,0 +1,141 @@
+#define _POSIX_C_SOURCE 200809L
+#include <getopt.h>
+#include "bench.h"
+
+/*
+ * Control packets overtaking a saturated data lane. A subscriber that never
+ * reads gets a flood of QoS 0 PUBLISHes, while another client times PINGREQ
+ * round trips, one per chunk of the flood and then a series once it's all
+ * in. The saturated subscriber then sends its own PINGREQ, counting the
+ * PUBLISHes delivered ahead of the PINGRESP, and drains the rest, those past
+ * the bound of its data lane having been dropped.
+ *
+ *   bench_lanes [-b broker binary] [-a host] [-p port] [-n messages]
+ *               [-s payload size]
+ *
+ * With a broker binary, it's started once for each max_output_bytes below,
+ * otherwise the broker running at host:port is used as it is.
+ */
+
+#define TOPIC   "bench/lanes"
+#define CHUNK   1000
+#define PINGS   1000
+
+static const char *output_bytes[] = { "16MB", "1MB", "64KB" };
+
+static double ping(struct bench_client *c) {
+    unsigned char header, *body;
+    size_t len;
+    double start = bench_now();
+    if (bench_write(c->fd, "\xc0\x00", 2) < 0 ||
+        bench_wait(c, &header, &body, &len) < 0 || header != 0xd0)
+        return -1;
+    return bench_now() - start;
+}
+
+static void print_latency(const char *label, double *samples, size_t nr) {
+    printf("  %s ping p50 %.0f us, p99 %.0f us, p99.9 %.0f us\n", label,
+           bench_percentile(samples, nr, 50) * 1e6,
+           bench_percentile(samples, nr, 99) * 1e6,
+           bench_percentile(samples, nr, 99.9) * 1e6);
+}
+
+static int run(const char *host, const char *port, size_t messages,
+               size_t size) {
+    static struct bench_client slow, pub, other;
+    static unsigned char chunk[CHUNK * 4200], payload[4096];
+    static double during[1024], after[PINGS];
+    unsigned char header, *body;
+    size_t len, n = 0, nr_during = 0, ahead = 0, rest = 0;
+    if (bench_connect(&slow, host, port, "bench-lanes-slow", true) < 0 ||
+        bench_subscribe(&slow, TOPIC, 0) < 0 ||
+        bench_connect(&pub, host, port, "bench-lanes-pub", true) < 0 ||
+        bench_connect(&other, host, port, "bench-lanes-other", true) < 0)
+        return -1;
+    memset(payload, 'x', size);
+    for (size_t i = 0; i < CHUNK; i++)
+        n += bench_pack_publish(chunk + n, TOPIC, payload, size, 0, 0);
+    for (size_t sent = 0; sent < messages; sent += CHUNK) {
+        if (bench_write(pub.fd, chunk, n) < 0)
+            return -1;
+        if (nr_during < sizeof(during) / sizeof(double) &&
+            (during[nr_during++] = ping(&other)) < 0)
+            return -1;
+    }
+    // The broker has read the whole flood once its PINGRESP comes
+    if (ping(&pub) < 0)
+        return -1;
+    for (size_t i = 0; i < PINGS; i++)
+        if ((after[i] = ping(&other)) < 0)
+            return -1;
+    print_latency("during flood,", during, nr_during);
+    print_latency("after flood, ", after, PINGS);
+
+    double start = bench_now();
+    if (bench_write(slow.fd, "\xc0\x00", 2) < 0)
+        return -1;
+    while (bench_wait(&slow, &header, &body, &len) == 0 && header != 0xd0)
+        ahead++;
+    printf("  saturated client PINGRESP after %zu PUBLISHes, %.1f ms\n",
+           ahead, (bench_now() - start) * 1e3);
+    struct pollfd fd = { slow.fd, POLLIN, 0 };
+    for (;;) {
+        while (bench_next(&slow, &header, &body, &len))
+            rest++;
+        if (poll(&fd, 1, 500) <= 0 || bench_fill(&slow) < 0)
+            break;
+    }
+    printf("  delivered to the saturated client %zu of %zu\n",
+           ahead + rest, messages);
+    bench_disconnect(&slow);
+    bench_disconnect(&pub);
+    bench_disconnect(&other);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *host = BENCH_HOST, *port = BENCH_PORT, *binary = NULL;
+    size_t messages = 100000, size = 100;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:a:p:n:s:")) != -1) {
+        switch (opt) {
+            case 'b': binary = optarg; break;
+            case 'a': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'n': messages = strtoul(optarg, NULL, 10); break;
+            case 's': size = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-b binary] [-a host] [-p port] "
+                        "[-n messages] [-s size]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (size > 4096) {
+        fprintf(stderr, "A payload up to 4096 bytes\n");
+        return EXIT_FAILURE;
+    }
+    if (!binary)
+        return run(host, port, messages, size) < 0 ?
+            EXIT_FAILURE : EXIT_SUCCESS;
+    for (size_t i = 0; i < sizeof(output_bytes) / sizeof(char *); i++) {
+        char conf[256];
+        snprintf(conf, sizeof(conf), "max_output_bytes %s\n"
+                 "max_queued_bytes 16MB\nlog_path /var/tmp/sol-bench.log\n",
+                 output_bytes[i]);
+        pid_t pid = bench_broker_start(binary, port,
+                                       "/var/tmp/sol-bench.conf", conf);
+        if (pid < 0) {
+            fprintf(stderr, "Unable to start %s\n", binary);
+            return EXIT_FAILURE;
+        }
+        printf("max_output_bytes %s\n", output_bytes[i]);
+        int rc = run(BENCH_HOST, port, messages, size);
+        bench_broker_stop(pid);
+        if (rc < 0) {
+            fprintf(stderr, "Connection lost\n");
+            return EXIT_FAILURE;
+        }
+    }
+    unlink("/var/tmp/sol-bench.conf");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+#define _POSIX_C_SOURCE 200809L
+#include <getopt.h>
+#include "bench.h"
+
+/*
+ * QoS 1 against QoS 2 at high message rates, against a running broker. A
+ * publisher keeps a window of PUBLISHes in flight on a single topic and a
+ * subscriber acks each one as it comes, both going through the full
+ * exchange of their QoS, PUBACK or PUBREC, PUBREL and PUBCOMP. The rate is
+ * taken once every message has been both acked to the publisher and
+ * delivered. Given the pid of the broker, its CPU time per message is
+ * printed too, the figure that doesn't depend on the speed of the clients.
+ *
+ *   bench_qos [-a host] [-p port] [-q qos] [-n messages] [-w window]
+ *             [-s payload size] [-P broker pid]
+ *
+ * The window should not exceed the max_inflight of the broker.
+ */
+
+#define TOPIC "bench/qos"
+
+int main(int argc, char **argv) {
+    const char *host = BENCH_HOST, *port = BENCH_PORT;
+    unsigned qos = 1;
+    size_t messages = 100000, window = 256, size = 64;
+    pid_t pid = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:q:n:w:s:P:")) != -1) {
+        switch (opt) {
+            case 'a': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'q': qos = atoi(optarg); break;
+            case 'n': messages = strtoul(optarg, NULL, 10); break;
+            case 'w': window = strtoul(optarg, NULL, 10); break;
+            case 's': size = strtoul(optarg, NULL, 10); break;
+            case 'P': pid = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-a host] [-p port] [-q qos] "
+                        "[-n messages] [-w window] [-s size] [-P pid]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (qos < 1 || qos > 2 || window == 0 || window > 65535 ||
+        size > 4096) {
+        fprintf(stderr, "QoS 1 or 2, a window up to 65535, a payload up "
+                "to 4096 bytes\n");
+        return EXIT_FAILURE;
+    }
+    static struct bench_client pub, sub;
+    if (bench_connect(&sub, host, port, "bench-qos-sub", true) < 0 ||
+        bench_subscribe(&sub, TOPIC, qos) < 0 ||
+        bench_connect(&pub, host, port, "bench-qos-pub", true) < 0) {
+        fprintf(stderr, "Unable to connect to %s:%s\n", host, port);
+        return EXIT_FAILURE;
+    }
+    double cpu = pid ? bench_cpu(pid) : 0;
+    double elapsed =
+        bench_pipeline(&pub, &sub, TOPIC, qos, messages, window, size);
+    if (elapsed < 0)
+        return EXIT_FAILURE;
+    printf("qos %u window %5zu: %zu msgs in %.3fs, %.0f msg/s",
+           qos, window, messages, elapsed, messages / elapsed);
+    if (pid)
+        printf(", broker cpu %.1f us/msg",
+               (bench_cpu(pid) - cpu) * 1e6 / messages);
+    printf("\n");
+    bench_disconnect(&pub);
+    bench_disconnect(&sub);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include "bench.h"
+#include "registry.h"
+
+/*
+ * Reconnect storm on the client registry, 1 to 16 threads doing CONNECTs on
+ * random ids out of 100k, each one inserting a new client or taking over the
+ * one already there, and half of them followed by the disconnection of a
+ * clean session, removing it. The sharded registry is compared with a single
+ * HashTable behind a mutex, the alternative of a global lock.
+ */
+
+#define IDS         100000
+#define SECONDS     1
+#define MAX_THREADS 16
+#define ID_SIZE     24
+
+struct client {
+    char id[ID_SIZE];
+};
+
+static struct registry registry;
+static HashTable *table;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool sharded;
+static bool done;
+
+/* The key is the id inside the client, released with it */
+static int client_destroy(struct hashtable_entry *entry) {
+    free(entry->val);
+    return 0;
+}
+
+/*
+ * The id is passed apart from the client, which may be taken over and freed
+ * by another thread as soon as it's inserted
+ */
+static void connect_client(const char *id, struct client *c, bool clean) {
+    if (sharded) {
+        free(registry_get_or_insert(&registry, c->id, c, true));
+        if (clean)
+            registry_del(&registry, id);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    if (hashtable_get(table, c->id))
+        hashtable_del(table, c->id);
+    hashtable_put(table, c->id, c);
+    if (clean)
+        hashtable_del(table, id);
+    pthread_mutex_unlock(&lock);
+}
+
+static void *storm(void *arg) {
+    // Seeded with the number of the thread, the count goes in its place
+    size_t *connects = arg;
+    unsigned seed = *connects;
+    size_t n = 0;
+    char id[ID_SIZE];
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        struct client *c = malloc(sizeof(*c));
+        snprintf(id, sizeof(id), "client-%u", rand_r(&seed) % IDS);
+        memcpy(c->id, id, sizeof(id));
+        connect_client(id, c, rand_r(&seed) & 1);
+        n++;
+    }
+    *connects = n;
+    return NULL;
+}
+
+static void run(unsigned threads) {
+    pthread_t tids[MAX_THREADS];
+    size_t connects[MAX_THREADS], total = 0;
+    struct timespec pause = { SECONDS, 0 };
+    if (sharded)
+        registry_init(&registry, client_destroy);
+    else
+        table = hashtable_create(client_destroy);
+    done = false;
+    for (unsigned i = 0; i < threads; i++) {
+        connects[i] = i + 1;
+        pthread_create(&tids[i], NULL, storm, &connects[i]);
+    }
+    nanosleep(&pause, NULL);
+    __atomic_store_n(&done, true, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        total += connects[i];
+    }
+    printf("%-8s %2u threads  %6.2f M connects/s\n",
+           sharded ? "sharded" : "mutex", threads, total / 1e6 / SECONDS);
+    if (sharded)
+        registry_release(&registry);
+    else
+        hashtable_release(table);
+}
+
+int main(void) {
+    for (int s = 0; s < 2; s++) {
+        sharded = s == 0;
+        for (unsigned threads = 1; threads <= MAX_THREADS; threads *= 2)
+            run(threads);
+    }
+    return 0;
+}
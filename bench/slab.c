@@ -0,0 +1,70 @@
+#define _POSIX_C_SOURCE 200809L
+#include <malloc.h>
+#include "bench.h"
+#include "slab.h"
+
+/*
+ * Slab against malloc for a million objects of 64 bytes, the size of the hot
+ * structures of the broker. Times per allocation, fresh and reusing the ones
+ * freed, per free, and heap bytes held as counted by mallinfo2.
+ */
+
+#define OBJECTS 1000000
+
+struct object {
+    char bytes[64];
+};
+
+static struct slab slab = SLAB_INIT("bench", struct object);
+
+static void *slab_get(void) {
+    return slab_alloc(&slab);
+}
+
+static void slab_put(void *obj) {
+    slab_free(&slab, obj);
+}
+
+static void *malloc_get(void) {
+    return malloc(sizeof(struct object));
+}
+
+static const struct {
+    const char *name;
+    void *(*alloc)(void);
+    void (*free)(void *);
+} allocators[] = {
+    { "slab", slab_get, slab_put },
+    { "malloc", malloc_get, free },
+};
+
+int main(void) {
+    static struct object *objs[OBJECTS];
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(*allocators); a++) {
+        size_t heap = mallinfo2().uordblks;
+        double start = bench_now();
+        for (size_t i = 0; i < OBJECTS; i++) {
+            objs[i] = allocators[a].alloc();
+            objs[i]->bytes[0] = 1;
+        }
+        double alloc = bench_now() - start;
+        heap = mallinfo2().uordblks - heap;
+        start = bench_now();
+        for (size_t i = 0; i < OBJECTS; i++)
+            allocators[a].free(objs[i]);
+        double release = bench_now() - start;
+        start = bench_now();
+        for (size_t i = 0; i < OBJECTS; i++) {
+            objs[i] = allocators[a].alloc();
+            objs[i]->bytes[0] = 1;
+        }
+        double reuse = bench_now() - start;
+        for (size_t i = 0; i < OBJECTS; i++)
+            allocators[a].free(objs[i]);
+        printf("%-7s alloc %5.1f ns, free %5.1f ns, alloc again %5.1f ns, "
+               "heap %.1f MB\n", allocators[a].name, alloc * 1e9 / OBJECTS,
+               release * 1e9 / OBJECTS, reuse * 1e9 / OBJECTS, heap / 1e6);
+    }
+    slab_release(&slab);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#define _POSIX_C_SOURCE 200809L
+#include <getopt.h>
+#include <sys/stat.h>
+#include "bench.h"
+#include "config.h"
+#include "snapshot.h"
+
+/*
+ * Restart time from a snapshot, persistent sessions each subscribed to the
+ * same topics, a million subscriptions by default. The snapshot is written
+ * and loaded back into an empty broker state, timing both. Given a broker
+ * binary, it's also started on the snapshot, timing till it answers a
+ * CONNACK, the time to ready as seen by the clients.
+ *
+ *   bench_snapshot [-c clients] [-t topics] [-f snapshot] [-b broker binary]
+ *                  [-p port]
+ */
+
+static int nop_destructor(struct hashtable_entry *entry) {
+    (void) entry;
+    return 0;
+}
+
+static struct sol *sol_create(void) {
+    struct sol *sol = calloc(1, sizeof(*sol));
+    trie_init(&sol->topics);
+    trie_init(&sol->filters);
+    registry_init(&sol->clients, nop_destructor);
+    return sol;
+}
+
+int main(int argc, char **argv) {
+    const char *path = "/var/tmp/sol-bench.snap", *binary = NULL;
+    const char *port = "18830";
+    size_t clients = 1000, topics = 1000;
+    char buf[128];
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:f:b:p:")) != -1) {
+        switch (opt) {
+            case 'c': clients = strtoul(optarg, NULL, 10); break;
+            case 't': topics = strtoul(optarg, NULL, 10); break;
+            case 'f': path = optarg; break;
+            case 'b': binary = optarg; break;
+            case 'p': port = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-t topics] "
+                        "[-f snapshot] [-b binary] [-p port]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    config_set_default();
+    struct sol *sol = sol_create();
+    struct topic **t = malloc(topics * sizeof(*t));
+    for (size_t i = 0; i < topics; i++) {
+        snprintf(buf, sizeof(buf), "bench/%zu/value/", i);
+        t[i] = topic_create(topic_name(buf, strlen(buf)));
+        sol_topic_put(sol, t[i]);
+    }
+    for (size_t i = 0; i < clients; i++) {
+        struct sol_client *c = calloc(1, sizeof(*c));
+        snprintf(buf, sizeof(buf), "bench-client-%zu", i);
+        c->client_id = strdup(buf);
+        registry_get_or_insert(&sol->clients, c->client_id, c, false);
+        for (size_t j = 0; j < topics; j++)
+            topic_add_subscriber(t[j], c, 1);
+    }
+
+    double start = bench_now();
+    if (snapshot_save(sol, path) < 0) {
+        fprintf(stderr, "Unable to write %s\n", path);
+        return EXIT_FAILURE;
+    }
+    double save = bench_now() - start;
+    struct stat sb;
+    stat(path, &sb);
+
+    struct sol *restored = sol_create();
+    start = bench_now();
+    int loaded = snapshot_load(restored, path);
+    double load = bench_now() - start;
+    if (loaded != (int) clients) {
+        fprintf(stderr, "Restored %d sessions out of %zu\n", loaded, clients);
+        return EXIT_FAILURE;
+    }
+    printf("%zu sessions, %zu subscriptions, snapshot of %.1f MB\n",
+           clients, clients * topics, sb.st_size / 1e6);
+    printf("save %.3fs, load %.3fs\n", save, load);
+
+    if (binary) {
+        char conf[1024], conf_path[512];
+        snprintf(conf_path, sizeof(conf_path), "%s.conf", path);
+        snprintf(conf, sizeof(conf), "snapshot_path %s\n"
+                 "snapshot_interval 1h\nlog_path %s.log\n", path, path);
+        start = bench_now();
+        pid_t pid = bench_broker_start(binary, port, conf_path, conf);
+        if (pid < 0) {
+            fprintf(stderr, "Unable to start %s\n", binary);
+            return EXIT_FAILURE;
+        }
+        // The socket listens before the restore, the CONNACK comes after
+        static struct bench_client c;
+        if (bench_connect(&c, BENCH_HOST, port, "bench-ready", true) < 0) {
+            fprintf(stderr, "No CONNACK from %s\n", binary);
+            bench_broker_stop(pid);
+            return EXIT_FAILURE;
+        }
+        printf("broker ready in %.3fs\n", bench_now() - start);
+        bench_disconnect(&c);
+        bench_broker_stop(pid);
+        unlink(conf_path);
+    }
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+#include <getopt.h>
+#include "bench.h"
+
+/*
+ * A million subscriptions against a running broker, each of a number of
+ * clients subscribing to the same topics, a batch of filters per SUBSCRIBE,
+ * then unsubscribing half of them. Given the pid of the broker, its resident
+ * memory and its CPU time for each phase are printed too.
+ *
+ *   bench_subscriptions [-a host] [-p port] [-c clients] [-t topics]
+ *                       [-P broker pid]
+ */
+
+#define BATCH 100
+
+/* Resident memory of a process in MB, -1 if it can't be read */
+static double rss(pid_t pid) {
+    char path[32], line[128];
+    double kb = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "VmRSS: %lf", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb < 0 ? -1 : kb / 1024;
+}
+
+/*
+ * Send a SUBSCRIBE, or an UNSUBSCRIBE, of topics [first, first + nr) and
+ * wait for its ack
+ */
+static int request(struct bench_client *c, bool subscribe, size_t first,
+                   size_t nr) {
+    static unsigned char buf[BATCH * 32 + 16], payload[BATCH * 32];
+    unsigned char header, *body;
+    size_t len = 0, n;
+    char topic[32];
+    for (size_t i = first; i < first + nr; i++) {
+        snprintf(topic, sizeof(topic), "bench/sub/%zu", i);
+        len += bench_string(payload + len, topic);
+        if (subscribe)
+            payload[len++] = 0;
+    }
+    n = bench_header(buf, subscribe ? 0x82 : 0xA2, len + 2);
+    buf[n++] = 0;
+    buf[n++] = 1;
+    memcpy(buf + n, payload, len);
+    if (bench_write(c->fd, buf, n + len) < 0 ||
+        bench_wait(c, &header, &body, &len) < 0)
+        return -1;
+    return header == (subscribe ? 0x90 : 0xB0) ? 0 : -1;
+}
+
+static int phase(struct bench_client *clients, size_t nr, size_t topics,
+                 bool subscribe, pid_t pid, const char *name) {
+    double cpu = pid ? bench_cpu(pid) : 0, start = bench_now();
+    for (size_t i = 0; i < nr; i++)
+        for (size_t t = 0; t < topics; t += BATCH)
+            if (request(&clients[i], subscribe, t,
+                        topics - t < BATCH ? topics - t : BATCH) < 0) {
+                fprintf(stderr, "Request of client %zu failed\n", i);
+                return -1;
+            }
+    printf("%-18s %zu x %zu in %.2fs", name, nr, topics,
+           bench_now() - start);
+    if (pid)
+        printf(", broker cpu %.2fs, rss %.0f MB", bench_cpu(pid) - cpu,
+               rss(pid));
+    printf("\n");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *host = BENCH_HOST, *port = BENCH_PORT;
+    size_t nr = 1000, topics = 1000;
+    pid_t pid = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:c:t:P:")) != -1) {
+        switch (opt) {
+            case 'a': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': nr = strtoul(optarg, NULL, 10); break;
+            case 't': topics = strtoul(optarg, NULL, 10); break;
+            case 'P': pid = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-a host] [-p port] [-c clients] "
+                        "[-t topics] [-P pid]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    struct bench_client *clients = malloc(nr * sizeof(*clients));
+    char id[32];
+    if (pid)
+        printf("broker rss %.0f MB before\n", rss(pid));
+    for (size_t i = 0; i < nr; i++) {
+        snprintf(id, sizeof(id), "bench-sub-%zu", i);
+        if (bench_connect(&clients[i], host, port, id, true) < 0) {
+            fprintf(stderr, "Unable to connect to %s:%s\n", host, port);
+            return EXIT_FAILURE;
+        }
+    }
+    if (phase(clients, nr, topics, true, pid, "subscribe") < 0 ||
+        phase(clients, nr, topics / 2, false, pid, "unsubscribe half") < 0)
+        return EXIT_FAILURE;
+    for (size_t i = 0; i < nr; i++)
+        bench_disconnect(&clients[i]);
+    free(clients);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+#define _POSIX_C_SOURCE 200809L
+#include <malloc.h>
+#include "bench.h"
+#include "trie.h"
+
+/*
+ * Topic index cost, time per insert and per lookup in random order, and heap
+ * bytes per topic as counted by mallinfo2, for a million topics of each shape
+ * below. The topic strings are built before the measures and not counted,
+ * each is stored as the data of its own key.
+ *
+ *   bench_topics [-n topics]
+ */
+
+struct shape {
+    const char *name;
+    void (*topic)(char *, size_t, size_t);
+};
+
+static void factory(char *buf, size_t size, size_t i) {
+    snprintf(buf, size, "factory/line%zu/dev%zu/metric/", i % 100, i / 100);
+}
+
+/* A random looking uuid for each device, the same on every run */
+static void tenants(char *buf, size_t size, size_t i) {
+    unsigned long long x = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    snprintf(buf, size, "tenants/t%zu/devices/%08llx-%04llx-4%03llx-a%03llx-"
+             "%012llx/telemetry/raw/", i % 100, x >> 32, x >> 16 & 0xFFFF,
+             x >> 4 & 0xFFF, x >> 40 & 0xFFF, x & 0xFFFFFFFFFFFFULL);
+}
+
+static void devices(char *buf, size_t size, size_t i) {
+    unsigned long long x = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    snprintf(buf, size, "devices/%016llx/", x);
+}
+
+/* Wide fan-out at the root and a few metrics under each device */
+static void metrics4(char *buf, size_t size, size_t i) {
+    snprintf(buf, size, "devices/d%zu/m%zu/", i / 4, i % 4);
+}
+
+static void metrics12(char *buf, size_t size, size_t i) {
+    snprintf(buf, size, "devices/d%zu/m%zu/", i / 12, i % 12);
+}
+
+static const struct shape shapes[] = {
+    { "factory/lineN/devN/metric/", factory },
+    { "tenants/tN/devices/<uuid>/telemetry/raw/", tenants },
+    { "devices/<id>/", devices },
+    { "devices/dN/mK/, 4 per device", metrics4 },
+    { "devices/dN/mK/, 12 per device", metrics12 },
+};
+
+static void run(const struct shape *shape, size_t nr) {
+    char **topics = malloc(nr * sizeof(*topics)), buf[128];
+    size_t *order = malloc(nr * sizeof(*order));
+    unsigned seed = 42;
+    void *data;
+    for (size_t i = 0; i < nr; i++) {
+        shape->topic(buf, sizeof(buf), i);
+        topics[i] = strdup(buf);
+        order[i] = i;
+    }
+    for (size_t i = nr - 1; i > 0; i--) {
+        size_t j = rand_r(&seed) % (i + 1), tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    size_t heap = mallinfo2().uordblks;
+    double start = bench_now();
+    Trie *trie = trie_create();
+    for (size_t i = 0; i < nr; i++)
+        trie_insert(trie, topics[i], topics[i]);
+    double insert = bench_now() - start;
+    heap = mallinfo2().uordblks - heap;
+    size_t found = 0;
+    start = bench_now();
+    for (size_t i = 0; i < nr; i++)
+        found += trie_find(trie, topics[order[i]], &data);
+    double lookup = bench_now() - start;
+    printf("%-42s insert %5.0f ns, lookup %5.0f ns, %4.0f B/topic, "
+           "%zu nodes\n", shape->name, insert * 1e9 / nr, lookup * 1e9 / nr,
+           (double) heap / nr, trie_nodes());
+    if (found != nr)
+        fprintf(stderr, "%zu of %zu topics found\n", found, nr);
+    // The trie owns the strings stored as data
+    trie_release(trie);
+    free(topics);
+    free(order);
+}
+
+int main(int argc, char **argv) {
+    size_t nr = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            fprintf(stderr, "Usage: %s [-n topics]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        nr = strtoul(optarg, NULL, 10);
+    }
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(*shapes); i++)
+        run(&shapes[i], nr);
+    return 0;
+}
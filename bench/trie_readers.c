@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "ebr.h"
+#include "trie.h"
+
+/*
+ * Read scalability of the topic index, 1 to 32 threads looking up topics
+ * while a writer keeps inserting and deleting others, a read-mostly load
+ * like publishes against subscriptions coming and going. Readers run either
+ * inside epoch sections, lock-free, or under a read-write lock, the
+ * alternative of a global lock around the trie.
+ */
+
+#define TOPICS      100000
+#define SECONDS     1
+#define MAX_THREADS 32
+
+static Trie *trie;
+static bool done;
+static bool locked;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void topic_of(unsigned i, char *buf, size_t size) {
+    snprintf(buf, size, "site/%u/dev/%u/temp/", i % 100, i);
+}
+
+static void *reader(void *arg) {
+    // Seeded with the number of the thread, the count goes in its place
+    size_t *lookups = arg;
+    unsigned seed = *lookups;
+    size_t n = 0;
+    char topic[64];
+    void *data;
+    ebr_register();
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        topic_of(rand_r(&seed) % TOPICS, topic, sizeof(topic));
+        if (locked) {
+            pthread_rwlock_rdlock(&lock);
+            trie_find(trie, topic, &data);
+            pthread_rwlock_unlock(&lock);
+        } else {
+            ebr_enter();
+            trie_find(trie, topic, &data);
+            ebr_exit();
+        }
+        n++;
+    }
+    ebr_unregister();
+    *lookups = n;
+    return NULL;
+}
+
+/* Churn the topics past the first half, one change every 10 us */
+static void *writer(void *arg) {
+    unsigned seed = 42, i;
+    char topic[64];
+    struct timespec pause = { 0, 10000 };
+    (void) arg;
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        i = TOPICS / 2 + rand_r(&seed) % (TOPICS / 2);
+        topic_of(i, topic, sizeof(topic));
+        if (locked)
+            pthread_rwlock_wrlock(&lock);
+        void *data;
+        if (trie_find(trie, topic, &data))
+            trie_delete(trie, topic);
+        else
+            trie_insert(trie, topic, malloc(1));
+        ebr_collect();
+        if (locked)
+            pthread_rwlock_unlock(&lock);
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+static double run(int threads) {
+    pthread_t readers[MAX_THREADS], w;
+    size_t lookups[MAX_THREADS], total = 0;
+    struct timespec run = { SECONDS, 0 };
+    done = false;
+    for (int t = 0; t < threads; t++) {
+        lookups[t] = t + 1;
+        pthread_create(&readers[t], NULL, reader, &lookups[t]);
+    }
+    pthread_create(&w, NULL, writer, NULL);
+    nanosleep(&run, NULL);
+    __atomic_store_n(&done, true, __ATOMIC_RELAXED);
+    pthread_join(w, NULL);
+    for (int t = 0; t < threads; t++) {
+        pthread_join(readers[t], NULL);
+        total += lookups[t];
+    }
+    return total / (double) SECONDS;
+}
+
+int main(void) {
+    char topic[64];
+    trie = trie_create();
+    for (unsigned i = 0; i < TOPICS; i++) {
+        topic_of(i, topic, sizeof(topic));
+        trie_insert(trie, topic, malloc(1));
+    }
+    printf("threads    epochs lookups/s    rwlock lookups/s\n");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        locked = false;
+        double lockfree = run(threads);
+        locked = true;
+        double rwlock = run(threads);
+        printf("%7d %20.0f %19.0f\n", threads, lockfree, rwlock);
+    }
+    while (ebr_pending() > 0)
+        ebr_collect();
+    trie_release(trie);
+    return 0;
+}
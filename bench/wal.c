@@ -0,0 +1,107 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "bench.h"
+
+/*
+ * Durable QoS 1 throughput against the WAL commit window. For each window a
+ * broker is started with a fresh log, a persistent subscriber, so that its
+ * deliveries are logged, and a publisher keeping messages in flight run
+ * through it, and it's killed. The last row runs without a WAL.
+ *
+ *   bench_wal [-b broker binary] [-d scratch dir] [-p port] [-n messages]
+ *             [-s payload size]
+ *
+ * The scratch directory should be on the disk to measure, a tmpfs makes
+ * the fdatasync free.
+ */
+
+#define TOPIC "bench/wal"
+
+static const int commit_windows[] = { 0, 1, 2, 5, 10, -1 };
+
+static const size_t inflight[] = { 256, 1024 };
+
+/* Remove the segments left by the previous run */
+static void clear_dir(const char *path) {
+    char file[512];
+    DIR *dir = opendir(path);
+    struct dirent *e;
+    if (!dir)
+        return;
+    while ((e = readdir(dir)))
+        if (e->d_name[0] != '.' &&
+            snprintf(file, sizeof(file), "%s/%s", path, e->d_name)
+            < (int) sizeof(file))
+            unlink(file);
+    closedir(dir);
+}
+
+static double run(const char *binary, const char *dir, const char *port,
+                  int commit_window, size_t window, size_t messages,
+                  size_t size) {
+    char conf[1024], path[512], wal[512];
+    static struct bench_client pub, sub;
+    snprintf(wal, sizeof(wal), "%s/wal", dir);
+    clear_dir(wal);
+    snprintf(path, sizeof(path), "%s/bench.conf", dir);
+    int n = snprintf(conf, sizeof(conf),
+                     "log_path %s/sol.log\nmax_inflight 65535\n", dir);
+    if (commit_window >= 0)
+        snprintf(conf + n, sizeof(conf) - n,
+                 "wal_path %s\nwal_commit_window %d\n", wal, commit_window);
+    pid_t pid = bench_broker_start(binary, port, path, conf);
+    if (pid < 0) {
+        fprintf(stderr, "Unable to start %s\n", binary);
+        exit(EXIT_FAILURE);
+    }
+    double elapsed = -1;
+    if (bench_connect(&sub, BENCH_HOST, port, "bench-wal-sub", false) >= 0 &&
+        bench_subscribe(&sub, TOPIC, 1) == 0 &&
+        bench_connect(&pub, BENCH_HOST, port, "bench-wal-pub", true) >= 0)
+        elapsed = bench_pipeline(&pub, &sub, TOPIC, 1, messages, window, size);
+    close(pub.fd);
+    close(sub.fd);
+    bench_broker_stop(pid);
+    return elapsed < 0 ? 0 : messages / elapsed;
+}
+
+int main(int argc, char **argv) {
+    const char *binary = "./sol", *dir = "/var/tmp/sol-bench-wal";
+    const char *port = "18830";
+    size_t messages = 20000, size = 64;
+    char wal[512];
+    int opt;
+    while ((opt = getopt(argc, argv, "b:d:p:n:s:")) != -1) {
+        switch (opt) {
+            case 'b': binary = optarg; break;
+            case 'd': dir = optarg; break;
+            case 'p': port = optarg; break;
+            case 'n': messages = strtoul(optarg, NULL, 10); break;
+            case 's': size = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-b binary] [-d dir] [-p port] "
+                        "[-n messages] [-s size]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    snprintf(wal, sizeof(wal), "%s/wal", dir);
+    mkdir(dir, 0700);
+    mkdir(wal, 0700);
+    printf("wal_commit_window  %zu in flight   %zu in flight\n",
+           inflight[0], inflight[1]);
+    for (size_t i = 0; i < sizeof(commit_windows) / sizeof(int); i++) {
+        if (commit_windows[i] < 0)
+            printf("no WAL           ");
+        else
+            printf("%2d ms            ", commit_windows[i]);
+        for (size_t j = 0; j < sizeof(inflight) / sizeof(size_t); j++)
+            printf(" %9.0f msg/s",
+                   run(binary, dir, port, commit_windows[i], inflight[j],
+                       messages, size));
+        printf("\n");
+    }
+    clear_dir(wal);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "core.h"
+
+/*
+ * Topic creation under a growing number of wildcard subscriptions, each new
+ * topic is stored and subscribed by the filters matching it. Most filters
+ * match none of the topics, like those of devices subscribing to their own
+ * subtree, and a couple match all of them.
+ */
+
+#define TOPICS      20000
+#define CLIENTS     64
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(size_t filters) {
+    struct sol *sol = calloc(1, sizeof(*sol));
+    struct sol_client *clients = calloc(CLIENTS, sizeof(*clients));
+    char buf[64];
+    trie_init(&sol->topics);
+    trie_init(&sol->filters);
+    for (size_t i = 0; i < filters; i++) {
+        if (i % 2)
+            snprintf(buf, sizeof(buf), "dev/%zu/+/temp", i);
+        else
+            snprintf(buf, sizeof(buf), "site/%zu/#", i);
+        sol_wildcard_add(sol, buf, &clients[i % CLIENTS], 0);
+    }
+    sol_wildcard_add(sol, "t/+/x", &clients[0], 0);
+    sol_wildcard_add(sol, "t/#", &clients[1], 0);
+    double start = now();
+    for (size_t i = 0; i < TOPICS; i++) {
+        snprintf(buf, sizeof(buf), "t/%zu/x/", i);
+        sol_topic_put(sol, topic_create(topic_name(buf, strlen(buf))));
+    }
+    double elapsed = now() - start;
+    printf("%8zu filters  %10.0f topics/s  %8.2f us/topic\n",
+           filters, TOPICS / elapsed, elapsed * 1e6 / TOPICS);
+}
+
+int main(void) {
+    config_set_default();
+    for (size_t filters = 10; filters <= 100000; filters *= 10)
+        run(filters);
+    return 0;
+}
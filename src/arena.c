@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <stdalign.h>
+#include "arena.h"
+
+#define ALIGN(size, a)  (((size) + (a) - 1) & ~((size_t) (a) - 1))
+
+/* Blocks are linked from the last allocated, the first one comes last */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    alignas(max_align_t) unsigned char data[];
+};
+
+static struct arena_block *arena_block_create(size_t size,
+                                              struct arena_block *next) {
+    struct arena_block *b = malloc(sizeof(*b) + size);
+    if (!b)
+        return NULL;
+    b->next = next;
+    b->size = size;
+    return b;
+}
+
+void arena_init(struct arena *a, size_t size) {
+    a->blocks = arena_block_create(size, NULL);
+    a->used = 0;
+    a->spilled = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = ALIGN(size, alignof(max_align_t));
+    if (a->used + size > a->blocks->size) {
+        // Doubling, so that a packet spills over a few blocks at most
+        size_t bsize = a->blocks->size * 2;
+        if (bsize < size)
+            bsize = size;
+        struct arena_block *b = arena_block_create(bsize, a->blocks);
+        if (!b)
+            return NULL;
+        a->spilled += a->used;
+        a->blocks = b;
+        a->used = 0;
+    }
+    void *ptr = a->blocks->data + a->used;
+    a->used += size;
+    return ptr;
+}
+
+void arena_reset(struct arena *a) {
+    if (a->blocks->next) {
+        size_t size = a->spilled + a->used;
+        while (a->blocks) {
+            struct arena_block *b = a->blocks;
+            a->blocks = b->next;
+            free(b);
+        }
+        a->blocks = arena_block_create(size, NULL);
+    }
+    a->used = 0;
+    a->spilled = 0;
+}
+
+void arena_release(struct arena *a) {
+    while (a->blocks) {
+        struct arena_block *b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    a->used = 0;
+    a->spilled = 0;
+}
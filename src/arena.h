@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Region allocator for objects sharing the same lifetime, e.g. the fields of
+ * a decoded packet. Allocations bump an offset in a block, there's no free of
+ * single objects, a reset gives back everything at once, in O(1) when all
+ * the allocations fit in the first block. Past it, more blocks are chained
+ * and released on reset, the first block then grows to the size reached, so
+ * that the next round of the same size fits in it.
+ */
+struct arena_block;
+
+struct arena {
+    struct arena_block *blocks;
+    size_t used;
+    /* Bytes allocated in the blocks before the last one, since the reset */
+    size_t spilled;
+};
+
+void arena_init(struct arena *, size_t);
+
+/* Allocate a given number of bytes, aligned for any type */
+void *arena_alloc(struct arena *, size_t);
+
+/* Give back all the allocations made since the last reset */
+void arena_reset(struct arena *);
+
+void arena_release(struct arena *);
+
+#endif
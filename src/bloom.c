@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include "bloom.h"
+
+/* Bits of the filter for each key it is sized for */
+#define BLOOM_BITS_PER_KEY  16
+
+#define BLOOM_MIN_WORDS     64
+
+/* Bits set in the word of a hash, taken from its high 24 bits */
+#define BLOOM_BITS(h) ((1ULL << (((h) >> 40) & 63)) | \
+                       (1ULL << (((h) >> 46) & 63)) | \
+                       (1ULL << (((h) >> 52) & 63)) | \
+                       (1ULL << (((h) >> 58) & 63)))
+
+struct bloom *bloom_create(size_t keys) {
+    size_t words = BLOOM_MIN_WORDS;
+    while (words * 64 < keys * BLOOM_BITS_PER_KEY)
+        words <<= 1;
+    struct bloom *b = calloc(1, sizeof(*b) + words * sizeof(uint64_t));
+    b->mask = words - 1;
+    b->keys = 0;
+    return b;
+}
+
+void bloom_release(struct bloom *b) {
+    free(b);
+}
+
+void bloom_add(struct bloom *b, uint64_t hash) {
+    b->words[hash & b->mask] |= BLOOM_BITS(hash);
+    b->keys++;
+}
+
+bool bloom_test(const struct bloom *b, uint64_t hash) {
+    uint64_t bits = BLOOM_BITS(hash);
+    return (b->words[hash & b->mask] & bits) == bits;
+}
+
+bool bloom_full(const struct bloom *b) {
+    return b->keys * BLOOM_BITS_PER_KEY > (b->mask + 1) * 64;
+}
@@ -0,0 +1,34 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Blocked bloom filter over 64 bit hashes, the low bits of a hash select a
+ * single 64 bit word and 4 groups of 6 of the high bits select the bits to
+ * set in it, so that an add or a test touch one word only. Sized at 16 bits
+ * per key the false positive rate stays under 1%, keys can't be removed, the
+ * filter is to be rebuilt from scratch instead.
+ */
+struct bloom {
+    uint64_t mask;
+    size_t keys;
+    uint64_t words[];
+};
+
+/* Create an empty filter with room for a given number of keys */
+struct bloom *bloom_create(size_t);
+
+void bloom_release(struct bloom *);
+
+void bloom_add(struct bloom *, uint64_t);
+
+/* Return true if the hash may have been added, false if it surely wasn't */
+bool bloom_test(const struct bloom *, uint64_t);
+
+/* Return true if more keys than the filter was sized for were added */
+bool bloom_full(const struct bloom *);
+
+#endif
@@ -165,6 +165,54 @@ static void add_config_value(const char *key, const char *value) {
         config.tcp_backlog = tcp_backlog <= SOMAXCONN ? tcp_backlog : SOMAXCONN;
     } else if (STREQ("stats_publish_interval", key, klen) == true) {
         config.stats_pub_interval = read_time_with_mul(value);
+    } else if (STREQ("max_inflight", key, klen) == true) {
+        int max_inflight = parse_int(value);
+        config.max_inflight = max_inflight > 0 ? max_inflight : 1;
+    } else if (STREQ("retry_interval", key, klen) == true) {
+        config.retry_interval = read_time_with_mul(value);
+    } else if (STREQ("max_queued_messages", key, klen) == true) {
+        config.max_queued_messages = parse_int(value);
+    } else if (STREQ("max_queued_bytes", key, klen) == true) {
+        config.max_queued_bytes = read_memory_with_mul(value);
+    } else if (STREQ("max_output_bytes", key, klen) == true) {
+        config.max_output_bytes = read_memory_with_mul(value);
+    } else if (STREQ("queue_policy", key, klen) == true) {
+        if (STREQ("drop_newest", value, vlen) == true)
+            config.queue_policy = DROP_NEWEST;
+        else
+            config.queue_policy = DROP_OLDEST;
+    } else if (STREQ("spill_path", key, klen) == true) {
+        strcpy(config.spill_path, value);
+    } else if (STREQ("wal_path", key, klen) == true) {
+        strcpy(config.wal_path, value);
+    } else if (STREQ("wal_segment_size", key, klen) == true) {
+        config.wal_segment_size = read_memory_with_mul(value);
+    } else if (STREQ("wal_commit_window", key, klen) == true) {
+        int window = parse_int(value);
+        config.wal_commit_window = window > 0 ? window : 0;
+    } else if (STREQ("snapshot_path", key, klen) == true) {
+        strcpy(config.snapshot_path, value);
+    } else if (STREQ("snapshot_interval", key, klen) == true) {
+        config.snapshot_interval = read_time_with_mul(value);
+    } else if (STREQ("message_expiry", key, klen) == true) {
+        config.message_expiry = read_time_with_mul(value);
+    } else if (STREQ("topic_expiry", key, klen) == true) {
+        // In the form <topic-prefix>:<time>, the last ':' splits the two
+        const char *sep = strrchr(value, ':');
+        if (!sep || sep == value ||
+            config.topic_expiry_nr == MAX_TOPIC_EXPIRY) {
+            sol_warning("WARNING: Ignoring topic_expiry %s", value);
+            return;
+        }
+        int i = config.topic_expiry_nr++;
+        snprintf(config.topic_expiry[i].prefix,
+                 sizeof(config.topic_expiry[i].prefix),
+                 "%.*s", (int) (sep - value), value);
+        config.topic_expiry[i].expiry = read_time_with_mul(sep + 1);
+    } else if (STREQ("topic_gc_idle", key, klen) == true) {
+        config.topic_gc_idle = read_time_with_mul(value);
+    } else if (STREQ("hugepages", key, klen) == true) {
+        config.hugepages = STREQ("true", value, vlen);
     }
 }
 
@@ -236,6 +284,22 @@ void config_set_default(void) {
     config.max_request_size = read_memory_with_mul(DEFAULT_MAX_REQUEST_SIZE);
     config.tcp_backlog = SOMAXCONN;
     config.stats_pub_interval = read_time_with_mul(DEFAULT_STATS_INTERVAL);
+    config.max_inflight = DEFAULT_MAX_INFLIGHT;
+    config.retry_interval = read_time_with_mul(DEFAULT_RETRY_INTERVAL);
+    config.max_queued_messages = DEFAULT_MAX_QUEUED_MESSAGES;
+    config.max_queued_bytes = read_memory_with_mul(DEFAULT_MAX_QUEUED_BYTES);
+    config.max_output_bytes = read_memory_with_mul(DEFAULT_MAX_OUTPUT_BYTES);
+    config.queue_policy = DROP_OLDEST;
+    strcpy(config.spill_path, DEFAULT_SPILL_PATH);
+    config.wal_path[0] = '\0';
+    config.wal_segment_size = read_memory_with_mul(DEFAULT_WAL_SEGMENT_SIZE);
+    config.wal_commit_window = DEFAULT_WAL_COMMIT_WINDOW;
+    config.snapshot_path[0] = '\0';
+    config.snapshot_interval = read_time_with_mul(DEFAULT_SNAPSHOT_INTERVAL);
+    config.message_expiry = read_time_with_mul(DEFAULT_MESSAGE_EXPIRY);
+    config.topic_expiry_nr = 0;
+    config.topic_gc_idle = read_time_with_mul(DEFAULT_TOPIC_GC_IDLE);
+    config.hugepages = false;
 }
 
 void config_print(void) {
@@ -263,7 +327,51 @@ void config_print(void) {
         sol_info("\tlogpath: %s", config.logpath);
         const char *human_memory = memory_to_string(config.max_memory);
         sol_info("Max memory: %s", human_memory);
+        sol_info("Max in-flight messages: %lu", config.max_inflight);
+        const char *human_qbytes = memory_to_string(config.max_queued_bytes);
+        sol_info("Session queues:");
+        sol_info("\tmax messages: %lu", config.max_queued_messages);
+        sol_info("\tmax size: %s", human_qbytes);
+        sol_info("\tpolicy: %s", config.queue_policy == DROP_NEWEST ?
+                 "drop_newest" : "drop_oldest");
+        sol_info("\tspill path: %s", config.spill_path);
+        const char *human_obytes = memory_to_string(config.max_output_bytes);
+        sol_info("Max pending output: %s", human_obytes);
+        if (config.wal_path[0] != '\0') {
+            const char *human_wseg = memory_to_string(config.wal_segment_size);
+            sol_info("Write-ahead log:");
+            sol_info("\tpath: %s", config.wal_path);
+            sol_info("\tsegment size: %s", human_wseg);
+            sol_info("\tcommit window: %lu ms", config.wal_commit_window);
+            free((char *) human_wseg);
+        }
+        sol_info("Message expiry: %lu s", config.message_expiry);
+        for (int i = 0; i < config.topic_expiry_nr; i++)
+            sol_info("\t%s: %lu s", config.topic_expiry[i].prefix,
+                     config.topic_expiry[i].expiry);
+        sol_info("Unused topics kept for: %lu s", config.topic_gc_idle);
+        sol_info("Huge pages for I/O buffers: %s",
+                 config.hugepages ? "true" : "false");
+        if (config.snapshot_path[0] != '\0') {
+            sol_info("Snapshots:");
+            sol_info("\tpath: %s", config.snapshot_path);
+            sol_info("\tinterval: %lu s", config.snapshot_interval);
+        }
+        free((char *) human_qbytes);
         free((char *) human_memory);
         free((char *) human_rsize);
     }
 }
+
+size_t config_message_expiry(const char *topic) {
+    size_t expiry = config.message_expiry, matched = 0, len;
+    for (int i = 0; i < config.topic_expiry_nr; i++) {
+        len = strlen(config.topic_expiry[i].prefix);
+        if (len > matched &&
+            strncmp(topic, config.topic_expiry[i].prefix, len) == 0) {
+            expiry = config.topic_expiry[i].expiry;
+            matched = len;
+        }
+    }
+    return expiry;
+}
@@ -2,6 +2,7 @@
 #define CONFIG_H
 
 #include <stdio.h>
+#include <stdbool.h>
 
 // Default parameters
 #define VERSION                     "0.0.1"
@@ -14,6 +15,24 @@
 #define DEFAULT_MAX_MEMORY          "2GB"
 #define DEFAULT_MAX_REQUEST_SIZE    "2MB"
 #define DEFAULT_STATS_INTERVAL      "10s"
+#define DEFAULT_MAX_INFLIGHT        32
+#define DEFAULT_RETRY_INTERVAL      "20s"
+#define DEFAULT_MAX_QUEUED_MESSAGES 1000
+#define DEFAULT_MAX_QUEUED_BYTES    "16MB"
+#define DEFAULT_MAX_OUTPUT_BYTES    "16MB"
+#define DEFAULT_SPILL_PATH          "/var/tmp"
+#define DEFAULT_WAL_SEGMENT_SIZE    "64MB"
+#define DEFAULT_WAL_COMMIT_WINDOW   0
+#define DEFAULT_SNAPSHOT_INTERVAL   "60s"
+#define DEFAULT_MESSAGE_EXPIRY      "0s"
+#define DEFAULT_TOPIC_GC_IDLE       "5m"
+
+/* Max number of per-topic message expiry overrides */
+#define MAX_TOPIC_EXPIRY 16
+
+/* Policies to be applied when a session queue reaches its limits */
+#define DROP_OLDEST 0
+#define DROP_NEWEST 1
 
 struct config {
     /* Sol version <MAJOR.MINOR.PATCH> */
@@ -43,6 +62,47 @@ struct config {
     int tcp_backlog;
     /* Delay between every automatic publish of broker stats on topic */
     size_t stats_pub_interval;
+    /* Max number of QoS > 0 messages in-flight for each client, others will
+     * be queued till an ack frees a slot */
+    size_t max_inflight;
+    /* Seconds before an unacknowledged message is re-sent with DUP flag */
+    size_t retry_interval;
+    /* Limits of the message queue of each client session, both for offline
+     * clients and for messages exceeding the in-flight window */
+    size_t max_queued_messages;
+    size_t max_queued_bytes;
+    /* Bytes of PUBLISH packets a connection can have pending on its output,
+     * past which new ones are dropped for slow subscribers */
+    size_t max_output_bytes;
+    /* Policy applied on full queues, dropping oldest or newest messages */
+    int queue_policy;
+    /* Directory for the spill files of queues under memory pressure */
+    char spill_path[0xFF];
+    /* Directory of the write-ahead log of QoS > 0 messages, an empty path
+     * disables it */
+    char wal_path[0xFF];
+    /* Size after which the WAL rolls over a new segment */
+    size_t wal_segment_size;
+    /* Milliseconds to wait collecting WAL records before a commit, 0 commits
+     * once for each iteration of the event loop */
+    size_t wal_commit_window;
+    /* Snapshot file of topics and persistent sessions, an empty path
+     * disables snapshots */
+    char snapshot_path[0xFF];
+    /* Seconds between one snapshot and the next */
+    size_t snapshot_interval;
+    /* Seconds a queued message lives before being discarded, 0 for never */
+    size_t message_expiry;
+    /* Per-topic overrides of the message expiry, matched by topic prefix */
+    struct {
+        char prefix[0xFF];
+        size_t expiry;
+    } topic_expiry[MAX_TOPIC_EXPIRY];
+    int topic_expiry_nr;
+    /* Seconds a topic without subscribers is kept after its last message */
+    size_t topic_gc_idle;
+    /* Back the pools of the largest I/O buffers with huge pages, if reserved */
+    bool hugepages;
 };
 
 extern struct config *conf;
@@ -51,6 +111,12 @@ void config_set_default(void);
 void config_print(void);
 int config_load(const char *);
 
+/*
+ * Expiry in seconds of messages published on a topic, taken from the longest
+ * matching per-topic override or from the broker default
+ */
+size_t config_message_expiry(const char *);
+
 char *time_to_string(size_t);
 char *memory_to_string(size_t);
 
@@ -1,10 +1,42 @@
+#define _DEFAULT_SOURCE
 #include <string.h>
 #include <stdlib.h>
+#include "ebr.h"
+#include "hash.h"
+#include "slab.h"
+#include "wal.h"
+#include "config.h"
 #include "core.h"
 
-static int compare_cid(void *c1, void *c2) {
-    return strcmp(((struct subscriber *) c1)->client->client_id,
-                  ((struct subscriber *) c2)->client->client_id);
+/* Max number of slots of an in-flight window, half of the packet id space */
+#define INFLIGHT_MAX_SIZE 32768
+
+#define INFLIGHT_TAKEN(w, i) (((w)->bitmap[(i) / 64] >> ((i) % 64)) & 1)
+
+/* Initial number of buckets of a packet id set */
+#define PKTID_SET_INITIAL_SIZE 8
+
+/* Initial number of buckets of the subscriptions index of a session */
+#define SUBSCRIPTION_INDEX_INITIAL_SIZE 8
+
+/* Initial number of slots of the topic ids table */
+#define TOPIC_IDS_INITIAL_SIZE 64
+
+/* Deleted topics and wildcards tolerated in the filter before a rebuild */
+#define TOPIC_FILTER_MIN_STALE 64
+
+/* Tells apart the keys of wildcard prefixes from those of topic names */
+#define WILDCARD_SALT 0x9e3779b97f4a7c15ULL
+
+/* Links followed by publishes are stored with release semantics */
+#define PUBLISH(ptr, val)   __atomic_store_n(&(ptr), (val), __ATOMIC_RELEASE)
+
+/* Subscriptions and clients come and go with each connection */
+static struct slab subscribers = SLAB_INIT("subscribers", struct subscriber);
+static struct slab clients = SLAB_INIT("clients", struct sol_client);
+
+static void subscriber_free(void *sub) {
+    slab_free(&subscribers, sub);
 }
 
 struct topic *topic_create(const char *name) {
@@ -14,38 +46,479 @@ struct topic *topic_create(const char *name) {
 }
 
 void topic_init(struct topic *t, const char *name) {
+    t->id = TOPIC_ID_NONE;
     t->name = name;
-    t->subscribers = list_create(NULL);
+    // Length of the name alone, without the trailing '/'
+    t->len = strlen(name);
+    if (t->len > 0 && name[t->len - 1] == '/')
+        t->len--;
+    t->subscribers = NULL;
+    t->expiry = config_message_expiry(name);
+    t->last_used = time(NULL);
+}
+
+char *topic_name(const char *topic, size_t len) {
+    if (len > 0 && topic[len - 1] == '/')
+        len--;
+    char *name = malloc(len + 2);
+    memcpy(name, topic, len);
+    name[len] = '/';
+    name[len + 1] = '\0';
+    return name;
+}
+
+static bool topic_name_eq(const struct topic *t, const char *name, size_t len) {
+    if (len > 0 && name[len - 1] == '/')
+        len--;
+    return t->len == len && memcmp(t->name, name, len) == 0;
+}
+
+static uint32_t topic_id_acquire(struct topic_ids *ids, struct topic *t) {
+    uint32_t id;
+    if (ids->free_nr > 0) {
+        id = ids->free[--ids->free_nr];
+    } else {
+        id = ++ids->next;
+        if (id >= ids->size) {
+            ids->size = ids->size ? ids->size * 2 : TOPIC_IDS_INITIAL_SIZE;
+            ids->topics = realloc(ids->topics,
+                                  ids->size * sizeof(*ids->topics));
+            ids->free = realloc(ids->free, ids->size * sizeof(*ids->free));
+            ids->topics[TOPIC_ID_NONE] = NULL;
+        }
+    }
+    ids->topics[id] = t;
+    return id;
+}
+
+static void topic_id_release(struct topic_ids *ids, uint32_t id) {
+    ids->topics[id] = NULL;
+    ids->free[ids->free_nr++] = id;
+}
+
+/*
+ * Home bucket of a topic id, ids are dense, masked as they are they would
+ * fill a run of contiguous buckets, making every probe and deletion walk it
+ */
+static inline unsigned subscription_index_home(uint32_t id, unsigned mask) {
+    uint32_t h = id * 0x9E3779B1U;
+    return (h ^ (h >> 16)) & mask;
+}
+
+/* Return the bucket storing the topic id or the empty one where it goes */
+static unsigned subscription_index_lookup(const struct subscription_index *idx,
+                                          uint32_t id) {
+    unsigned i = subscription_index_home(id, idx->size - 1);
+    while (idx->subs[i] && idx->subs[i]->topic->id != id)
+        i = (i + 1) & (idx->size - 1);
+    return i;
+}
+
+/* Double the buckets keeping the load factor under 3/4 */
+static void subscription_index_grow(struct subscription_index *idx) {
+    struct subscriber **old = idx->subs;
+    unsigned old_size = idx->size;
+    idx->size *= 2;
+    idx->subs = calloc(idx->size, sizeof(*idx->subs));
+    for (unsigned i = 0; i < old_size; i++)
+        if (old[i])
+            idx->subs[subscription_index_lookup(idx, old[i]->topic->id)] =
+                old[i];
+    free(old);
+}
+
+static void subscription_index_add(struct session *s, struct subscriber *sub) {
+    if (!s->index) {
+        s->index = malloc(sizeof(*s->index));
+        s->index->size = SUBSCRIPTION_INDEX_INITIAL_SIZE;
+        s->index->nr = 0;
+        s->index->subs = calloc(s->index->size, sizeof(*s->index->subs));
+    }
+    struct subscription_index *idx = s->index;
+    idx->subs[subscription_index_lookup(idx, sub->topic->id)] = sub;
+    if (++idx->nr * 4 >= idx->size * 3)
+        subscription_index_grow(idx);
+}
+
+/* Backward shift deletion, as for the packet ids set */
+static void subscription_index_del(struct subscription_index *idx,
+                                   const struct subscriber *sub) {
+    unsigned mask = idx->size - 1;
+    unsigned i = subscription_index_lookup(idx, sub->topic->id);
+    if (idx->subs[i] != sub)
+        return;
+    idx->subs[i] = NULL;
+    idx->nr--;
+    for (unsigned j = (i + 1) & mask; idx->subs[j]; j = (j + 1) & mask) {
+        unsigned home = subscription_index_home(idx->subs[j]->topic->id, mask);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            idx->subs[i] = idx->subs[j];
+            idx->subs[j] = NULL;
+            i = j;
+        }
+    }
 }
 
-void topic_add_subscriber(struct topic *t,
-                          struct sol_client *client,
-                          unsigned qos,
-                          bool cleansession) {
-    struct subscriber *sub = malloc(sizeof(*sub));
+/* Link a new subscription in the subscribers of a topic */
+static struct subscriber *subscriber_link(struct topic *t,
+                                          struct sol_client *client,
+                                          unsigned qos) {
+    struct subscriber *sub = slab_alloc(&subscribers);
     sub->client = client;
     sub->qos = qos;
-    t->subscribers = list_push(t->subscribers, sub);
-    // It must be added to the session if cleansession is false
-    if (!cleansession)
-        client->session.subscriptions =
-            list_push(client->session.subscriptions, t);
+    sub->topic = t;
+    sub->wildcard = NULL;
+    sub->prev = NULL;
+    sub->next = t->subscribers;
+    if (t->subscribers)
+        t->subscribers->prev = sub;
+    // Fully linked before a publish can reach it
+    PUBLISH(t->subscribers, sub);
+    sub->client_prev = NULL;
+    return sub;
+}
+
+struct subscriber *topic_add_subscriber(struct topic *t,
+                                        struct sol_client *client,
+                                        unsigned qos) {
+    struct subscriber *sub = subscriber_link(t, client, qos);
+    struct session *s = &client->session;
+    sub->client_next = s->subscriptions;
+    if (s->subscriptions)
+        s->subscriptions->client_prev = sub;
+    s->subscriptions = sub;
+    subscription_index_add(s, sub);
+    return sub;
+}
+
+/* Subscribe the client of a wildcard subscription to a topic it matches */
+static void wildcard_add_subscriber(struct topic *t, struct wildcard *w) {
+    struct subscriber *sub = subscriber_link(t, w->client, w->qos);
+    sub->wildcard = w;
+    sub->client_next = w->subscriptions;
+    if (w->subscriptions)
+        w->subscriptions->client_prev = sub;
+    w->subscriptions = sub;
+}
+
+void topic_del_subscriber(struct subscriber *sub) {
+    struct subscriber **head = &sub->client->session.subscriptions;
+    if (sub->wildcard)
+        head = &sub->wildcard->subscriptions;
+    else
+        subscription_index_del(sub->client->session.index, sub);
+    if (sub->prev)
+        PUBLISH(sub->prev->next, sub->next);
+    else
+        PUBLISH(sub->topic->subscribers, sub->next);
+    if (sub->next)
+        sub->next->prev = sub->prev;
+    if (sub->client_prev)
+        sub->client_prev->client_next = sub->client_next;
+    else
+        *head = sub->client_next;
+    if (sub->client_next)
+        sub->client_next->client_prev = sub->client_prev;
+    // A publish may still be walking the subscribers, keeping `next`
+    ebr_retire(sub, subscriber_free);
+}
+
+struct subscriber *session_subscription(const struct sol_client *client,
+                                        const struct topic *t) {
+    const struct subscription_index *idx = client->session.index;
+    if (!idx)
+        return NULL;
+    return idx->subs[subscription_index_lookup(idx, t->id)];
+}
+
+/* Finalizer of MurmurHash3, spreading the bits of a CRC over 64 */
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb93e53ca1a85ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Key in the topic filter of a topic name without the trailing '/' */
+static uint64_t topic_key(uint32_t crc) {
+    return mix64(crc);
+}
+
+/* Key in the topic filter of the literal prefix of a wildcard filter */
+static uint64_t wildcard_key(uint32_t crc) {
+    return mix64(crc ^ WILDCARD_SALT);
+}
+
+static uint64_t wildcard_prefix_key(const char *filter) {
+    size_t len = strcspn(filter, "+#");
+    if (len > 0 && filter[len - 1] == '/')
+        len--;
+    return wildcard_key(hash_crc32c(filter, len, 0));
+}
+
+/*
+ * Build a new filter from the topics alive and the wildcard subscriptions,
+ * with room for twice as many keys, dropping those deleted
+ */
+static void topic_filter_rebuild(struct sol *sol) {
+    struct topic_filter *f = &sol->topic_filter;
+    struct topic_ids *ids = &sol->topic_ids;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct bloom *b =
+        bloom_create((trie_size(&sol->topics) + sol->wildcards_nr) * 2);
+    for (uint32_t id = 1; id <= ids->next; id++)
+        if (ids->topics[id])
+            bloom_add(b, topic_key(hash_crc32c(ids->topics[id]->name,
+                                               ids->topics[id]->len, 0)));
+    for (struct wildcard *w = sol->wildcards; w; w = w->next)
+        bloom_add(b, wildcard_prefix_key(w->filter));
+    // A publish may still be testing the old one
+    if (f->bloom)
+        ebr_retire(f->bloom, free);
+    f->bloom = b;
+    f->stale = 0;
+    f->rebuilds++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    f->rebuild_usec = (end.tv_sec - start.tv_sec) * 1000000 +
+        (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/*
+ * Add a key to the topic filter, when full it is rebuilt instead, the key
+ * being already stored as a topic or a wildcard subscription
+ */
+static void topic_filter_add(struct sol *sol, uint64_t key) {
+    struct topic_filter *f = &sol->topic_filter;
+    if (!f->bloom || bloom_full(f->bloom))
+        topic_filter_rebuild(sol);
+    else
+        bloom_add(f->bloom, key);
+}
+
+/*
+ * Rebuild the topic filter once the keys deleted since the last rebuild make
+ * up more than half of it, so that the cost of a rebuild is spread over as
+ * many deletions as keys stay
+ */
+static void topic_filter_collect(struct sol *sol) {
+    struct topic_filter *f = &sol->topic_filter;
+    if (f->stale >= TOPIC_FILTER_MIN_STALE && f->stale * 2 > f->bloom->keys)
+        topic_filter_rebuild(sol);
+}
+
+int sol_topic_filter(struct sol *sol, const char *topic, size_t len) {
+    struct topic_filter *f = &sol->topic_filter;
+    const struct bloom *b = f->bloom;
+    uint32_t crc = 0;
+    size_t hashed = 0;
+    if (len > 0 && topic[len - 1] == '/')
+        len--;
+    if (!b)
+        goto reject;
+    /*
+     * A single pass over the name, the CRC of every prefix ending on a level
+     * boundary, the empty one included, continues the previous one and is
+     * tested against the wildcard prefixes
+     */
+    for (size_t i = 0; sol->wildcards_nr > 0; ) {
+        crc = hash_crc32c(topic + hashed, i - hashed, crc);
+        hashed = i;
+        if (bloom_test(b, wildcard_key(crc)))
+            return TOPIC_FILTER_WILDCARD;
+        if (i == len)
+            break;
+        const char *sep = memchr(topic + i + 1, '/', len - i - 1);
+        i = sep ? (size_t) (sep - topic) : len;
+    }
+    crc = hash_crc32c(topic + hashed, len - hashed, crc);
+    if (bloom_test(b, topic_key(crc)))
+        return TOPIC_FILTER_TOPIC;
+reject:
+    f->rejected++;
+    return TOPIC_FILTER_NONE;
+}
 
+/* Auxiliary function to subscribe to every topic matched by a wildcard */
+static void wildcard_subscription(struct trie_node *node, void *arg) {
+    if (!node->data)
+        return;
+    wildcard_add_subscriber(node->data, arg);
 }
 
-void topic_del_subscriber(struct topic *t,
-                          struct sol_client *client,
-                          bool cleansession) {
-    list_remove_node(t->subscribers, client, compare_cid);
-    // TODO remomve in case of cleansession == false
+/*
+ * Auxiliary function to subscribe to a new topic all the wildcard
+ * subscriptions with a filter matching it
+ */
+static void filter_subscription(struct trie_node *node, void *arg) {
+    for (struct wildcard *w = node->data; w; w = w->filter_next)
+        wildcard_add_subscriber(arg, w);
+}
+
+/* The filters table doesn't own its keys nor its values */
+static int filter_destructor(struct hashtable_entry *entry) {
+    (void) entry;
+    return HASHTABLE_OK;
+}
+
+static struct wildcard *wildcard_find(const struct sol_client *client,
+                                      const char *filter) {
+    if (!client->session.filters)
+        return NULL;
+    return hashtable_get(client->session.filters, filter);
+}
+
+void sol_wildcard_add(struct sol *sol, const char *filter,
+                      struct sol_client *client, unsigned qos) {
+    struct session *s = &client->session;
+    struct wildcard *w = wildcard_find(client, filter);
+    if (w) {
+        w->qos = qos;
+        for (struct subscriber *sub = w->subscriptions; sub;
+             sub = sub->client_next)
+            sub->qos = qos;
+        return;
+    }
+    w = malloc(sizeof(*w));
+    w->filter = strdup(filter);
+    w->client = client;
+    w->qos = qos;
+    w->subscriptions = NULL;
+    w->prev = NULL;
+    w->next = sol->wildcards;
+    if (sol->wildcards)
+        sol->wildcards->prev = w;
+    sol->wildcards = w;
+    sol->wildcards_nr++;
+    w->filter_prev = NULL;
+    trie_find(&sol->filters, filter, (void **) &w->filter_next);
+    if (w->filter_next)
+        w->filter_next->filter_prev = w;
+    trie_insert(&sol->filters, filter, w);
+    w->client_prev = NULL;
+    w->client_next = s->wildcards;
+    if (s->wildcards)
+        s->wildcards->client_prev = w;
+    s->wildcards = w;
+    // Filters are chosen by clients, they're hashed with a secret
+    if (!s->filters)
+        s->filters = hashtable_create_keyed(filter_destructor);
+    hashtable_put(s->filters, w->filter, w);
+    trie_match(&sol->topics, filter, wildcard_subscription, w);
+    topic_filter_add(sol, wildcard_prefix_key(filter));
+}
+
+/*
+ * Remove the subscriptions made for a wildcard subscription, unlink it from
+ * the global list and release it
+ */
+static void wildcard_release(struct sol *sol, struct wildcard *w) {
+    while (w->subscriptions)
+        topic_del_subscriber(w->subscriptions);
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        sol->wildcards = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    sol->wildcards_nr--;
+    sol->topic_filter.stale++;
+    if (w->filter_next)
+        w->filter_next->filter_prev = w->filter_prev;
+    if (w->filter_prev) {
+        w->filter_prev->filter_next = w->filter_next;
+    } else if (w->filter_next) {
+        trie_insert(&sol->filters, w->filter, w->filter_next);
+    } else {
+        // The last one with its filter is retired by the trie
+        trie_delete(&sol->filters, w->filter);
+        free(w->filter);
+        return;
+    }
+    free(w->filter);
+    free(w);
+}
+
+bool sol_wildcard_del(struct sol *sol, const char *filter,
+                      struct sol_client *client) {
+    struct session *s = &client->session;
+    struct wildcard *w = wildcard_find(client, filter);
+    if (!w)
+        return false;
+    hashtable_del(s->filters, w->filter);
+    if (w->client_prev)
+        w->client_prev->client_next = w->client_next;
+    else
+        s->wildcards = w->client_next;
+    if (w->client_next)
+        w->client_next->client_prev = w->client_prev;
+    // Its prefix stays in the filter as a deleted topic does
+    wildcard_release(sol, w);
+    topic_filter_collect(sol);
+    return true;
+}
+
+void sol_wildcard_clear(struct sol *sol, struct sol_client *client) {
+    struct wildcard *w = client->session.wildcards, *next;
+    if (!w)
+        return;
+    for (; w; w = next) {
+        next = w->client_next;
+        wildcard_release(sol, w);
+    }
+    client->session.wildcards = NULL;
+    hashtable_release(client->session.filters);
+    client->session.filters = NULL;
+    topic_filter_collect(sol);
 }
 
 void sol_topic_put(struct sol *sol, struct topic *t) {
     trie_insert(&sol->topics, t->name, t);
+    t->id = topic_id_acquire(&sol->topic_ids, t);
+    topic_filter_add(sol, topic_key(hash_crc32c(t->name, t->len, 0)));
+    // Wildcard subscriptions made before the topic existed
+    trie_match_topic(&sol->filters, t->name, filter_subscription, t);
 }
 
 void sol_topic_del(struct sol *sol, const char *name) {
+    struct topic *t = sol_topic_get(sol, name);
+    if (!t)
+        return;
+    while (t->subscribers)
+        topic_del_subscriber(t->subscribers);
+    topic_id_release(&sol->topic_ids, t->id);
+    // The topic itself is retired by the trie, the name goes after it
     trie_delete(&sol->topics, name);
+    ebr_retire((void *) t->name, free);
+    // Its key stays in the filter till enough others are deleted
+    sol->topic_filter.stale++;
+    topic_filter_collect(sol);
+}
+
+void session_clear(struct sol_client *client) {
+    struct session *s = &client->session;
+    // Each removal unlinks the head of the subscriptions
+    while (s->subscriptions)
+        topic_del_subscriber(s->subscriptions);
+    if (s->index) {
+        free(s->index->subs);
+        free(s->index);
+        s->index = NULL;
+    }
+    inflight_release(s->inflight);
+    s->inflight = NULL;
+    pktid_set_release(s->received);
+    s->received = NULL;
+}
+
+struct sol_client *sol_client_alloc(void) {
+    return slab_alloc(&clients);
+}
+
+void sol_client_free(struct sol_client *client) {
+    slab_free(&clients, client);
 }
 
 struct topic *sol_topic_get(struct sol *sol, const char *name) {
@@ -53,3 +526,213 @@ struct topic *sol_topic_get(struct sol *sol, const char *name) {
     trie_find(&sol->topics, name, (void *) &ret_topic);
     return ret_topic;
 }
+
+struct topic *sol_topic_by_id(const struct sol *sol, uint32_t id) {
+    return id < sol->topic_ids.size ? sol->topic_ids.topics[id] : NULL;
+}
+
+/* Hash of a topic name without the trailing '/' */
+static uint32_t topic_hash(const char *name, size_t len) {
+    if (len > 0 && name[len - 1] == '/')
+        len--;
+    return hash_crc32c(name, len, 0);
+}
+
+struct topic *sol_topic_lookup(struct sol *sol, struct topic_cache *cache,
+                               const char *name, size_t len) {
+    uint32_t hash = topic_hash(name, len);
+    struct topic *t = NULL;
+    if (cache->hash == hash)
+        t = sol_topic_by_id(sol, cache->id);
+    if (t && topic_name_eq(t, name, len))
+        return t;
+    t = sol_topic_get(sol, name);
+    cache->id = t ? t->id : TOPIC_ID_NONE;
+    cache->hash = hash;
+    return t;
+}
+
+size_t sol_topic_gc(struct sol *sol, time_t idle, uint32_t max) {
+    struct topic_ids *ids = &sol->topic_ids;
+    struct topic_gc *gc = &sol->topic_gc;
+    time_t now = time(NULL);
+    size_t nodes, reclaimed = 0;
+    struct topic *t;
+    for (uint32_t i = 0; i < max && ids->next > 0; i++) {
+        if (++gc->cursor > ids->next)
+            gc->cursor = 1;
+        t = ids->topics[gc->cursor];
+        if (!t || t->subscribers || now - t->last_used < idle
+            || strncmp(t->name, "$SOL/", 5) == 0)
+            continue;
+        nodes = trie_nodes();
+        sol_topic_del(sol, t->name);
+        gc->nodes += nodes - trie_nodes();
+        reclaimed++;
+    }
+    gc->topics += reclaimed;
+    return reclaimed;
+}
+
+struct inflight *inflight_create(unsigned size) {
+    unsigned wsize = 1;
+    while (wsize < size && wsize < INFLIGHT_MAX_SIZE)
+        wsize <<= 1;
+    struct inflight *w = malloc(sizeof(*w));
+    w->next_id = 1;
+    w->size = wsize;
+    w->nr = 0;
+    w->bitmap = calloc((wsize + 63) / 64, sizeof(uint64_t));
+    w->slots = calloc(wsize, sizeof(struct inflight_msg));
+    msg_queue_init(&w->pending);
+    return w;
+}
+
+void inflight_release(struct inflight *w) {
+    if (!w)
+        return;
+    for (unsigned i = 0; i < w->size; i++)
+        if (INFLIGHT_TAKEN(w, i)) {
+            bytestring_release(w->slots[i].packet);
+            wal_unref(w->slots[i].wal_id);
+        }
+    msg_queue_clear(&w->pending);
+    free(w->bitmap);
+    free(w->slots);
+    free(w);
+}
+
+/*
+ * Packet ids are handed out sequentially, skipping those mapping to a taken
+ * slot, as acks usually come back in order the first candidate is almost
+ * always free.
+ */
+struct inflight_msg *inflight_acquire(struct inflight *w) {
+    if (w->nr == w->size)
+        return NULL;
+    unsigned short id;
+    unsigned slot;
+    do {
+        id = w->next_id++;
+        if (w->next_id == 0)
+            w->next_id = 1;
+        slot = id & (w->size - 1);
+    } while (INFLIGHT_TAKEN(w, slot));
+    w->bitmap[slot / 64] |= 1ULL << (slot % 64);
+    w->nr++;
+    w->slots[slot].pkt_id = id;
+    w->slots[slot].packet = NULL;
+    w->slots[slot].wal_id = -1;
+    return &w->slots[slot];
+}
+
+struct inflight_msg *inflight_get(const struct inflight *w,
+                                  unsigned short pkt_id) {
+    if (!w)
+        return NULL;
+    unsigned slot = pkt_id & (w->size - 1);
+    if (!INFLIGHT_TAKEN(w, slot) || w->slots[slot].pkt_id != pkt_id)
+        return NULL;
+    return &w->slots[slot];
+}
+
+bool inflight_ack(struct inflight *w, unsigned short pkt_id) {
+    struct inflight_msg *msg = inflight_get(w, pkt_id);
+    if (!msg)
+        return false;
+    unsigned slot = pkt_id & (w->size - 1);
+    bytestring_release(msg->packet);
+    msg->packet = NULL;
+    wal_unref(msg->wal_id);
+    msg->wal_id = -1;
+    w->bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+    w->nr--;
+    return true;
+}
+
+void inflight_map(struct inflight *w,
+                  void (*mapfunc)(struct inflight_msg *, void *), void *arg) {
+    if (!w || w->nr == 0)
+        return;
+    for (unsigned i = 0; i < (w->size + 63) / 64; i++) {
+        uint64_t word = w->bitmap[i];
+        // Skip whole empty words, visiting only taken slots
+        while (word) {
+            unsigned bit = __builtin_ctzll(word);
+            mapfunc(&w->slots[i * 64 + bit], arg);
+            word &= word - 1;
+        }
+    }
+}
+
+struct pktid_set *pktid_set_create(void) {
+    struct pktid_set *set = malloc(sizeof(*set));
+    set->size = PKTID_SET_INITIAL_SIZE;
+    set->nr = 0;
+    set->ids = calloc(set->size, sizeof(unsigned short));
+    return set;
+}
+
+void pktid_set_release(struct pktid_set *set) {
+    if (!set)
+        return;
+    free(set->ids);
+    free(set);
+}
+
+/* Return the bucket storing the id or the empty one where it should go */
+static unsigned pktid_set_lookup(const struct pktid_set *set,
+                                 unsigned short pkt_id) {
+    unsigned i = pkt_id & (set->size - 1);
+    while (set->ids[i] != 0 && set->ids[i] != pkt_id)
+        i = (i + 1) & (set->size - 1);
+    return i;
+}
+
+/* Double the buckets keeping the load factor under 3/4 */
+static void pktid_set_grow(struct pktid_set *set) {
+    unsigned short *old = set->ids;
+    unsigned old_size = set->size;
+    set->size *= 2;
+    set->ids = calloc(set->size, sizeof(unsigned short));
+    for (unsigned i = 0; i < old_size; i++)
+        if (old[i] != 0)
+            set->ids[pktid_set_lookup(set, old[i])] = old[i];
+    free(old);
+}
+
+bool pktid_set_add(struct pktid_set *set, unsigned short pkt_id) {
+    unsigned i = pktid_set_lookup(set, pkt_id);
+    if (set->ids[i] == pkt_id)
+        return false;
+    set->ids[i] = pkt_id;
+    set->nr++;
+    if (set->nr * 4 >= set->size * 3)
+        pktid_set_grow(set);
+    return true;
+}
+
+/*
+ * Remove an id using backward shift deletion, entries following the removed
+ * one in the same probe sequence are moved back, no tombstones needed.
+ */
+bool pktid_set_del(struct pktid_set *set, unsigned short pkt_id) {
+    if (!set)
+        return false;
+    unsigned mask = set->size - 1;
+    unsigned i = pktid_set_lookup(set, pkt_id);
+    if (set->ids[i] != pkt_id)
+        return false;
+    set->ids[i] = 0;
+    set->nr--;
+    for (unsigned j = (i + 1) & mask; set->ids[j] != 0; j = (j + 1) & mask) {
+        unsigned home = set->ids[j] & mask;
+        // Move the entry back only if its home bucket isn't in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            set->ids[i] = set->ids[j];
+            set->ids[j] = 0;
+            i = j;
+        }
+    }
+    return true;
+}
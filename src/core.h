@@ -1,28 +1,182 @@
 #ifndef CORE_H
 #define CORE_H
 
+#include <time.h>
 #include "trie.h"
 #include "list.h"
+#include "pack.h"
+#include "queue.h"
 #include "hashtable.h"
+#include "bloom.h"
+#include "registry.h"
+
+/* Id of no topic, real ids start from 1 */
+#define TOPIC_ID_NONE 0
+
+/* Outcome of the check of a published topic against the topic filter */
+#define TOPIC_FILTER_NONE       0
+#define TOPIC_FILTER_TOPIC      1
+#define TOPIC_FILTER_WILDCARD   2
 
 struct topic {
+    /* Small integer id, reused after the topic is deleted */
+    uint32_t id;
     const char *name;
-    List *subscribers;
+    size_t len;
+    /* Head of the subscribers, linked through `next` */
+    struct subscriber *subscribers;
+    /* Seconds messages on this topic can wait in a queue, 0 for no expiry */
+    size_t expiry;
+    /* Last time a message was published on it, or its creation */
+    time_t last_used;
+};
+
+/*
+ * Last topic looked up by a client, with a hash of its name, so that a lookup
+ * of another topic goes straight to the trie without touching this one
+ */
+struct topic_cache {
+    uint32_t id;
+    uint32_t hash;
+};
+
+/*
+ * Dense table of the known topics indexed by id, ids of deleted topics are
+ * pushed on a stack and handed out again before new ones, keeping the table
+ * as compact as the set of topics alive.
+ */
+struct topic_ids {
+    struct topic **topics;
+    uint32_t size;
+    uint32_t next;
+    uint32_t *free;
+    uint32_t free_nr;
+};
+
+/*
+ * Open connections indexed by their descriptor, the kernel hands out the
+ * lowest free one so the table is as dense as the set of connections, grown
+ * by doubling to the highest descriptor seen.
+ */
+struct connections {
+    struct closure **closures;
+    size_t size;
+    size_t nr;
+};
+
+/*
+ * Garbage collection of unused topics, a cursor sweeps the ids table a few
+ * slots at a time, with the count of topics and trie nodes reclaimed so far.
+ */
+struct topic_gc {
+    uint32_t cursor;
+    size_t topics;
+    size_t nodes;
+};
+
+/*
+ * Filter of the topics a message published may have subscribers on, checked
+ * before any lookup in the trie. It holds the names of the topics known and
+ * the literal prefixes, up to the first wildcard, of the wildcard
+ * subscriptions, so that a topic matching neither is dropped right away.
+ */
+struct topic_filter {
+    struct bloom *bloom;
+    /* Topics and wildcards deleted since the last rebuild, still set in */
+    size_t stale;
+    /* Publishes dropped, and passed with no subscribers to deliver to */
+    size_t rejected;
+    size_t false_positives;
+    size_t rebuilds;
+    /* Microseconds taken by the last rebuild */
+    long rebuild_usec;
 };
 
 /*
  * Main structure, a global instance will be instantiated at start, tracking
- * topics, connected clients and registered closures.
+ * topics, connected clients and open connections.
  */
 struct sol {
-    HashTable *clients;
-    HashTable *closures;
+    struct registry clients;
+    struct connections connections;
     Trie topics;
+    struct topic_ids topic_ids;
+    struct topic_gc topic_gc;
+    struct topic_filter topic_filter;
+    /* Wildcard subscriptions, applied to topics created after them too */
+    struct wildcard *wildcards;
+    size_t wildcards_nr;
+    /* The same keyed by filter, to the first of those sharing one */
+    Trie filters;
+};
+
+/*
+ * Outgoing QoS > 0 message waiting for an acknowledgement, it retains the
+ * packed bytes in order to be re-sent with the DUP flag set on timeout, and
+ * a reference on the WAL segment storing the message, by its delivery id, if
+ * any.
+ */
+struct inflight_msg {
+    unsigned short pkt_id;
+    unsigned char qos;
+    time_t sent_at;
+    long wal_id;
+    struct bytestring *packet;
+};
+
+/*
+ * In-flight window of a session. Slots are indexed directly by the packet id
+ * masked over the window size, this way both the assignment of a new packet id
+ * and the processing of an ack are O(1). A bitmap tracks taken slots, allowing
+ * fast scans on retransmission, while messages exceeding the window, or sent
+ * while the client is offline, are parked in the pending queue till a slot is
+ * released.
+ */
+struct inflight {
+    unsigned short next_id;
+    unsigned size;
+    unsigned nr;
+    uint64_t *bitmap;
+    struct inflight_msg *slots;
+    struct msg_queue pending;
+};
+
+/*
+ * Compact set of packet ids, open addressing with linear probing over a power
+ * of 2 array of 16 bit ids, 0 marks an empty bucket as it's never a valid
+ * packet id, packets carrying it are rejected when decoded. Clients usually hand out sequential ids, so masking the id
+ * itself spreads them evenly without any hashing.
+ */
+struct pktid_set {
+    unsigned size;
+    unsigned nr;
+    unsigned short *ids;
+};
+
+/*
+ * Plain subscriptions of a session indexed by topic id, open addressing with
+ * linear probing over a power of 2 array, as the packet ids set, with the ids
+ * scrambled by a multiplicative hash, being dense they would cluster.
+ */
+struct subscription_index {
+    unsigned size;
+    unsigned nr;
+    struct subscriber **subs;
 };
 
 struct session {
-    List *subscriptions;
-    // TODO add pending confirmed messages
+    /* Plain subscriptions of the client, linked through `client_next` */
+    struct subscriber *subscriptions;
+    /* Allocated on the first plain subscription, NULL till then */
+    struct subscription_index *index;
+    /* Wildcard subscriptions of the client, linked through `client_next` */
+    struct wildcard *wildcards;
+    /* Wildcard subscriptions by filter, NULL till the first one */
+    HashTable *filters;
+    /* Allocated on the first QoS > 0 message, NULL for idle sessions */
+    struct inflight *inflight;
+    /* Inbound QoS 2 packet ids received and not yet released by a PUBREL */
+    struct pktid_set *received;
 };
 
 /*
@@ -32,22 +186,178 @@ struct session {
 struct sol_client {
     char *client_id;
     int fd;
+    /* Connection of an online client, carrying its output queue */
+    struct closure *cb;
+    /* Clients with a persistent session are kept offline after disconnection */
+    bool online;
+    bool clean_session;
+    /* Set on a restored session, in-flight and queued messages are to be
+     * re-sent once the CONNACK is out */
+    bool resume;
+    /* Last topic published to, devices usually stick to one */
+    struct topic_cache last_topic;
     struct session session;
 };
 
+/*
+ * Subscription of a client to a topic, linked both in the subscribers of the
+ * topic and in the subscriptions of the client, or of its wildcard
+ * subscription, so that it is removed in O(1) from either side. Publishes
+ * walk the subscribers of a topic following `next` only, without locks: new
+ * subscribers are linked at the head, removed ones are unlinked keeping their
+ * `next` and retired, the other links are touched by the writer only.
+ */
 struct subscriber {
     unsigned qos;
     struct sol_client *client;
+    struct topic *topic;
+    /* Wildcard subscription the handle was made for, NULL for a plain one */
+    struct wildcard *wildcard;
+    struct subscriber *next;
+    struct subscriber *prev;
+    struct subscriber *client_next;
+    struct subscriber *client_prev;
+};
+
+/*
+ * Subscription with a filter containing '+' or '#' wildcards, linked both in
+ * the global list and in the wildcard subscriptions of the client. The
+ * subscriptions to the topics it matches are linked to it, instead of to the
+ * subscriptions of the client.
+ */
+struct wildcard {
+    char *filter;
+    unsigned qos;
+    struct sol_client *client;
+    /* Subscriptions made for the filter, linked through `client_next` */
+    struct subscriber *subscriptions;
+    struct wildcard *next;
+    struct wildcard *prev;
+    /* Subscriptions of other clients with the same filter */
+    struct wildcard *filter_next;
+    struct wildcard *filter_prev;
+    struct wildcard *client_next;
+    struct wildcard *client_prev;
 };
 
 struct topic *topic_create(const char *);
 void topic_init(struct topic *, const char *);
-void topic_add_subscriber(struct topic *, struct sol_client *, unsigned, bool);
-void topic_del_subscriber(struct topic *, struct sol_client *, bool);
+
+/*
+ * Return a copy of a topic name of a given length, terminated by a '/' as
+ * topics are stored, to be called only once creating a new topic
+ */
+char *topic_name(const char *, size_t);
+
+/*
+ * Subscribe a client to a topic, returning the handle of the subscription,
+ * indexed by topic in the session
+ */
+struct subscriber *topic_add_subscriber(struct topic *,
+                                        struct sol_client *, unsigned);
+
+/* Remove a subscription from its topic and its client and release it */
+void topic_del_subscriber(struct subscriber *);
+
+/*
+ * Find the plain subscription of a client to a topic in O(1), the ones made
+ * for wildcard subscriptions excluded, NULL if the client isn't subscribed
+ */
+struct subscriber *session_subscription(const struct sol_client *,
+                                        const struct topic *);
 void sol_topic_put(struct sol *, struct topic *);
 void sol_topic_del(struct sol *, const char *);
 
 /* Find a topic by name and return it */
 struct topic *sol_topic_get(struct sol *, const char *);
 
+/* Find a topic by id, NULL if no topic has it */
+struct topic *sol_topic_by_id(const struct sol *, uint32_t);
+
+/*
+ * Find a topic by NUL-terminated name of a given length, trying first the one
+ * cached, checked by name as ids are reused, and then the trie, the topic
+ * found is cached back. A name with or without the trailing '/' is the same
+ * topic.
+ */
+struct topic *sol_topic_lookup(struct sol *, struct topic_cache *,
+                               const char *, size_t);
+
+/*
+ * Check a NUL-terminated topic name of a given length against the topic
+ * filter, returning TOPIC_FILTER_NONE if it has surely no subscribers,
+ * TOPIC_FILTER_WILDCARD if it may match a wildcard subscription, or
+ * TOPIC_FILTER_TOPIC if it may be a topic already known.
+ */
+int sol_topic_filter(struct sol *, const char *, size_t);
+
+/*
+ * Register a wildcard subscription, subscribing the client to the topics
+ * matching the filter, those known and those created from now on, and let
+ * all the topics starting with the levels before the first '+' or '#' pass
+ * the topic filter. Subscribing again to the same filter just updates the
+ * QoS.
+ */
+void sol_wildcard_add(struct sol *, const char *, struct sol_client *,
+                      unsigned);
+
+/*
+ * Remove a wildcard subscription of a client along with the subscriptions to
+ * the topics it matched, return false if the client has no such filter
+ */
+bool sol_wildcard_del(struct sol *, const char *, struct sol_client *);
+
+/* Remove all the wildcard subscriptions of a client */
+void sol_wildcard_clear(struct sol *, struct sol_client *);
+
+/*
+ * Visit up to a given number of slots of the topic ids table, resuming from
+ * where the last call stopped, deleting topics without subscribers and with
+ * no message published for at least the given seconds, pruning their nodes
+ * off the trie. Broker topics under "$SOL/" are never deleted. Return the
+ * number of topics deleted.
+ */
+size_t sol_topic_gc(struct sol *, time_t, uint32_t);
+
+/*
+ * Release all the state of a session, removing the client from all the topics
+ * it subscribed to, in O(number of subscriptions)
+ */
+void session_clear(struct sol_client *);
+
+/* Allocate a client out of the slab of clients, left uninitialized */
+struct sol_client *sol_client_alloc(void);
+
+/* Give back the memory of a client, its session already cleared */
+void sol_client_free(struct sol_client *);
+
+/*
+ * In-flight window management, the size is rounded up to the next power of 2,
+ * packet ids are never 0 as required by MQTT specs
+ */
+struct inflight *inflight_create(unsigned);
+void inflight_release(struct inflight *);
+
+/* Reserve a slot with a fresh packet id, NULL if the window is full */
+struct inflight_msg *inflight_acquire(struct inflight *);
+
+/* Retrieve the message in-flight with a given packet id, NULL if not found */
+struct inflight_msg *inflight_get(const struct inflight *, unsigned short);
+
+/* Release the slot of an acknowledged packet id, false if not in-flight */
+bool inflight_ack(struct inflight *, unsigned short);
+
+/* Apply a function to every message in-flight */
+void inflight_map(struct inflight *,
+                  void (*mapfunc)(struct inflight_msg *, void *), void *);
+
+struct pktid_set *pktid_set_create(void);
+void pktid_set_release(struct pktid_set *);
+
+/* Add a packet id to the set, false if it was already present */
+bool pktid_set_add(struct pktid_set *, unsigned short);
+
+/* Remove a packet id from the set, false if it wasn't present */
+bool pktid_set_del(struct pktid_set *, unsigned short);
+
 #endif
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include "ebr.h"
+
+/*
+ * Objects retired during an epoch wait in one of 3 lists, indexed by the
+ * epoch modulo 3. When the epoch advances to e + 1 every reader is known to
+ * have entered in e or later, objects retired in e - 2 were unlinked before
+ * any of them started and their list is recycled for the new epoch.
+ */
+#define EBR_EPOCHS 3
+
+/* Low bit of the state of a reader, set while inside a read-side section */
+#define EBR_ACTIVE 1u
+
+/*
+ * Per-thread reader record, the state is the epoch announced on entering a
+ * section, shifted left by one and marked active. Records are never freed,
+ * those released by exiting threads are reused by new ones.
+ */
+struct ebr_record {
+    unsigned state;
+    unsigned nesting;
+    bool taken;
+    struct ebr_record *next;
+};
+
+struct ebr_retired {
+    void *ptr;
+    void (*destructor)(void *);
+};
+
+struct ebr_limbo {
+    struct ebr_retired *objs;
+    size_t nr;
+    size_t size;
+};
+
+static struct {
+    unsigned epoch;
+    struct ebr_record *records;
+    struct ebr_limbo limbo[EBR_EPOCHS];
+} ebr;
+
+static _Thread_local struct ebr_record *self;
+
+void ebr_register(void) {
+    struct ebr_record *r;
+    bool taken = false;
+    if (self)
+        return;
+    r = __atomic_load_n(&ebr.records, __ATOMIC_ACQUIRE);
+    for (; r; r = r->next) {
+        if (!__atomic_load_n(&r->taken, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&r->taken, &taken, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            self = r;
+            return;
+        }
+        taken = false;
+    }
+    r = calloc(1, sizeof(*r));
+    r->taken = true;
+    r->next = __atomic_load_n(&ebr.records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ebr.records, &r->next, r, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    self = r;
+}
+
+void ebr_unregister(void) {
+    if (!self)
+        return;
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+    self->nesting = 0;
+    __atomic_store_n(&self->taken, false, __ATOMIC_RELEASE);
+    self = NULL;
+}
+
+void ebr_enter(void) {
+    if (self->nesting++ > 0)
+        return;
+    unsigned epoch = __atomic_load_n(&ebr.epoch, __ATOMIC_RELAXED);
+    // The announcement must be visible before any load of shared data
+    __atomic_store_n(&self->state, (epoch << 1) | EBR_ACTIVE,
+                     __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(void) {
+    if (--self->nesting > 0)
+        return;
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+void ebr_retire(void *ptr, void (*destructor)(void *)) {
+    struct ebr_limbo *l = &ebr.limbo[ebr.epoch % EBR_EPOCHS];
+    if (l->nr == l->size) {
+        l->size = l->size ? l->size * 2 : 64;
+        l->objs = realloc(l->objs, l->size * sizeof(*l->objs));
+    }
+    l->objs[l->nr].ptr = ptr;
+    l->objs[l->nr].destructor = destructor;
+    l->nr++;
+}
+
+size_t ebr_collect(void) {
+    unsigned epoch = ebr.epoch, state;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    struct ebr_record *r = __atomic_load_n(&ebr.records, __ATOMIC_ACQUIRE);
+    for (; r; r = r->next) {
+        state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+        // A reader still in the previous epoch holds the advance
+        if ((state & EBR_ACTIVE) && (state & ~EBR_ACTIVE) != (epoch << 1))
+            return 0;
+    }
+    epoch++;
+    __atomic_store_n(&ebr.epoch, epoch, __ATOMIC_RELEASE);
+
+    /*
+     * Detach the list before running the destructors, so that objects they
+     * may retire go to a fresh one, the array is recycled if still unused
+     */
+    struct ebr_limbo *l = &ebr.limbo[epoch % EBR_EPOCHS];
+    struct ebr_limbo done = *l;
+    l->objs = NULL;
+    l->nr = l->size = 0;
+    for (size_t i = 0; i < done.nr; i++)
+        done.objs[i].destructor(done.objs[i].ptr);
+    if (l->size == 0) {
+        l->objs = done.objs;
+        l->size = done.size;
+    } else {
+        free(done.objs);
+    }
+    return done.nr;
+}
+
+size_t ebr_pending(void) {
+    size_t nr = 0;
+    for (int i = 0; i < EBR_EPOCHS; i++)
+        nr += ebr.limbo[i].nr;
+    return nr;
+}
@@ -0,0 +1,42 @@
+#ifndef EBR_H
+#define EBR_H
+
+#include <stddef.h>
+
+/*
+ * Epoch-based reclamation, lets readers walk shared structures without locks
+ * while a writer unlinks and retires parts of them.
+ *
+ * Readers wrap each access in `ebr_enter` / `ebr_exit`, announcing the global
+ * epoch they entered in. Objects unlinked by the writer are not freed but
+ * retired with `ebr_retire`, tagged with the current epoch. `ebr_collect`
+ * advances the epoch once every reader inside a section has caught up with
+ * it, and runs the destructors of the objects retired two epochs before, that
+ * no reader can still be looking at.
+ *
+ * There's a single writer at a time: `ebr_retire` and `ebr_collect` must be
+ * serialised by the caller, as the mutations of the structures themselves,
+ * destructors run in the same context. Readers are any number of threads.
+ */
+
+/* Register the calling thread as a reader, to be done once per thread */
+void ebr_register(void);
+void ebr_unregister(void);
+
+/* Enter and leave a read-side section, they can be nested */
+void ebr_enter(void);
+void ebr_exit(void);
+
+/* Defer the release of an object till no reader can reference it anymore */
+void ebr_retire(void *, void (*)(void *));
+
+/*
+ * Try to advance the epoch, reclaiming objects retired two epochs before,
+ * return the number of objects reclaimed
+ */
+size_t ebr_collect(void);
+
+/* Number of objects retired and not yet reclaimed */
+size_t ebr_pending(void);
+
+#endif
@@ -0,0 +1,140 @@
+#define _DEFAULT_SOURCE
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/random.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "hash.h"
+
+/* Reflected polynomial of the CRC32C, as computed by the SSE4.2 instruction */
+#define CRC32C_POLY     0x82f63b78u
+
+#define MURMUR64_M      0xc6a4a7935bd1e995ULL
+#define MURMUR64_R      47
+
+#define ROTL(x, b)      (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do {                                                       \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);               \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                                  \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                                  \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);               \
+} while (0)
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_resolve(const unsigned char *, size_t, uint32_t);
+
+/* Implementation of the CRC32C for the CPU, picked on the first call */
+static uint32_t (*crc32c)(const unsigned char *, size_t, uint32_t) =
+    crc32c_resolve;
+
+void hash_key_init(struct hash_key *key) {
+    if (getrandom(key, sizeof(*key), 0) == sizeof(*key))
+        return;
+    // Not as good, still different on each run
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    key->k0 = hash64(&ts, sizeof(ts), (uint64_t) getpid());
+    key->k1 = hash64(&ts, sizeof(ts), (uintptr_t) key);
+}
+
+static uint32_t crc32c_sw(const unsigned char *buf, size_t len,
+                          uint32_t crc) {
+    for (size_t i = 0; i < len; i++)
+        crc = crc32c_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const unsigned char *buf, size_t len,
+                             uint32_t crc) {
+    uint64_t crc64 = crc, word;
+    for (; len >= 8; buf += 8, len -= 8) {
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; len > 0; buf++, len--)
+        crc = _mm_crc32_u8(crc, *buf);
+    return crc;
+}
+#endif
+
+static uint32_t crc32c_resolve(const unsigned char *buf, size_t len,
+                               uint32_t crc) {
+    uint32_t (*impl)(const unsigned char *, size_t, uint32_t) = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        impl = crc32c_sse42;
+#endif
+    if (impl == crc32c_sw) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; j++)
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            crc32c_table[i] = c;
+        }
+    }
+    // Readers may race on the first calls, they all store the same
+    __atomic_store_n(&crc32c, impl, __ATOMIC_RELEASE);
+    return impl(buf, len, crc);
+}
+
+uint32_t hash_crc32c(const void *buf, size_t len, uint32_t crc) {
+    uint32_t (*impl)(const unsigned char *, size_t, uint32_t) =
+        __atomic_load_n(&crc32c, __ATOMIC_ACQUIRE);
+    return ~impl(buf, len, ~crc);
+}
+
+uint64_t hash64(const void *buf, size_t len, uint64_t seed) {
+    const unsigned char *p = buf;
+    uint64_t h = seed ^ (len * MURMUR64_M), k;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&k, p, sizeof(k));
+        k *= MURMUR64_M;
+        k ^= k >> MURMUR64_R;
+        k *= MURMUR64_M;
+        h ^= k;
+        h *= MURMUR64_M;
+    }
+    if (len > 0) {
+        k = 0;
+        memcpy(&k, p, len);
+        h ^= k;
+        h *= MURMUR64_M;
+    }
+    h ^= h >> MURMUR64_R;
+    h *= MURMUR64_M;
+    h ^= h >> MURMUR64_R;
+    return h;
+}
+
+uint64_t hash_keyed(const void *buf, size_t len, const struct hash_key *key) {
+    const unsigned char *p = buf;
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key->k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key->k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key->k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ key->k1;
+    uint64_t m, b = (uint64_t) len << 56;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&m, p, sizeof(m));
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+    m = 0;
+    memcpy(&m, p, len);
+    b |= m;
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
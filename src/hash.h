@@ -0,0 +1,39 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Non-cryptographic hashing of strings for the tables of the broker.
+ *
+ * - `hash_crc32c` is the cheapest for short strings like topic levels, with
+ *   the SSE4.2 instruction hashing 8 bytes at a time where the CPU has it,
+ *   picked at runtime, and a table otherwise. 32 bits only.
+ * - `hash64` is MurmurHash64A, 8 bytes at a time on any CPU, with a seed.
+ * - `hash_keyed` is SipHash-1-3, slower but keyed with a secret, so that keys
+ *   all colliding can't be crafted by clients, to be used by the tables keyed
+ *   by strings chosen by them.
+ */
+
+struct hash_key {
+    uint64_t k0;
+    uint64_t k1;
+};
+
+/* Fill a key with random bytes */
+void hash_key_init(struct hash_key *);
+
+/*
+ * CRC32C of a buffer of a given length, continuing from a previous CRC, 0 to
+ * start, so that a string can be hashed a piece at a time
+ */
+uint32_t hash_crc32c(const void *, size_t, uint32_t);
+
+/* 64 bit hash of a buffer of a given length, with a seed */
+uint64_t hash64(const void *, size_t, uint64_t);
+
+/* 64 bit hash of a buffer of a given length, keyed */
+uint64_t hash_keyed(const void *, size_t, const struct hash_key *);
+
+#endif
@@ -1,108 +1,295 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
-#include "util.h"
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hash.h"
 #include "hashtable.h"
 
+/*
+ * Open addressing in the style of the Swiss tables. Slots come in groups of
+ * 16, each group starting with a control byte per slot: 0 marks an empty
+ * slot, the top bit set a used one, with 7 bits of the hash of the key, any
+ * other value a deleted one. Tables are allocated zeroed, so that their pages
+ * are touched only once used. A probe matches the control bytes of a whole
+ * group against the hash at once, comparing only the candidates, and moves to
+ * the next group only if the current one is full. Groups are probed
+ * quadratically, a group with an empty slot ends a probe.
+ *
+ * Growing doesn't stop the world: the new table is allocated and the entries
+ * of the old one are moved a few at a time by each of the following
+ * operations, the lookups checking both tables till the old one is drained.
+ * Moved slots are marked as deleted in the old table, so that probes for the
+ * entries still there go on past them. Large tables are mapped on their own
+ * and backed by huge pages where available, a fault zeroing 2MB at a time and
+ * not 4KB, few of them end up on the operations after a growth.
+ *
+ * Slots store the length, part of the hash and the first bytes of the key, so
+ * that the client ids allowed by MQTT, up to 23 bytes, are compared without
+ * touching the key itself.
+ */
+#define GROUP_SIZE      16
+#define CTRL_EMPTY      0x00
+#define CTRL_DELETED    0x01
+#define CTRL_FULL       0x80
+#define CTRL(hash)      ((uint8_t) ((hash) >> 57 | CTRL_FULL))
+#define KEY_PREFIX_LEN  24
+
+/*
+ * Slots of the old table moved by each operation during a rehash, the old
+ * table is drained long before the new one can fill up
+ */
+#define REHASH_STEP     4
+
+/* Tables from this size on are mapped aligned to a huge page */
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+/* Max load of 7/8, deleted slots included */
+#define MAX_LOAD(size)  ((size) - (size) / 8)
+
+struct hashtable_slot {
+    const char *key;
+    void *val;
+    uint32_t hash;
+    uint32_t len;
+    char prefix[KEY_PREFIX_LEN];
+};
+
+struct hashtable_group {
+    uint8_t ctrl[GROUP_SIZE];
+    struct hashtable_slot slots[GROUP_SIZE];
+};
+
 /* Hashtable definition */
 struct hashtable {
     size_t table_size;
     size_t size;
+    /* Empty slots that can be taken before growing, moves to come included */
+    size_t growth_left;
     int (*destructor)(struct hashtable_entry *);
-    struct hashtable_entry *entries;
+    /* Drawn per table, the seed of a plain one is `key.k0` */
+    struct hash_key key;
+    bool keyed;
+    struct hashtable_group *groups;
+    /* Table being moved into `groups` by a rehash, NULL if there's none */
+    struct hashtable_group *old_groups;
+    size_t old_size;
+    /* Slots of the old table moved so far */
+    size_t moved;
 };
 
-const int INITIAL_SIZE = 4;
-const int MAX_CHAIN_LENGTH = 8;
-const unsigned long KNUTH_PRIME = 2654435761;
-static unsigned long crc32(const uint8_t *, unsigned int);
+const int INITIAL_SIZE = GROUP_SIZE;
 
 /*
- * Hashing function for a string
+ * Hashing function for a string of a given length, the low bits select the
+ * group and the top 7 go in the control byte
  */
-static uint64_t hashtable_hash_int(HashTable *m, const uint8_t *keystr) {
-    assert(m && keystr);
-    uint64_t key = crc32(keystr, strlen((const char *) keystr));
-
-    /* Robert Jenkins' 32 bit Mix Function */
-    key += (key << 12);
-    key ^= (key >> 22);
-    key += (key << 4);
-    key ^= (key >> 9);
-    key += (key << 10);
-    key ^= (key >> 2);
-    key += (key << 7);
-    key ^= (key >> 12);
-
-    /* Knuth's Multiplicative Method */
-    key = (key >> 3) * KNUTH_PRIME;
-
-    return key % m->table_size;
+static uint64_t hashtable_hash(const HashTable *table,
+                               const char *key, size_t len) {
+    if (table->keyed)
+        return hash_keyed(key, len, &table->key);
+    return hash64(key, len, table->key.k0);
+}
+
+/* Bitmask of the slots of a group with a given control byte */
+static unsigned group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        if (ctrl[i] == byte)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/* Bitmask of the empty or deleted slots of a group, without the top bit */
+static unsigned group_match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return ~_mm_movemask_epi8(group) & 0xFFFF;
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        if (!(ctrl[i] & CTRL_FULL))
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+static bool slot_eq(const struct hashtable_slot *slot, const char *key,
+                    size_t len, uint64_t hash) {
+    if (slot->hash != (uint32_t) hash || slot->len != len)
+        return false;
+    if (len <= KEY_PREFIX_LEN)
+        return memcmp(slot->prefix, key, len) == 0;
+    return memcmp(slot->prefix, key, KEY_PREFIX_LEN) == 0 &&
+        memcmp(slot->key + KEY_PREFIX_LEN, key + KEY_PREFIX_LEN,
+               len - KEY_PREFIX_LEN) == 0;
+}
+
+/* Return the slot of a key in an array of groups, or NULL if not stored */
+static struct hashtable_slot *groups_find(struct hashtable_group *groups,
+                                          size_t size, const char *key,
+                                          size_t len, uint64_t hash,
+                                          struct hashtable_group **group) {
+    size_t mask = size / GROUP_SIZE - 1;
+    size_t index = hash & mask;
+    for (size_t i = 1; ; i++) {
+        struct hashtable_group *g = &groups[index];
+        unsigned match = group_match(g->ctrl, CTRL(hash));
+        while (match) {
+            struct hashtable_slot *slot = &g->slots[__builtin_ctz(match)];
+            if (slot_eq(slot, key, len, hash)) {
+                *group = g;
+                return slot;
+            }
+            match &= match - 1;
+        }
+        if (group_match(g->ctrl, CTRL_EMPTY))
+            return NULL;
+        index = (index + i) & mask;
+    }
 }
 
 /*
- * Return the integer of the location in entries to store the point to the item
- * or -HASHTABLE_FULL.
+ * Return the position in its group of the first empty or deleted slot on the
+ * probe of a hash in an array of groups
  */
-static int hashtable_hash(HashTable *table, const uint8_t *key) {
-    assert(table && key);
-    /* If full, return immediately */
-    if (table->size >= (table->table_size / 2))
-        return -HASHTABLE_FULL;
-
-    /* Find the best index */
-    uint64_t curr = hashtable_hash_int(table, key);
-    char *k, *currk;
-
-    /* Linear probing */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++) {
-        if (table->entries[curr].taken == false)
-            return curr;
-        k = (char *) table->entries[curr].key;
-        currk = (char *) key;
-        if (table->entries[curr].taken == true &&
-            STREQ(k, currk, strlen(k)) == true)
-            return curr;
-        curr = (curr + 1) % table->table_size;
+static unsigned groups_find_free(struct hashtable_group *groups, size_t size,
+                                 uint64_t hash,
+                                 struct hashtable_group **group) {
+    size_t mask = size / GROUP_SIZE - 1;
+    size_t index = hash & mask;
+    for (size_t i = 1; ; i++) {
+        struct hashtable_group *g = &groups[index];
+        unsigned match = group_match_free(g->ctrl);
+        if (match) {
+            *group = g;
+            return __builtin_ctz(match);
+        }
+        index = (index + i) & mask;
     }
-    return -HASHTABLE_FULL;
 }
 
 /*
- * Doubles the size of the hashtable, and rehashes all the elements
+ * Return the slot of a key, looked up in the table being moved too during a
+ * rehash, or NULL if not stored
  */
-static int hashtable_rehash(HashTable *table) {
-    assert(table);
-    size_t old_size;
-    struct hashtable_entry *curr;
-    /* Setup the new elements */
-    struct hashtable_entry *temp =
-        calloc(2 * table->table_size, sizeof(*temp));
-    if (!temp)
-        return -HASHTABLE_ERR;
+static struct hashtable_slot *hashtable_find(const HashTable *table,
+                                             const char *key, size_t len,
+                                             uint64_t hash,
+                                             struct hashtable_group **group) {
+    struct hashtable_slot *slot =
+        groups_find(table->groups, table->table_size, key, len, hash, group);
+    if (!slot && table->old_groups)
+        slot = groups_find(table->old_groups, table->old_size,
+                           key, len, hash, group);
+    return slot;
+}
 
-    /* Update the array */
-    curr = table->entries;
-    table->entries = temp;
+/* Return true if a group belongs to the table being moved */
+static bool hashtable_old_group(const HashTable *table,
+                                const struct hashtable_group *g) {
+    return table->old_groups && g >= table->old_groups &&
+        g < table->old_groups + table->old_size / GROUP_SIZE;
+}
 
-    /* Update the size */
-    old_size = table->table_size;
-    table->table_size = 2 * table->table_size;
-    table->size = 0;
+static size_t huge_page_align(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+}
 
-    int status;
+/* Return zeroed groups for a table of a given size, NULL on failure */
+static struct hashtable_group *groups_alloc(size_t table_size) {
+    size_t size = table_size / GROUP_SIZE * sizeof(struct hashtable_group);
+    if (size < HUGE_PAGE_SIZE)
+        return calloc(table_size / GROUP_SIZE, sizeof(struct hashtable_group));
+    // Map a huge page more and trim it off to align the start
+    size = huge_page_align(size);
+    char *map = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    char *start = (char *) huge_page_align((uintptr_t) map);
+    if (start > map)
+        munmap(map, start - map);
+    munmap(start + size, map + HUGE_PAGE_SIZE - start);
+    madvise(start, size, MADV_HUGEPAGE);
+    return (struct hashtable_group *) start;
+}
 
-    /* Rehash the elements */
-    for (size_t i = 0; i < old_size; i++) {
-        if (curr[i].taken == false)
+static void groups_free(struct hashtable_group *groups, size_t table_size) {
+    size_t size = table_size / GROUP_SIZE * sizeof(struct hashtable_group);
+    if (size < HUGE_PAGE_SIZE)
+        free(groups);
+    else
+        munmap(groups, huge_page_align(size));
+}
+
+static int hashtable_alloc(HashTable *table, size_t table_size) {
+    struct hashtable_group *groups = groups_alloc(table_size);
+    if (!groups)
+        return -HASHTABLE_OOM;
+    table->groups = groups;
+    table->table_size = table_size;
+    table->growth_left = MAX_LOAD(table_size) - table->size;
+    return HASHTABLE_OK;
+}
+
+/*
+ * Move the entries of the next slots of the old table to the new one, the
+ * stored hashes spare hashing and comparing keys again. The old table is
+ * released once drained.
+ */
+static void hashtable_rehash_step(HashTable *table, size_t slots_nr) {
+    struct hashtable_group *g;
+    for (; slots_nr > 0 && table->moved < table->old_size; slots_nr--) {
+        size_t i = table->moved++;
+        struct hashtable_group *old = &table->old_groups[i / GROUP_SIZE];
+        unsigned j = i % GROUP_SIZE;
+        if (!(old->ctrl[j] & CTRL_FULL))
             continue;
-        if ((status = hashtable_put(table, curr[i].key,
-                                    curr[i].val)) != HASHTABLE_OK)
-            return status;
+        unsigned k = groups_find_free(table->groups, table->table_size,
+                                      old->slots[j].hash, &g);
+        // Entries to move are already accounted for, not deleted slots
+        if (g->ctrl[k] == CTRL_DELETED)
+            table->growth_left++;
+        g->ctrl[k] = old->ctrl[j];
+        g->slots[k] = old->slots[j];
+        old->ctrl[j] = CTRL_DELETED;
     }
-    free(curr);
+    if (table->moved == table->old_size) {
+        groups_free(table->old_groups, table->old_size);
+        table->old_groups = NULL;
+    }
+}
+
+/*
+ * Start moving all the entries to a new table, doubling the size unless
+ * enough of the slots used are deleted ones, in which case they're just
+ * cleared out. A rehash still in progress is completed first.
+ */
+static int hashtable_rehash(HashTable *table) {
+    assert(table);
+    if (table->old_groups)
+        hashtable_rehash_step(table, table->old_size);
+    struct hashtable_group *groups = table->groups;
+    size_t old_size = table->table_size;
+    size_t new_size = table->size * 2 < MAX_LOAD(old_size) ?
+        old_size : old_size * 2;
+    int status = hashtable_alloc(table, new_size);
+    if (status != HASHTABLE_OK)
+        return status;
+    table->old_groups = groups;
+    table->old_size = old_size;
+    table->moved = 0;
     return HASHTABLE_OK;
 }
 
@@ -122,25 +309,35 @@ static int destroy_entry(struct hashtable_entry *entry) {
     return HASHTABLE_OK;
 }
 
-/*
- * Return an empty hashtable, or NULL on failure. The newly create HashTable is
- * dynamically allocated on the heap memory, so it must be released manually.
- */
-HashTable *hashtable_create(int (*destructor)(struct hashtable_entry *)) {
+static HashTable *hashtable_new(int (*destructor)(struct hashtable_entry *),
+                                bool keyed) {
     HashTable *table = malloc(sizeof(HashTable));
     if(!table)
         return NULL;
-    table->entries = calloc(INITIAL_SIZE, sizeof(struct hashtable_entry));
-    if(!table->entries) {
-        hashtable_release(table);
+    table->size = 0;
+    table->old_groups = NULL;
+    if (hashtable_alloc(table, INITIAL_SIZE) != HASHTABLE_OK) {
+        free(table);
         return NULL;
     }
     table->destructor = destructor ? destructor : destroy_entry;
-    table->table_size = INITIAL_SIZE;
-    table->size = 0;
+    table->keyed = keyed;
+    hash_key_init(&table->key);
     return table;
 }
 
+/*
+ * Return an empty hashtable, or NULL on failure. The newly create HashTable is
+ * dynamically allocated on the heap memory, so it must be released manually.
+ */
+HashTable *hashtable_create(int (*destructor)(struct hashtable_entry *)) {
+    return hashtable_new(destructor, false);
+}
+
+HashTable *hashtable_create_keyed(int (*destructor)(struct hashtable_entry *)) {
+    return hashtable_new(destructor, true);
+}
+
 size_t hashtable_size(const HashTable *table) {
     return table->size;
 }
@@ -150,27 +347,42 @@ int hashtable_exists(HashTable *table, const char *key) {
     return !ret ? 0 : 1;
 }
 
-/* Add a new key-value pair into the hashtable entries array, use chaining in
-   case of collision. */
+/*
+ * Add a new key-value pair into the hashtable, replacing the value of a key
+ * already stored
+ */
 int hashtable_put(HashTable *table, const char *key, void *val) {
     assert(table && key);
-    /* Find a place to put our value */
-    int index = hashtable_hash(table, (const uint8_t *) key);
-    while (index == -HASHTABLE_FULL){
-        if (hashtable_rehash(table) == -HASHTABLE_ERR)
-            return -HASHTABLE_ERR;
-        index = hashtable_hash(table, (const uint8_t *) key);
+    if (table->old_groups)
+        hashtable_rehash_step(table, REHASH_STEP);
+    size_t len = strlen(key);
+    uint64_t hash = hashtable_hash(table, key, len);
+    struct hashtable_group *g;
+    struct hashtable_slot *slot = hashtable_find(table, key, len, hash, &g);
+    if (slot) {
+        slot->key = key;
+        slot->val = val;
+        return HASHTABLE_OK;
     }
 
-    /* Set the entries */
-    table->entries[index].val = val;
-    table->entries[index].key = key;
-
-    /* Update taken flag, if it was false, update the size also */
-    if (table->entries[index].taken == false) {
-        table->entries[index].taken = true;
-        table->size++;
+    /* Find a place to put our value, a deleted slot doesn't count on load */
+    unsigned i = groups_find_free(table->groups, table->table_size, hash, &g);
+    if (g->ctrl[i] == CTRL_EMPTY && table->growth_left == 0) {
+        int status = hashtable_rehash(table);
+        if (status != HASHTABLE_OK)
+            return status;
+        i = groups_find_free(table->groups, table->table_size, hash, &g);
     }
+    if (g->ctrl[i] == CTRL_EMPTY)
+        table->growth_left--;
+    g->ctrl[i] = CTRL(hash);
+    slot = &g->slots[i];
+    slot->key = key;
+    slot->val = val;
+    slot->hash = hash;
+    slot->len = len;
+    memcpy(slot->prefix, key, len < KEY_PREFIX_LEN ? len : KEY_PREFIX_LEN);
+    table->size++;
     return HASHTABLE_OK;
 }
 
@@ -179,20 +391,13 @@ int hashtable_put(HashTable *table, const char *key, void *val) {
  */
 void *hashtable_get(HashTable *table, const char *key) {
     assert(table && key);
-    /* Find data location */
-    uint64_t curr = hashtable_hash_int(table, (const uint8_t *) key);
-
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++){
-        if (table->entries[curr].taken == true) {
-            if (STREQ(table->entries[curr].key, key, strlen(key)) == true)
-                return table->entries[curr].val;
-        }
-        curr = (curr + 1) % table->table_size;
-    }
-
-    /* Not found */
-    return NULL;
+    if (table->old_groups)
+        hashtable_rehash_step(table, REHASH_STEP);
+    size_t len = strlen(key);
+    struct hashtable_group *g;
+    struct hashtable_slot *slot =
+        hashtable_find(table, key, len, hashtable_hash(table, key, len), &g);
+    return slot ? slot->val : NULL;
 }
 
 /*
@@ -200,29 +405,86 @@ void *hashtable_get(HashTable *table, const char *key) {
  */
 int hashtable_del(HashTable *table, const char *key) {
     assert(table && key);
-    /* Find key */
-    uint64_t curr = hashtable_hash_int(table, (const uint8_t *) key);
-
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++) {
-        // check wether the position in array is in use
-        if (table->entries[curr].taken == true) {
-            if (STREQ(table->entries[curr].key, key, strlen(key)) == true) {
-                /* Blank out the fields */
-                table->entries[curr].taken = false;
-                /* Reduce the size */
-                table->size--;
-                /* Destroy the entry */
-                table->destructor(&table->entries[curr]);
-
-                return HASHTABLE_OK;
-            }
+    if (table->old_groups)
+        hashtable_rehash_step(table, REHASH_STEP);
+    size_t len = strlen(key);
+    struct hashtable_group *g;
+    struct hashtable_slot *slot =
+        hashtable_find(table, key, len, hashtable_hash(table, key, len), &g);
+    if (!slot)
+        return -HASHTABLE_ERR;
+
+    /*
+     * No probe ever went past a group with an empty slot, the slot can be
+     * emptied too, else it has to be marked as deleted. An entry of the old
+     * table won't be moved anymore.
+     */
+    unsigned i = slot - g->slots;
+    if (hashtable_old_group(table, g)) {
+        g->ctrl[i] = CTRL_DELETED;
+        table->growth_left++;
+    } else if (group_match(g->ctrl, CTRL_EMPTY)) {
+        g->ctrl[i] = CTRL_EMPTY;
+        table->growth_left++;
+    } else {
+        g->ctrl[i] = CTRL_DELETED;
+    }
+    table->size--;
+
+    /* Destroy the entry, the key may be released with it */
+    struct hashtable_entry entry = {
+        .key = slot->key,
+        .val = slot->val,
+        .taken = true
+    };
+    table->destructor(&entry);
+    return HASHTABLE_OK;
+}
+
+/*
+ * Iterate through all key-value pairs in an array of groups, applying a
+ * function to each pair with an additional parameter, stops at the first
+ * failure
+ */
+static int groups_iterate(struct hashtable_group *groups, size_t size,
+                          int (*func)(struct hashtable_entry *, void *),
+                          void *param) {
+    for (size_t i = 0; i < size / GROUP_SIZE; i++) {
+        struct hashtable_group *g = &groups[i];
+        for (int j = 0; j < GROUP_SIZE; j++) {
+            if (!(g->ctrl[j] & CTRL_FULL))
+                continue;
+            /* Apply function to the key-value entry */
+            struct hashtable_entry data = {
+                .key = g->slots[j].key,
+                .val = g->slots[j].val,
+                .taken = true
+            };
+            int status = func(&data, param);
+            if (status != HASHTABLE_OK)
+                return status;
         }
-        curr = (curr + 1) % table->table_size;
     }
+    return HASHTABLE_OK;
+}
+
+/* Entries not moved yet by a rehash are visited after the others */
+static int hashtable_iterate(HashTable *table,
+                             int (*func)(struct hashtable_entry *, void *),
+                             void *param) {
+    int status = groups_iterate(table->groups, table->table_size, func, param);
+    if (status == HASHTABLE_OK && table->old_groups)
+        status = groups_iterate(table->old_groups, table->old_size,
+                                func, param);
+    return status;
+}
 
-    /* Data not found */
-    return -HASHTABLE_ERR;
+struct map_func {
+    int (*func)(struct hashtable_entry *);
+};
+
+static int apply(struct hashtable_entry *entry, void *arg) {
+    return ((struct map_func *) arg)->func(entry);
 }
 
 /*
@@ -235,18 +497,8 @@ int hashtable_map(HashTable *table, int (*func)(struct hashtable_entry *)) {
     /* On empty hashmap, return immediately */
     if (!table || table->size <= 0)
         return -HASHTABLE_ERR;
-
-    /* Linear probing */
-    for (size_t i = 0; i < table->table_size; i++) {
-        if (table->entries[i].taken == true) {
-            /* Apply function to the key-value entry */
-            struct hashtable_entry data = table->entries[i];
-            int status = func(&data);
-            if (status != HASHTABLE_OK)
-                return status;
-        }
-    }
-    return HASHTABLE_OK;
+    struct map_func f = { func };
+    return hashtable_iterate(table, apply, &f);
 }
 
 /*
@@ -260,18 +512,7 @@ int hashtable_map2(HashTable *table,
     /* On empty hashmap, return immediately */
     if (!table || table->size <= 0)
         return -HASHTABLE_ERR;
-
-    /* Linear probing */
-    for (size_t i = 0; i < table->table_size; i++) {
-        if (table->entries[i].taken == true) {
-            /* Apply function to the key-value entry */
-            struct hashtable_entry data = table->entries[i];
-            int status = func(&data, param);
-            if (status != HASHTABLE_OK)
-                return status;
-        }
-    }
-    return HASHTABLE_OK;
+    return hashtable_iterate(table, func, param);
 }
 
 /*
@@ -282,118 +523,8 @@ void hashtable_release(HashTable *table){
     if (!table)
         return;
     hashtable_map(table, table->destructor);
-    if (!table || !table->entries)
-        return;
-    free(table->entries);
+    groups_free(table->groups, table->table_size);
+    if (table->old_groups)
+        groups_free(table->old_groups, table->old_size);
     free(table);
 }
-
-/* The implementation here was originally done by Gary S. Brown. Slightly
- * modified by Pete Warden, without any imposition on the reuse of the code.
- */
-
-/* ============================================================= */
-/*  COPYRIGHT (C) 1986 Gary S. Brown.  You may use this program, or       */
-/*  code or tables extracted from it, as desired without restriction.     */
-/*                                                                        */
-/*  First, the polynomial itself and its table of feedback terms.  The    */
-/*  polynomial is                                                         */
-/*  X^32+X^26+X^23+X^22+X^16+X^12+X^11+X^10+X^8+X^7+X^5+X^4+X^2+X^1+X^0   */
-/*                                                                        */
-/*  Note that we take it "backwards" and put the highest-order term in    */
-/*  the lowest-order bit.  The X^32 term is "implied"; the LSB is the     */
-/*  X^31 term, etc.  The X^0 term (usually shown as "+1") results in      */
-/*  the MSB being 1.                                                      */
-/*                                                                        */
-/*  Note that the usual hardware shift register implementation, which     */
-/*  is what we're using (we're merely optimizing it by doing eight-bit    */
-/*  chunks at a time) shifts bits into the lowest-order term.  In our     */
-/*  implementation, that means shifting towards the right.  Why do we     */
-/*  do it this way?  Because the calculated CRC must be transmitted in    */
-/*  order from highest-order term to lowest-order term.  UARTs transmit   */
-/*  characters in order from LSB to MSB.  By storing the CRC this way,    */
-/*  we hand it to the UART in the order low-byte to high-byte; the UART   */
-/*  sends each low-bit to high-bit; and the result is transmission bit   */
-/*  by bit from highest- to lowest-order term without requiring any bit   */
-/*  shuffling on our part.  Reception works similarly.                    */
-/*                                                                        */
-/*  The feedback terms table consists of 256, 32-bit entries.  Notes:     */
-/*                                                                        */
-/*      The table can be generated at runtime if desired; code to do so   */
-/*      is shown later.  It might not be obvious, but the feedback        */
-/*      terms simply represent the results of eight shift/xor opera-      */
-/*      tions for all combinations of data and CRC register values.       */
-/*                                                                        */
-/*      The values must be right-shifted by eight bits by the "updcrc"    */
-/*      logic; the shift must be unsigned (bring in zeroes).  On some     */
-/*      hardware you could probably optimize the shift in assembler by    */
-/*      using byte-swap instructions.                                     */
-/*      polynomial $edb88320                                              */
-/*                                                                        */
-/*  --------------------------------------------------------------------  */
-
-static unsigned long crc32_tab[] = {
-    0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-    0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-    0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-    0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-    0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-    0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-    0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-    0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-    0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-    0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-    0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-    0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-    0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-    0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-    0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-    0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-    0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-    0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-    0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-    0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-    0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-    0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-    0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-    0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-    0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-    0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-    0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-    0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-    0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-    0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-    0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-    0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-    0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-    0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-    0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-    0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-    0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-    0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-    0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-    0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-    0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-    0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-    0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-    0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-    0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-    0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-    0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-    0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-    0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-    0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-    0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-    0x2d02ef8dL
-};
-
-/* Return a 32-bit CRC of the contents of the buffer. */
-static unsigned long crc32(const uint8_t *s, unsigned int len) {
-    unsigned int i;
-    uint64_t crc32val;
-    crc32val = 0LL;
-    for (i = 0;  i < len;  i ++) {
-        crc32val = crc32_tab[(crc32val ^ s[i]) & 0xff] ^ (crc32val >> 8);
-    }
-    return crc32val;
-}
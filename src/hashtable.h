@@ -19,7 +19,10 @@ struct hashtable_entry {
 
 /*
  * An HashTable has some maximum size and current size, as well as the data to
- * hold.
+ * hold. Open addressing with control bytes matched a group of 16 slots at a
+ * time, it grows doubling its size past a load of 7/8, moving the entries to
+ * the new table a few at a time on the next operations. Keys are compared
+ * exactly, the table stores pointers to them, not copies.
  */
 typedef struct hashtable HashTable;
 
@@ -30,6 +33,13 @@ typedef struct hashtable HashTable;
  */
 HashTable *hashtable_create(int (*destructor)(struct hashtable_entry *));
 
+/*
+ * Same as `hashtable_create`, hashing keys with a random secret instead of
+ * just a seed, for tables keyed by strings chosen by clients, e.g. client ids,
+ * that could otherwise be crafted to all collide. Slower to hash.
+ */
+HashTable *hashtable_create_keyed(int (*destructor)(struct hashtable_entry *));
+
 /* Destroy the hashtable by calling functor `destructor` on every
  * `struct hashtable_entry`, thus it needs to have a defined destructor function
  * for each different data-type inserted. In case of a NULL destructor, it' ll call
@@ -117,12 +117,38 @@ List *list_push_back(List *l, void *val) {
     return l;
 }
 
+/*
+ * Remove the first node of the list, returning the data it was storing
+ * Complexity: O(1)
+ */
+void *list_pop(List *l) {
+    if (!l || l->len == 0)
+        return NULL;
+    struct list_node *head = l->head;
+    void *data = head->data;
+    l->head = head->next;
+    if (!l->head)
+        l->tail = NULL;
+    l->len--;
+    free(head);
+    return data;
+}
+
+/* Point the tail to the last node, to be called after a removal */
+static void list_update_tail(List *l) {
+    l->tail = l->head;
+    while (l->tail && l->tail->next)
+        l->tail = l->tail->next;
+}
+
 void list_remove(List *l, struct list_node *node, compare_func cmp) {
     if (!l || !node)
         return;
     int counter = 0;
     l->head = list_node_remove(l->head, node, cmp, &counter);
     l->len -= counter;
+    if (counter > 0)
+        list_update_tail(l);
 }
 
 static struct list_node *list_node_remove(struct list_node *head,
@@ -161,13 +187,14 @@ static struct list_node *list_remove_single_node(struct list_node *head,
 }
 
 struct list_node *list_remove_node(List *list, void *data, compare_func cmp) {
-    if (list->len == 0 || !list)
+    if (!list || list->len == 0)
         return NULL;
     struct list_node *node = NULL;
-    list_remove_single_node(list->head, data, &node, cmp);
+    list->head = list_remove_single_node(list->head, data, &node, cmp);
     if (node) {
         list->len--;
-        node->next = NULL;
+        if (list->tail == node)
+            list_update_tail(list);
     }
     return node;
 }
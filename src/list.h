@@ -40,6 +40,9 @@ List *list_push(List *, void *);
 /* Insert data into a node and push it to the back of the list */
 List *list_push_back(List *, void *);
 
+/* Remove the front node of the list returning its data, NULL if empty */
+void *list_pop(List *);
+
 /*
  * Remove a node from the list based on a compare function that must be
  * previously defined and passed in as a function pointer, accept two void
@@ -49,7 +52,8 @@ void list_remove(List *, struct list_node *, compare_func);
 
 /*
  * Remove a single node from the list, the first one satisfy compare_func
- * criteria, without de-allocating it
+ * criteria, without de-allocating it. The node keeps pointing to the next
+ * one, so that an iteration standing on it can go on.
  */
 struct list_node *list_remove_node(List *, void *, compare_func);
 
@@ -1,8 +1,10 @@
+#include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include "util.h"
 #include "pack.h"
 #include "mqtt.h"
+#include "arena.h"
 
 /**
  * MQTT v3.1.1 standard. Remaining length field for fixed header
@@ -10,21 +12,22 @@
  */
 static const int MAX_LEN_BYTES = 4;
 
-static size_t unpack_mqtt_connect(const unsigned char *, union mqtt_header *,
-                                  union mqtt_packet *);
-static size_t unpack_mqtt_publish(const unsigned char *, union mqtt_header *,
-                                  union mqtt_packet *);
-static size_t unpack_mqtt_subscribe(const unsigned char *, union mqtt_header *,
-                                    union mqtt_packet *);
-static size_t unpack_mqtt_unsubscribe(const unsigned char *,
-                                      union mqtt_header *, union mqtt_packet *);
-static size_t unpack_mqtt_ack(const unsigned char *, union mqtt_header *,
-                              union mqtt_packet *);
-static unsigned char *pack_mqtt_header(const union mqtt_header *);
-static unsigned char *pack_mqtt_ack(const union mqtt_packet *);
-static unsigned char *pack_mqtt_connack(const union mqtt_packet *);
-static unsigned char *pack_mqtt_suback(const union mqtt_packet *);
-static unsigned char *pack_mqtt_publish(const union mqtt_packet *);
+static int unpack_mqtt_connect(unsigned char *, union mqtt_header *,
+                               union mqtt_packet *, struct arena *);
+static int unpack_mqtt_publish(unsigned char *, union mqtt_header *,
+                               union mqtt_packet *, struct arena *);
+static int unpack_mqtt_subscribe(unsigned char *, union mqtt_header *,
+                                 union mqtt_packet *, struct arena *);
+static int unpack_mqtt_unsubscribe(unsigned char *,
+                                   union mqtt_header *, union mqtt_packet *,
+                                   struct arena *);
+static int unpack_mqtt_ack(unsigned char *, union mqtt_header *,
+                           union mqtt_packet *, struct arena *);
+static struct bytestring *pack_mqtt_header(const union mqtt_header *);
+static struct bytestring *pack_mqtt_ack(const union mqtt_packet *);
+static struct bytestring *pack_mqtt_connack(const union mqtt_packet *);
+static struct bytestring *pack_mqtt_suback(const union mqtt_packet *);
+static struct bytestring *pack_mqtt_publish(const union mqtt_packet *);
 
 /**
  * Encode remaining length on a MQTT packet header, comprised of variable
@@ -66,175 +69,211 @@ unsigned long long mqtt_decode_length(const unsigned char **buf) {
 }
 
 /**
- * MQTT unpacking functions
+ * MQTT unpacking functions, strings and payloads are not copied but point
+ * into the buffer of the packet, valid as long as it is. Strings are moved
+ * over their length prefix to be NUL-terminated, payloads are left in place.
  */
-static size_t unpack_mqtt_connect(const unsigned char *buf,
-                                  union mqtt_header *hdr,
-                                  union mqtt_packet *pkt) {
+static int unpack_mqtt_connect(unsigned char *buf,
+                               union mqtt_header *hdr,
+                               union mqtt_packet *pkt,
+                               struct arena *arena) {
 
+  (void) arena;
   struct mqtt_connect connect = {.header = *hdr};
   pkt->connect = connect;
-  const unsigned char *init = buf;
   /**
    * Second byte of the fixed header, containts the length of the
    * remaining bytes for the connect packet
    */
-  size_t len = mqtt_decode_length(&buf);
-  // ignore checks on protocol name and reserved bits. skip to 8th byte
-  buf = init + 8;
+  size_t len = mqtt_decode_length((const unsigned char **)&buf);
+  const unsigned char *end = buf + len;
+  /**
+   * ignore checks on protocol name and reserved bits, the variable header
+   * is 10 bytes long: protocol name (6), level, flags and keepalive (2)
+   */
+  if (len < 10)
+    return -1;
+  buf += 7;
   // read variable header byte flags
   pkt->connect.byte = unpack_u8((const uint8_t **)&buf);
   // read keepalive MSB and LSB (2 byte words)
   pkt->connect.payload.keepalive = unpack_u16((const uint8_t **)&buf);
-  // Read CID length (2 byte words)
-  uint16_t cid_len = unpack_u16((const uint8_t **)&buf);
   // read the client id
-  if (cid_len > 0) {
-    pkt->connect.payload.client_id = malloc(cid_len + 1);
-    unpack_bytes((const uint8_t **)&buf, cid_len,
-                 pkt->connect.payload.client_id);
-  }
+  if (unpack_string16(&buf, end, &pkt->connect.payload.client_id) < 0)
+    return -1;
   //   read the will topic and message if will is set on flags
   if (pkt->connect.bits.will == 1) {
-    unpack_string16(&buf, &pkt->connect.payload.will_topic);
-    unpack_string16(&buf, &pkt->connect.payload.will_message);
+    if (unpack_string16(&buf, end, &pkt->connect.payload.will_topic) < 0
+        || unpack_string16(&buf, end, &pkt->connect.payload.will_message) < 0)
+      return -1;
   }
   //   read the username if username flag is set
-  if (pkt->connect.bits.username == 1)
-    unpack_string16(&buf, &pkt->connect.payload.username);
+  if (pkt->connect.bits.username == 1
+      && unpack_string16(&buf, end, &pkt->connect.payload.username) < 0)
+    return -1;
 
   // read the password if the password flag is set
-  if (pkt->connect.bits.password == 1)
-    unpack_string16(&buf, &pkt->connect.payload.password);
-  return len;
+  if (pkt->connect.bits.password == 1
+      && unpack_string16(&buf, end, &pkt->connect.payload.password) < 0)
+    return -1;
+  return 0;
 }
 
-static size_t unpack_mqtt_publish(const unsigned char *buf,
-                                  union mqtt_header *hdr,
-                                  union mqtt_packet *pkt) {
+static int unpack_mqtt_publish(unsigned char *buf,
+                               union mqtt_header *hdr,
+                               union mqtt_packet *pkt,
+                               struct arena *arena) {
+  (void) arena;
   struct mqtt_publish publish = {.header = *hdr};
   pkt->publish = publish;
   /**
    * Second byte of the fixed header. Contains the length of the
    * remaining bytes of the publish packet
    */
-  size_t len = mqtt_decode_length(&buf);
+  size_t len = mqtt_decode_length((const unsigned char **)&buf);
+  const unsigned char *end = buf + len;
   //   Read topic length and topic of the soon-to-be-published message
-  pkt->publish.topiclen = unpack_string16(&buf, &pkt->publish.topic);
-  uint16_t message_len = len;
+  int topiclen = unpack_string16(&buf, end, &pkt->publish.topic);
+  if (topiclen < 0)
+    return -1;
+  pkt->publish.topiclen = topiclen;
   if (publish.header.bits.qos > AT_MOST_ONCE) {
+    if (end - buf < (ptrdiff_t)sizeof(uint16_t))
+      return -1;
     pkt->publish.pkt_id = unpack_u16(((const uint8_t **)&buf));
-    message_len -= sizeof(uint8_t);
+    // a packet id of 0 is a protocol violation (MQTT-2.3.1-1)
+    if (pkt->publish.pkt_id == 0)
+      return -1;
   }
   /**
-   * Message len is calculated by subtracting the length of the variable
-   * header from the remaining length field that is in the fixed header
+   * The payload is whatever follows the variable header up to the remaining
+   * length found in the fixed header, it's only pointed to, so decoding costs
+   * the same no matter its size
    */
-  message_len -= (sizeof(uint16_t) + pkt->publish.topiclen);
-  pkt->publish.payloadlen = message_len;
-  pkt->publish.payload = malloc(message_len + 1);
-  unpack_bytes((const uint8_t **)&buf, message_len, pkt->publish.payload);
-  return len;
+  pkt->publish.payloadlen = end - buf;
+  pkt->publish.payload = buf;
+  return 0;
 }
 
-static size_t unpack_mqtt_subscribe(const unsigned char *buf,
-                                    union mqtt_header *hdr,
-                                    union mqtt_packet *pkt) {
+/*
+ * Count the filters of a SUBSCRIBE or UNSUBSCRIBE, each one followed by a
+ * number of option bytes, so that the tuples are allocated at once
+ */
+static unsigned count_filters(const unsigned char *buf, size_t len,
+                              size_t options) {
+  unsigned n = 0;
+  while (len >= sizeof(uint16_t)) {
+    size_t filter_len = sizeof(uint16_t) + unpack_u16(&buf) + options;
+    if (filter_len > len)
+      break;
+    buf += filter_len - sizeof(uint16_t);
+    len -= filter_len;
+    n++;
+  }
+  return n;
+}
+
+static int unpack_mqtt_subscribe(unsigned char *buf,
+                                 union mqtt_header *hdr,
+                                 union mqtt_packet *pkt,
+                                 struct arena *arena) {
   struct mqtt_subscribe subscribe = {.header = *hdr};
   /**
    * Second byte of the fixed header. Contains the length of the
    * remaining bytes of the subscribe packet
    */
-  size_t len = mqtt_decode_length(&buf);
-  size_t remaining_bytes = len;
+  size_t len = mqtt_decode_length((const unsigned char **)&buf);
+  const unsigned char *end = buf + len;
+  if (len < sizeof(uint16_t))
+    return -1;
   //   read packet id
   subscribe.pkt_id = unpack_u16((const uint8_t **)&buf);
-  remaining_bytes -= sizeof(uint16_t);
+  if (subscribe.pkt_id == 0)
+    return -1;
   /**
-   * read in a loop all the remaining bytes that is specified by
-   * the length found in the fixed header.
    * From now on, the payload consists of 3-tuples formed by
    * - topic length
    * - topic filter (string)
    * - qos
+   * as many as they fit in the remaining length found in the fixed header.
    */
-  int i = 0;
-  while (remaining_bytes > 0) {
-    // read length bytes of the first topic filter
-    remaining_bytes -= sizeof(uint16_t);
-    // we have to make room for additional tuples
-    subscribe.tuples =
-        realloc(subscribe.tuples, (i + 1) * sizeof(*subscribe.tuples));
+  subscribe.tuples_len = count_filters(buf, end - buf, sizeof(uint8_t));
+  // it must carry at least one
+  if (subscribe.tuples_len == 0)
+    return -1;
+  subscribe.tuples =
+      arena_alloc(arena, subscribe.tuples_len * sizeof(*subscribe.tuples));
+  for (unsigned i = 0; i < subscribe.tuples_len; i++) {
     subscribe.tuples[i].topic_len =
-        unpack_string16(&buf, &subscribe.tuples[i].topic);
-    remaining_bytes -= subscribe.tuples[i].topic_len;
+        unpack_string16(&buf, end, &subscribe.tuples[i].topic);
     subscribe.tuples[i].qos = unpack_u8((const uint8_t **)&buf);
-    len -= sizeof(uint8_t);
-    i++;
   }
-  subscribe.tuples_len = i;
   pkt->subscribe = subscribe;
-  return len;
+  return 0;
 }
 
-static size_t unpack_mqtt_unsubscribe(const unsigned char *buf,
-                                      union mqtt_header *hdr,
-                                      union mqtt_packet *pkt) {
+static int unpack_mqtt_unsubscribe(unsigned char *buf,
+                                   union mqtt_header *hdr,
+                                   union mqtt_packet *pkt,
+                                   struct arena *arena) {
   struct mqtt_unsubscribe unsubscribe = {.header = *hdr};
   /**
    * Second byte of the fixed header. Contains the length of the
    * remaining bytes of the unsubscribe packet
    */
-  size_t len = mqtt_decode_length(&buf);
-  size_t remaining_bytes = len;
+  size_t len = mqtt_decode_length((const unsigned char **)&buf);
+  const unsigned char *end = buf + len;
+  if (len < sizeof(uint16_t))
+    return -1;
   // read packet id
   unsubscribe.pkt_id = unpack_u16((const uint8_t **)&buf);
-  remaining_bytes -= sizeof(uint16_t);
-
+  if (unsubscribe.pkt_id == 0)
+    return -1;
   /**
-   * read in a loop all the remaining bytes that is specified by
-   * the length found in the fixed header.
-   * From now on, the payload consists of 3-tuples formed by
+   * From now on, the payload consists of 2-tuples formed by
    * - topic length
    * - topic filter (string)
+   * as many as they fit in the remaining length found in the fixed header.
    */
-  int i = 0;
-  while (remaining_bytes > 0) {
-    // read length bytes of the first topic filter
-    remaining_bytes -= sizeof(uint16_t);
-    // we have to make room for additional tuples
-    unsubscribe.tuples =
-        realloc(unsubscribe.tuples, (i + 1) * sizeof(*unsubscribe.tuples));
+  unsubscribe.tuples_len = count_filters(buf, end - buf, 0);
+  // it must carry at least one
+  if (unsubscribe.tuples_len == 0)
+    return -1;
+  unsubscribe.tuples =
+      arena_alloc(arena, unsubscribe.tuples_len * sizeof(*unsubscribe.tuples));
+  for (unsigned i = 0; i < unsubscribe.tuples_len; i++)
     unsubscribe.tuples[i].topic_len =
-        unpack_string16(&buf, &unsubscribe.tuples[i].topic);
-    remaining_bytes -= unsubscribe.tuples[i].topic_len;
-    i++;
-  }
-  unsubscribe.tuples_len = i;
+        unpack_string16(&buf, end, &unsubscribe.tuples[i].topic);
   pkt->unsubscribe = unsubscribe;
-  return len;
+  return 0;
 }
 
-static size_t unpack_mqtt_ack(const unsigned char *buf, union mqtt_header *hdr,
-                              union mqtt_packet *pkt) {
+static int unpack_mqtt_ack(unsigned char *buf, union mqtt_header *hdr,
+                           union mqtt_packet *pkt, struct arena *arena) {
+  (void) arena;
   struct mqtt_ack ack = {.header = *hdr};
   /**
    * Second byte of the fixed header. Contains the length of the
    * remaining bytes of the ack packet
    */
-  size_t len = mqtt_decode_length(&buf);
+  size_t len = mqtt_decode_length((const unsigned char **)&buf);
+  if (len < sizeof(uint16_t))
+    return -1;
   ack.pkt_id = unpack_u16((const uint8_t **)&buf);
+  if (ack.pkt_id == 0)
+    return -1;
   pkt->ack = ack;
-  return len;
+  return 0;
 }
 
-typedef size_t mqtt_unpack_handler(const unsigned char *, union mqtt_header *,
-                                   union mqtt_packet *);
+typedef int mqtt_unpack_handler(unsigned char *, union mqtt_header *,
+                                union mqtt_packet *, struct arena *);
 /**
  * Unpack functions mapping unpacking_handlers positioned in the
- * array based on packet type (enum in mqtt.h)
+ * array based on packet type (enum in mqtt.h), NULL for the ones only sent
+ * by the broker
  */
-static mqtt_unpack_handler *unpack_handlers[11] = {NULL,
+static mqtt_unpack_handler *unpack_handlers[15] = {NULL,
                                                    unpack_mqtt_connect,
                                                    NULL,
                                                    unpack_mqtt_publish,
@@ -244,19 +283,25 @@ static mqtt_unpack_handler *unpack_handlers[11] = {NULL,
                                                    unpack_mqtt_ack,
                                                    unpack_mqtt_subscribe,
                                                    NULL,
-                                                   unpack_mqtt_unsubscribe};
+                                                   unpack_mqtt_unsubscribe,
+                                                   NULL,
+                                                   NULL,
+                                                   NULL,
+                                                   NULL};
 
-int unpack_mqtt_packet(const unsigned char *buf, union mqtt_packet *pkt) {
-  int rc = 0;
+int unpack_mqtt_packet(unsigned char *buf, union mqtt_packet *pkt,
+                       struct arena *arena) {
   // read the first byte of the fixed header
   unsigned char type = *buf;
   union mqtt_header header = {.byte = type};
   if (header.bits.type == DISCONNECT || header.bits.type == PINGREQ ||
-      header.bits.type == PINGRESP)
+      header.bits.type == PINGRESP) {
     pkt->header = header;
-  else
-    rc = unpack_handlers[header.bits.type](++buf, &header, pkt);
-  return rc;
+    return 0;
+  }
+  if (header.bits.type >= 15 || !unpack_handlers[header.bits.type])
+    return -1;
+  return unpack_handlers[header.bits.type](++buf, &header, pkt, arena);
 }
 
 /**
@@ -315,46 +360,22 @@ struct mqtt_publish *mqtt_packet_publish(unsigned char byte,
 }
 
 void mqtt_packet_release(union mqtt_packet *pkt, unsigned type) {
-  // all pointer/arrays that used malloc must be released
+  // decoded packets live in their arena, only built ones malloc
   switch (type) {
-  case CONNECT:
-    free(pkt->connect.payload.client_id);
-    if (pkt->connect.bits.username == 1)
-      free(pkt->connect.payload.username);
-    if (pkt->connect.bits.password == 1)
-      free(pkt->connect.payload.password);
-    if (pkt->connect.bits.will == 1) {
-      free(pkt->connect.payload.will_message);
-      free(pkt->connect.payload.will_topic);
-    }
-    break;
-  case SUBSCRIBE:
-    for (unsigned i = 0; i < pkt->subscribe.tuples_len; i++)
-      free(pkt->subscribe.tuples[i].topic);
-    free(pkt->subscribe.tuples);
-    break;
-  case UNSUBSCRIBE:
-    for (unsigned i = 0; i < pkt->unsubscribe.tuples_len; i++)
-      free(pkt->unsubscribe.tuples[i].topic);
-    free(pkt->unsubscribe.tuples);
-    break;
   case SUBACK:
     free(pkt->suback.rcs);
     break;
-  case PUBLISH:
-    free(pkt->publish.topic);
-    free(pkt->publish.payload);
-    break;
   default:
     break;
   }
 }
 
 /**
- * MQTT packing functions
+ * MQTT packing functions, packets are packed in bytestrings sized on their
+ * exact length, ready to be sent out
  */
 
-typedef unsigned char *mqtt_pack_handler(const union mqtt_packet *);
+typedef struct bytestring *mqtt_pack_handler(const union mqtt_packet *);
 
 static mqtt_pack_handler *pack_handlers[13] = {NULL,
                                                NULL,
@@ -370,18 +391,18 @@ static mqtt_pack_handler *pack_handlers[13] = {NULL,
                                                pack_mqtt_ack,
                                                NULL};
 
-static unsigned char *pack_mqtt_header(const union mqtt_header *hdr) {
-  unsigned char *packed = malloc(MQTT_HEADER_LEN);
-  unsigned char *ptr = packed;
+static struct bytestring *pack_mqtt_header(const union mqtt_header *hdr) {
+  struct bytestring *packed = bytestring_create(MQTT_HEADER_LEN);
+  unsigned char *ptr = packed->data;
   pack_u8(&ptr, hdr->byte);
   /* Encode 0 length bytes, message like this have only a fixed header */
   mqtt_encode_length(ptr, 0);
   return packed;
 }
 
-static unsigned char *pack_mqtt_ack(const union mqtt_packet *pkt) {
-  unsigned char *packed = malloc(MQTT_ACK_LEN);
-  unsigned char *ptr = packed;
+static struct bytestring *pack_mqtt_ack(const union mqtt_packet *pkt) {
+  struct bytestring *packed = bytestring_create(MQTT_ACK_LEN);
+  unsigned char *ptr = packed->data;
   pack_u8(&ptr, pkt->ack.header.byte);
   mqtt_encode_length(ptr, MQTT_HEADER_LEN);
   ptr++;
@@ -389,9 +410,9 @@ static unsigned char *pack_mqtt_ack(const union mqtt_packet *pkt) {
   return packed;
 }
 
-static unsigned char *pack_mqtt_connack(const union mqtt_packet *pkt) {
-  unsigned char *packed = malloc(MQTT_ACK_LEN);
-  unsigned char *ptr = packed;
+static struct bytestring *pack_mqtt_connack(const union mqtt_packet *pkt) {
+  struct bytestring *packed = bytestring_create(MQTT_ACK_LEN);
+  unsigned char *ptr = packed->data;
   pack_u8(&ptr, pkt->connack.header.byte);
   mqtt_encode_length(ptr, MQTT_HEADER_LEN);
   ptr++;
@@ -400,10 +421,10 @@ static unsigned char *pack_mqtt_connack(const union mqtt_packet *pkt) {
   return packed;
 }
 
-static unsigned char *pack_mqtt_suback(const union mqtt_packet *pkt) {
+static struct bytestring *pack_mqtt_suback(const union mqtt_packet *pkt) {
   size_t pktlen = MQTT_HEADER_LEN + sizeof(uint16_t) + pkt->suback.rcslen;
-  unsigned char *packed = malloc(pktlen + 0);
-  unsigned char *ptr = packed;
+  struct bytestring *packed = bytestring_create(pktlen);
+  unsigned char *ptr = packed->data;
   pack_u8(&ptr, pkt->suback.header.byte);
   size_t len = sizeof(uint16_t) + pkt->suback.rcslen;
   int step = mqtt_encode_length(ptr, len);
@@ -414,7 +435,7 @@ static unsigned char *pack_mqtt_suback(const union mqtt_packet *pkt) {
   return packed;
 }
 
-static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt) {
+static struct bytestring *pack_mqtt_publish(const union mqtt_packet *pkt) {
   /*
    * We must calculate the total length of the packet including header and
    * length field of the fixed header part
@@ -433,8 +454,8 @@ static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt) {
   else if ((pktlen - 1) > 0x80)
     remaininglen_offset = 1;
   pktlen += remaininglen_offset;
-  unsigned char *packed = malloc(pktlen);
-  unsigned char *ptr = packed;
+  struct bytestring *packed = bytestring_create(pktlen);
+  unsigned char *ptr = packed->data;
   pack_u8(&ptr, pkt->publish.header.byte);
   // Total len of the packet excluding fixed header len
   len += (pktlen - MQTT_HEADER_LEN - remaininglen_offset);
@@ -446,16 +467,17 @@ static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt) {
   ptr += step;
   // Topic len followed by topic name in bytes
   pack_u16(&ptr, pkt->publish.topiclen);
-  pack_bytes(&ptr, pkt->publish.topic);
+  pack_bytes(&ptr, pkt->publish.topic, pkt->publish.topiclen);
   // Packet id
   if (pkt->header.bits.qos > AT_MOST_ONCE)
     pack_u16(&ptr, pkt->publish.pkt_id);
   // Finally the payload, same way of topic, payload len -> payload
-  pack_bytes(&ptr, pkt->publish.payload);
+  pack_bytes(&ptr, pkt->publish.payload, pkt->publish.payloadlen);
   return packed;
 }
 
-unsigned char *pack_mqtt_packet(const union mqtt_packet *pkt, unsigned type) {
+struct bytestring *pack_mqtt_packet(const union mqtt_packet *pkt,
+                                   unsigned type) {
   if (type == PINGREQ || type == PINGRESP)
     return pack_mqtt_header(&pkt->header);
   return pack_handlers[type](pkt);
@@ -3,6 +3,9 @@
 
 #include <stdio.h>
 
+struct arena;
+struct bytestring;
+
 #define MQTT_HEADER_LEN 2
 #define MQTT_ACK_LEN 4
 
@@ -14,7 +17,7 @@
 #define PUBLISH_BYTE 0X30
 #define PUBACK_BYTE 0X40
 #define PUBREC_BYTE 0X50
-#define PUBREL_BYTE 0X60
+#define PUBREL_BYTE 0X62
 #define PUBCOMP_BYTE 0X70
 #define SUBACK_BYTE 0X90
 #define UNSUBACK_BYTE 0XB0
@@ -118,7 +121,7 @@ struct mqtt_publish {
   unsigned short pkt_id;
   unsigned short topiclen;
   unsigned char *topic;
-  unsigned short payloadlen;
+  size_t payloadlen;
   unsigned char *payload;
 };
 
@@ -150,9 +153,17 @@ union mqtt_packet {
 // essential communication functions, 2 for each direction
 
 int mqtt_encode_length(unsigned char *, size_t);
-unsigned char *pack_mqtt_packet(const union mqtt_packet *, unsigned);
-
-int unpack_mqtt_packet(const unsigned char *, union mqtt_packet *);
+struct bytestring *pack_mqtt_packet(const union mqtt_packet *, unsigned);
+
+/*
+ * Decode a packet, its strings and payload are views into the buffer, which
+ * is modified in place, the tuples are allocated in the arena. The packet is
+ * valid as long as both of them, what has to outlive it must be copied. The
+ * payload of a PUBLISH is not NUL-terminated, its length is `payloadlen`.
+ * Return -1 if the packet is malformed, its fields then can't be trusted, or
+ * of a type only sent by the broker.
+ */
+int unpack_mqtt_packet(unsigned char *, union mqtt_packet *, struct arena *);
 unsigned long long mqtt_decode_length(const unsigned char **);
 
 // Utility functions
@@ -1,5 +1,6 @@
 #define _DEFAULT_SOURCE
 #include <stdlib.h>
+#include <time.h>
 #include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -14,6 +15,7 @@
 #include <sys/socket.h>
 #include <sys/eventfd.h>
 #include "util.h"
+#include "pack.h"
 #include "config.h"
 #include "network.h"
 
@@ -180,12 +182,109 @@ err:
   return -1;
 }
 
+/******************************
+ *        OUTPUT QUEUE        *
+ ******************************/
+
+void output_init(struct output *out) {
+  for (int i = 0; i < OUTPUT_LANES; i++)
+    out->lanes[i] = NULL;
+  out->current = NULL;
+  out->offset = 0;
+  out->bytes = 0;
+}
+
+void output_release(struct output *out) {
+  struct bytestring *frame;
+  for (int i = 0; i < OUTPUT_LANES; i++) {
+    if (!out->lanes[i])
+      continue;
+    while ((frame = list_pop(out->lanes[i])))
+      bytestring_release(frame);
+    list_release(out->lanes[i], 0);
+  }
+  if (out->current)
+    bytestring_release(out->current);
+  output_init(out);
+}
+
+size_t output_pending(const struct output *out) {
+  return out->bytes;
+}
+
+static struct bytestring *output_next(struct output *out) {
+  for (int i = 0; i < OUTPUT_LANES; i++)
+    if (out->lanes[i] && out->lanes[i]->len > 0)
+      return list_pop(out->lanes[i]);
+  return NULL;
+}
+
+ssize_t output_flush(struct output *out, int fd) {
+  ssize_t total = 0, n;
+  struct bytestring *frame;
+  while (out->current || (out->current = output_next(out))) {
+    frame = out->current;
+    n = send(fd, frame->data + out->offset,
+             frame->size - out->offset, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      fprintf(stderr, "send(2) - error sending data: %s", strerror(errno));
+      return -1;
+    }
+    total += n;
+    out->offset += n;
+    out->bytes -= n;
+    if (out->offset == frame->size) {
+      bytestring_release(frame);
+      out->current = NULL;
+      out->offset = 0;
+    }
+  }
+  return total;
+}
+
+ssize_t output_write(struct output *out, int fd,
+                     const unsigned char *data, size_t len, int lane) {
+  struct bytestring *frame;
+  if (out->bytes == 0) {
+    ssize_t sent = send_bytes(fd, data, len);
+    if (sent < 0 || (size_t)sent == len)
+      return sent;
+    // The rest of the packet must go out before anything else
+    frame = bytestring_create(len - sent);
+    memcpy(frame->data, data + sent, len - sent);
+    out->current = frame;
+    out->offset = 0;
+    out->bytes = len - sent;
+    return sent;
+  }
+  frame = bytestring_create(len);
+  memcpy(frame->data, data, len);
+  if (!out->lanes[lane])
+    out->lanes[lane] = list_create(NULL);
+  list_push_back(out->lanes[lane], frame);
+  out->bytes += len;
+  return output_flush(out, fd);
+}
+
 /******************************
  *         EPOLL APIS         *
  ******************************/
 
 #define EVLOOP_INITIAL_SIZE 4
 
+/* Slots of the timing wheel, i.e. seconds covered by a single turn */
+#define EVLOOP_WHEEL_SLOTS 512
+
+time_t evloop_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
 struct evloop *evloop_create(int max_events, int timeout) {
   struct evloop *loop = malloc(sizeof(*loop));
   evloop_init(loop, max_events, timeout);
@@ -195,12 +294,21 @@ struct evloop *evloop_create(int max_events, int timeout) {
 void evloop_init(struct evloop *loop, int max_events, int timeout) {
   loop->max_events = max_events;
   loop->events = malloc(sizeof(struct epoll_event) * max_events);
+  loop->events_nr = 0;
   loop->epollfd = epoll_create1(0);
   loop->timeout = timeout;
   loop->periodic_maxsize = EVLOOP_INITIAL_SIZE;
   loop->periodic_nr = 0;
   loop->periodic_tasks =
       malloc(EVLOOP_INITIAL_SIZE * sizeof(*loop->periodic_tasks));
+  loop->iteration_maxsize = EVLOOP_INITIAL_SIZE;
+  loop->iteration_nr = 0;
+  loop->iteration_tasks =
+      malloc(EVLOOP_INITIAL_SIZE * sizeof(*loop->iteration_tasks));
+  loop->wheel = calloc(EVLOOP_WHEEL_SLOTS, sizeof(*loop->wheel));
+  loop->wheel_pos = 0;
+  loop->wheel_time = evloop_now();
+  loop->timers_nr = 0;
   loop->status = 0;
 }
 
@@ -209,6 +317,8 @@ void evloop_free(struct evloop *loop) {
   for (int i = 0; i < loop->periodic_nr; i++)
     free(loop->periodic_tasks[i]);
   free(loop->periodic_tasks);
+  free(loop->iteration_tasks);
+  free(loop->wheel);
   free(loop);
 }
 
@@ -277,13 +387,85 @@ void evloop_add_periodic_task(struct evloop *loop, int seconds,
   loop->periodic_nr++;
 }
 
+void evloop_add_iteration_task(struct evloop *loop, struct closure *cb) {
+  if (loop->iteration_nr + 1 > loop->iteration_maxsize) {
+    loop->iteration_maxsize *= 2;
+    loop->iteration_tasks =
+        realloc(loop->iteration_tasks,
+                loop->iteration_maxsize * sizeof(*loop->iteration_tasks));
+  }
+  loop->iteration_tasks[loop->iteration_nr++] = cb;
+}
+
+void evloop_timer_add(struct evloop *loop, struct evloop_timer *timer,
+                      unsigned seconds) {
+  if (seconds == 0)
+    seconds = 1;
+  /*
+   * The wheel is advanced only when the loop wakes up, an empty one may be
+   * far behind and can jump straight to the current second, otherwise the
+   * delay is extended by the ticks still to be run
+   */
+  time_t now = evloop_now();
+  if (loop->timers_nr == 0) {
+    loop->wheel_pos = (loop->wheel_pos + (now - loop->wheel_time)) %
+                      EVLOOP_WHEEL_SLOTS;
+    loop->wheel_time = now;
+  } else if (now > loop->wheel_time) {
+    seconds += now - loop->wheel_time;
+  }
+  unsigned slot = (loop->wheel_pos + seconds) % EVLOOP_WHEEL_SLOTS;
+  timer->rounds = (seconds - 1) / EVLOOP_WHEEL_SLOTS;
+  timer->next = loop->wheel[slot];
+  if (timer->next)
+    timer->next->pprev = &timer->next;
+  timer->pprev = &loop->wheel[slot];
+  loop->wheel[slot] = timer;
+  loop->timers_nr++;
+}
+
+void evloop_timer_del(struct evloop *loop, struct evloop_timer *timer) {
+  if (!timer->pprev)
+    return;
+  *timer->pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+  loop->timers_nr--;
+}
+
+/* Advance the wheel up to the current second, expiring due timers */
+static void evloop_run_timers(struct evloop *el) {
+  time_t now = evloop_now();
+  struct evloop_timer *timer, *next;
+  while (el->wheel_time < now) {
+    el->wheel_time++;
+    el->wheel_pos = (el->wheel_pos + 1) % EVLOOP_WHEEL_SLOTS;
+    for (timer = el->wheel[el->wheel_pos]; timer; timer = next) {
+      next = timer->next;
+      if (timer->rounds > 0) {
+        timer->rounds--;
+        continue;
+      }
+      evloop_timer_del(el, timer);
+      timer->expire(timer);
+    }
+  }
+}
+
 int evloop_wait(struct evloop *el) {
   int rc = 0;
   int events = 0;
   long int timer = 0L;
   int periodic_done = 0;
+  int timeout;
   while (1) {
-    events = epoll_wait(el->epollfd, el->events, el->max_events, el->timeout);
+    // Wake up every second at least, if there are timers to be expired
+    timeout = el->timeout;
+    if (el->timers_nr > 0 && (timeout < 0 || timeout > 1000))
+      timeout = 1000;
+    events = epoll_wait(el->epollfd, el->events, el->max_events, timeout);
     if (events < 0) {
       // signals to all threads. Ignore for now.
       if (errno == EINTR)
@@ -293,25 +475,16 @@ int evloop_wait(struct evloop *el) {
       el->status = errno;
       break;
     }
+    el->events_nr = events;
     for (int i = 0; i < events; i++) {
-      /* Check for errors */
-      if ((el->events[i].events & EPOLLERR) ||
-          (el->events[i].events & EPOLLHUP) ||
-          (!(el->events[i].events & EPOLLIN) &&
-           !(el->events[i].events & EPOLLOUT))) {
-        /* An error has occured on this fd, or the socket is not
-           ready for reading, closing connection */
-        perror("epoll_wait(2)");
-        shutdown(el->events[i].data.fd, 0);
-        close(el->events[i].data.fd);
-        el->status = errno;
+      // Unregistered by a callback earlier in this round
+      if (!el->events[i].data.ptr)
         continue;
-      }
       struct closure *closure = el->events[i].data.ptr;
       periodic_done = 0;
-      for (int i = 0; i < el->periodic_nr && periodic_done == 0; i++) {
-        if (el->events[i].data.fd == el->periodic_tasks[i]->timerfd) {
-          struct closure *c = el->periodic_tasks[i]->closure;
+      for (int j = 0; j < el->periodic_nr && periodic_done == 0; j++) {
+        if (el->events[i].data.fd == el->periodic_tasks[j]->timerfd) {
+          struct closure *c = el->periodic_tasks[j]->closure;
           (void)read(el->events[i].data.fd, &timer, 8);
           c->call(el, c->args);
           periodic_done = 1;
@@ -319,9 +492,17 @@ int evloop_wait(struct evloop *el) {
       }
       if (periodic_done == 1)
         continue;
-      /* No error events, proceed to run callback */
+      /*
+       * Errors and hang ups are run by the callback too, the closure owns the
+       * descriptor and knows how to tear it down
+       */
+      closure->events = el->events[i].events;
       closure->call(el, closure->args);
     }
+    el->events_nr = 0;
+    evloop_run_timers(el);
+    for (int i = 0; i < el->iteration_nr; i++)
+      el->iteration_tasks[i]->call(el, el->iteration_tasks[i]->args);
   }
   return rc;
 }
@@ -335,5 +516,8 @@ int evloop_rearm_callback_write(struct evloop *el, struct closure *cb) {
 }
 
 int evloop_del_callback(struct evloop *el, struct closure *cb) {
+  for (int i = 0; i < el->events_nr; i++)
+    if (el->events[i].data.ptr == cb)
+      el->events[i].data.ptr = NULL;
   return epoll_del(el->epollfd, cb->fd);
 }
@@ -6,13 +6,12 @@
 #include <stdio.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
+#include "list.h"
 
 // Socket families
 #define UNIX 0
 #define INET 1
 
-#define UUID_LEN 16
-
 /**
  * Set TCP_NODELAY flag to true, disable Nagle's alogrithm,
  * no more waiting for incoming packets on the buffer.
@@ -51,12 +50,27 @@ ssize_t recv_bytes(int, unsigned char *, size_t);
  * re-armed manually in order to allow future uses on a
  * multi-threaded architecture
  */
+
+/*
+ * Timer of the loop wheel, meant to be embedded in the object it expires so
+ * that arming and cancelling it never allocate. The expire callback receives
+ * the timer itself.
+ */
+struct evloop_timer {
+  struct evloop_timer *next;
+  struct evloop_timer **pprev;
+  unsigned long rounds;
+  void (*expire)(struct evloop_timer *);
+};
+
 struct evloop {
   int epollfd;
   int max_events;
   int timeout;
   int status;
   struct epoll_event *events;
+  /* Events of the round being dispatched, 0 outside of it */
+  int events_nr;
   /* Dynamic array of periodic tasks, a pair descriptor - closure */
   int periodic_maxsize;
   int periodic_nr;
@@ -64,26 +78,59 @@ struct evloop {
     int timerfd;
     struct closure *closure;
   } **periodic_tasks;
-} evloop;
+  /* Dynamic array of closures to run after each batch of events */
+  int iteration_maxsize;
+  int iteration_nr;
+  struct closure **iteration_tasks;
+  /*
+   * Hashed timing wheel, one slot per second, timers due further than a full
+   * turn wait the remaining rounds in their slot. Insertion and removal are
+   * O(1), each tick only visits the timers of a single slot.
+   */
+  struct evloop_timer **wheel;
+  unsigned wheel_pos;
+  time_t wheel_time;
+  size_t timers_nr;
+};
 
 typedef void callback(struct evloop *, void *);
 
+/* Output priority classes, control packets always go out before data */
+#define OUTPUT_CONTROL 0
+#define OUTPUT_DATA    1
+#define OUTPUT_LANES   2
+
+/**
+ * Output queue of a connection, with a FIFO lane of packets for each priority
+ * class. A packet partially written stays in front till completed, lanes are
+ * switched only at packet boundaries, so frames never interleave on the wire
+ * while a control packet waits at most the tail of a single data packet.
+ */
+struct output {
+  List *lanes[OUTPUT_LANES];
+  struct bytestring *current;
+  size_t offset;
+  size_t bytes;
+};
+
 /**
  * Callback object. Represents a callback function with an associated
  * descriptor if needed. Args is a void pointer which can be a structure
- * pointing to callback parameters and closure_id is an UUID for the
- * closure itself.
+ * pointing to callback parameters.
  * The last two fields are payload, a serialised version of the result of
  * a callback, ready to be sent through wire, and a function pointer to
  * the callback function to execute.
+ * Connections also carry the events raised at the last wakeup and their
+ * output queue.
  */
 struct closure {
   int fd;
   void *obj;
   void *args;
-  char closure_id[UUID_LEN];
   struct bytestring *payload;
   callback *call;
+  uint32_t events;
+  struct output out;
 };
 
 struct evloop *evloop_create(int, int);
@@ -110,9 +157,29 @@ void evloop_add_callback(struct evloop *, struct closure *);
 void evloop_add_periodic_task(struct evloop *, int, unsigned long long,
                               struct closure *);
 
+/**
+ * Register a closure with a function to be executed once for each batch of
+ * events processed by the loop, after all of them have been handled
+ */
+void evloop_add_iteration_task(struct evloop *, struct closure *);
+
+/**
+ * Arm a timer to expire after a number of seconds, at least one, its expire
+ * callback is called by the loop. While there are timers armed, the loop
+ * wakes up at least once per second to advance the wheel.
+ */
+void evloop_timer_add(struct evloop *, struct evloop_timer *, unsigned);
+
+/* Cancel an armed timer, no-op if it already expired or was never armed */
+void evloop_timer_del(struct evloop *, struct evloop_timer *);
+
+/* Seconds on the monotonic clock driving the timers */
+time_t evloop_now(void);
+
 /**
  * Unregister a closure by removing the associated descriptor (socket) from
- * the EPOLL loop
+ * the EPOLL loop, events of the current round still to be dispatched to it
+ * are dropped, so that it can be released right away
  */
 int evloop_del_callback(struct evloop *, struct closure *);
 
@@ -128,6 +195,27 @@ int evloop_rearm_callback_read(struct evloop *, struct closure *);
  */
 int evloop_rearm_callback_write(struct evloop *, struct closure *);
 
+/* Output queue management, lanes are allocated on first use */
+void output_init(struct output *);
+void output_release(struct output *);
+
+/* Bytes still waiting to be written */
+size_t output_pending(const struct output *);
+
+/**
+ * Write a packet on a descriptor through an output queue, if nothing is
+ * pending it goes straight to the socket and only the part not accepted gets
+ * copied, otherwise it's copied in its lane and the queue flushed. Return
+ * the number of bytes written or -1 on error.
+ */
+ssize_t output_write(struct output *, int, const unsigned char *, size_t, int);
+
+/**
+ * Write out as much as the socket accepts, higher priority lanes first,
+ * return the number of bytes written or -1 on error
+ */
+ssize_t output_flush(struct output *, int);
+
 /* Epoll management functions */
 int epoll_add(int, int, int, void *);
 
@@ -1,27 +1,23 @@
 #include "pack.h"
+#include "pool.h"
 #include "util.h"
 #include <arpa/inet.h>
 #include <string.h>
 
 struct bytestring *bytestring_create(size_t len) {
-    struct bytestring *bstring = malloc(sizeof(*bstring));
-    bytestring_init(bstring, len);
-    return bstring;
-}
-
-void bytestring_init(struct bytestring *bstring, size_t size) {
+    struct bytestring *bstring = pool_alloc(sizeof(*bstring) + len);
     if (!bstring)
-        return;
-    bstring->size = size;
-    bstring->data = malloc(sizeof(unsigned char) * size);
-    bytestring_reset(bstring);
+        return NULL;
+    bstring->size = len;
+    bstring->last = 0;
+    bstring->data = (unsigned char *) (bstring + 1);
+    return bstring;
 }
 
 void bytestring_release(struct bytestring *bstring) {
     if (!bstring)
         return;
-    free(bstring->data);
-    free(bstring);
+    pool_free(bstring, sizeof(*bstring) + bstring->size);
 }
 
 void bytestring_reset(struct bytestring *bstring) {
@@ -59,10 +55,19 @@ uint8_t *unpack_bytes(const uint8_t **buf, size_t len, uint8_t *str) {
   return str;
 }
 
-uint16_t unpack_string16(uint8_t **buf, uint8_t **dest) {
-  uint16_t len = unpack_u16(buf);
-  *dest = malloc(len + 1);
-  *dest = unpack_bytes(buf, len, *dest);
+/*
+ * No copy is made, the string is moved back over its length prefix, making
+ * room for the NUL terminator in the buffer itself
+ */
+int unpack_string16(uint8_t **buf, const uint8_t *end, uint8_t **dest) {
+  if (end - *buf < (ptrdiff_t)sizeof(uint16_t))
+    return -1;
+  uint16_t len = unpack_u16((const uint8_t **)buf);
+  if (end - *buf < len)
+    return -1;
+  *dest = memmove(*buf - sizeof(uint16_t), *buf, len);
+  (*dest)[len] = '\0';
+  (*buf) += len;
   return len;
 }
 
@@ -84,8 +89,7 @@ void pack_u32(uint8_t **buf, uint32_t val) {
   (*buf) += sizeof(uint32_t);
 }
 
-void pack_bytes(uint8_t **buf, uint8_t *str) {
-  size_t len = strlen((char *)str);
+void pack_bytes(uint8_t **buf, const uint8_t *str, size_t len) {
   memcpy(*buf, str, len);
   (*buf) += len;
 }
@@ -1,6 +1,7 @@
 #ifndef PACK_H
 #define PACK_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -17,10 +18,10 @@ struct bytestring {
 
 /*
  * const struct bytestring constructor, it require a size cause we use a bounded
- * bytestring, e.g. no resize over a defined size
+ * bytestring, e.g. no resize over a defined size. The struct and its data are
+ * a single buffer from the pools, the data is left uninitialized.
  */
 struct bytestring *bytestring_create(size_t);
-void bytestring_init(struct bytestring *, size_t);
 void bytestring_release(struct bytestring *);
 void bytestring_reset(struct bytestring *);
 
@@ -33,8 +34,12 @@ uint16_t unpack_u16(const uint8_t **);
 uint32_t unpack_u32(const uint8_t **);
 // read a defined len of bytes
 uint8_t *unpack_bytes(const uint8_t **, size_t, uint8_t *);
-// Unpack a string prefixed by its length as a uint16 value
-uint16_t unpack_string16(uint8_t **buf, uint8_t **dest);
+/*
+ * Unpack a string prefixed by its length as a uint16 value, pointing into the
+ * buffer, which is modified and must outlive the string. Return its length,
+ * or -1 if the prefix or the string goes past the end given
+ */
+int unpack_string16(uint8_t **buf, const uint8_t *end, uint8_t **dest);
 /* Write data on const uint8_t pointer */
 // append a uint8_t -> bytes into the bytestring
 void pack_u8(uint8_t **, uint8_t);
@@ -43,6 +48,6 @@ void pack_u16(uint8_t **, uint16_t);
 // append a uint32_t -> bytes into the bytestring
 void pack_u32(uint8_t **, uint32_t);
 // append len bytes into the bytestring
-void pack_bytes(uint8_t **, uint8_t *);
+void pack_bytes(uint8_t **, const uint8_t *, size_t);
 
 #endif // PACK_H
@@ -0,0 +1,145 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+/* Chunks of the small classes, a malloc each */
+#define POOL_SMALL_CHUNK_SIZE (64 * 1024)
+
+/* Chunks of the large classes, mapped, the size of a huge page on x86-64 */
+#define POOL_LARGE_CHUNK_SIZE (2 * 1024 * 1024)
+
+/* Chunks are tracked aside, so that large buffers fill them up exactly */
+struct pool_chunk {
+    struct pool_chunk *next;
+    void *mem;
+    size_t size;
+    bool mapped;
+};
+
+struct pool_class {
+    void *free;
+    char *bump;
+    char *end;
+    struct pool_chunk *chunks;
+};
+
+static const struct {
+    size_t size;
+    size_t chunk_size;
+} classes[POOL_CLASSES] = {
+    { 64, POOL_SMALL_CHUNK_SIZE },
+    { 512, POOL_SMALL_CHUNK_SIZE },
+    { 4096, POOL_LARGE_CHUNK_SIZE },
+    { 65536, POOL_LARGE_CHUNK_SIZE },
+};
+
+static bool hugepages = false;
+
+static _Thread_local struct pool_class pools[POOL_CLASSES];
+
+static _Thread_local struct pool_stats stats[POOL_CLASSES + 1];
+
+static inline int pool_class_of(size_t size) {
+    int i = 0;
+    while (i < POOL_CLASSES && size > classes[i].size)
+        i++;
+    return i;
+}
+
+static void *chunk_map(size_t size, bool *mapped) {
+    void *mem = MAP_FAILED;
+    *mapped = true;
+    if (hugepages)
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    // No huge pages reserved, regular ones work all the same
+    if (mem == MAP_FAILED)
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void *pool_grow(int i) {
+    struct pool_chunk *c = malloc(sizeof(*c));
+    if (!c)
+        return NULL;
+    c->size = classes[i].chunk_size;
+    if (c->size == POOL_LARGE_CHUNK_SIZE) {
+        c->mem = chunk_map(c->size, &c->mapped);
+    } else {
+        c->mem = malloc(c->size);
+        c->mapped = false;
+    }
+    if (!c->mem) {
+        free(c);
+        return NULL;
+    }
+    c->next = pools[i].chunks;
+    pools[i].chunks = c;
+    pools[i].bump = c->mem;
+    pools[i].end = (char *) c->mem + c->size;
+    stats[i].bytes += c->size;
+    return c;
+}
+
+void pool_init(bool use_hugepages) {
+    hugepages = use_hugepages;
+}
+
+void *pool_alloc(size_t size) {
+    int i = pool_class_of(size);
+    void *buf;
+    if (i == POOL_CLASSES) {
+        if (!(buf = malloc(size)))
+            return NULL;
+        stats[i].bytes += size;
+    } else if ((buf = pools[i].free)) {
+        pools[i].free = *(void **) buf;
+    } else {
+        if ((size_t) (pools[i].end - pools[i].bump) < classes[i].size
+            && !pool_grow(i))
+            return NULL;
+        buf = pools[i].bump;
+        pools[i].bump += classes[i].size;
+    }
+    stats[i].allocs++;
+    stats[i].in_use++;
+    return buf;
+}
+
+void pool_free(void *buf, size_t size) {
+    int i = pool_class_of(size);
+    if (i == POOL_CLASSES) {
+        free(buf);
+        stats[i].bytes -= size;
+    } else {
+        *(void **) buf = pools[i].free;
+        pools[i].free = buf;
+    }
+    stats[i].frees++;
+    stats[i].in_use--;
+}
+
+void pool_release(void) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        while (pools[i].chunks) {
+            struct pool_chunk *c = pools[i].chunks;
+            pools[i].chunks = c->next;
+            if (c->mapped)
+                munmap(c->mem, c->size);
+            else
+                free(c->mem);
+            free(c);
+        }
+        pools[i].free = pools[i].bump = pools[i].end = NULL;
+        stats[i].in_use = 0;
+        stats[i].bytes = 0;
+    }
+}
+
+const struct pool_stats *pool_stats(void) {
+    for (int i = 0; i < POOL_CLASSES; i++)
+        stats[i].size = classes[i].size;
+    return stats;
+}
@@ -0,0 +1,59 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Buffers of variable size, served from a few size classes: 64B, 512B, 4KB
+ * and 64KB, a request is rounded up to the smallest class fitting it. Each
+ * class keeps its freed buffers on a free list threaded through their first
+ * word and carves new ones out of chunks, only a new chunk goes through the
+ * system allocator. Buffers past the largest class are huge, malloc'ed and
+ * freed one by one.
+ *
+ * Pools are per thread and chunks are kept till the pools are released. A
+ * buffer freed by a thread other than the one that allocated it goes to the
+ * free list of the freeing thread, while its chunk stays with the allocating
+ * one: the stats of both threads drift, and the buffer must not outlive the
+ * release of the allocating thread's pools. The size of a buffer isn't
+ * stored, it must be given back on free, so that small buffers carry no
+ * header.
+ */
+
+/* Size classes, plus one entry for huge buffers */
+#define POOL_CLASSES 4
+
+struct pool_stats {
+    /* Size of the buffers of the class, 0 for huge buffers */
+    size_t size;
+    size_t allocs;
+    size_t frees;
+    size_t in_use;
+    /* Memory held, by the chunks or by the huge buffers in use */
+    size_t bytes;
+};
+
+/*
+ * Back the chunks of the largest classes with huge pages, when available,
+ * falling back to regular pages otherwise. Must be called before any
+ * allocation, without it regular pages are used.
+ */
+void pool_init(bool);
+
+/* Allocate a buffer of at least a given size, aligned for any type */
+void *pool_alloc(size_t);
+
+/* Give back a buffer, with the same size it was allocated with */
+void pool_free(void *, size_t);
+
+/* Release the chunks of the calling thread, buffers in use go with them */
+void pool_release(void);
+
+/*
+ * Stats of the pools of the calling thread, POOL_CLASSES + 1 entries, the
+ * last one for huge buffers
+ */
+const struct pool_stats *pool_stats(void);
+
+#endif
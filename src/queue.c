@@ -0,0 +1,368 @@
+#define _DEFAULT_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+#include "config.h"
+#include "wal.h"
+#include "network.h"
+#include "queue.h"
+
+/* Size past which the spill store moves on to a new segment */
+#define SPILL_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/* Bytes of messages currently queued in memory by all the clients */
+static size_t queued_memory = 0;
+
+/* Messages discarded because expired, either by the sweep or on dequeue */
+static size_t expired_nr = 0;
+
+/* Loop owning the timers of the queued messages, NULL for lazy expiry only */
+static struct evloop *timers_loop = NULL;
+
+/*
+ * In memory entry, the message paired with the id of its WAL delivery and
+ * its expiration. The timer must be the first member, the expire callback
+ * gets it back from the timer pointer. Entries are linked in the queue
+ * through their own pointers, so that the sweep unlinks an expired one in
+ * O(1), without ever walking the queue.
+ */
+struct queued_msg {
+    struct evloop_timer timer;
+    struct msg_queue *queue;
+    struct bytestring *msg;
+    long wal_id;
+    time_t expire_at;
+    struct queued_msg *next;
+    struct queued_msg *prev;
+};
+
+void msg_queue_init(struct msg_queue *q) {
+    q->head = NULL;
+    q->tail = NULL;
+    q->nr = 0;
+    q->bytes = 0;
+    q->spill_nr = 0;
+    q->spill_head.segment = q->spill_tail.segment = NULL;
+    q->spill_head.offset = q->spill_tail.offset = 0;
+}
+
+void msg_queue_set_loop(struct evloop *loop) {
+    timers_loop = loop;
+}
+
+static inline bool is_expired(time_t expire_at, time_t now) {
+    return expire_at > 0 && expire_at < now;
+}
+
+static void queued_msg_link(struct msg_queue *q, struct queued_msg *qm) {
+    qm->next = NULL;
+    qm->prev = q->tail;
+    if (q->tail)
+        q->tail->next = qm;
+    else
+        q->head = qm;
+    q->tail = qm;
+}
+
+static void queued_msg_unlink(struct msg_queue *q, struct queued_msg *qm) {
+    if (qm->prev)
+        qm->prev->next = qm->next;
+    else
+        q->head = qm->next;
+    if (qm->next)
+        qm->next->prev = qm->prev;
+    else
+        q->tail = qm->prev;
+}
+
+/* Unlink an entry from its queue and free it, its message is left alone */
+static void queued_msg_remove(struct queued_msg *qm) {
+    struct msg_queue *q = qm->queue;
+    queued_msg_unlink(q, qm);
+    queued_memory -= qm->msg->size;
+    q->nr--;
+    q->bytes -= qm->msg->size;
+    free(qm);
+}
+
+/* Timer callback, drop the message out of the queue */
+static void queued_msg_expire(struct evloop_timer *timer) {
+    struct queued_msg *qm = (struct queued_msg *) timer;
+    bytestring_release(qm->msg);
+    wal_unref(qm->wal_id);
+    queued_msg_remove(qm);
+    expired_nr++;
+}
+
+/*
+ * Segment of the spill store, an anonymous file, with the count of the
+ * messages written to it not yet read or discarded
+ */
+struct spill_segment {
+    int fd;
+    off_t size;
+    size_t live;
+};
+
+/* Segment being appended to, NULL till something is spilled */
+static struct spill_segment *spill_active = NULL;
+
+/*
+ * Create an anonymous spill segment, it's unlinked right after creation so
+ * that it is removed by the kernel as soon as it gets closed, even after a
+ * crash.
+ */
+static struct spill_segment *spill_open(void) {
+    char path[0xFF + 18];
+    snprintf(path, sizeof(path), "%s/sol-spill-XXXXXX", conf->spill_path);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        sol_error("Unable to create spill file in %s: %s",
+                  conf->spill_path, strerror(errno));
+        return NULL;
+    }
+    unlink(path);
+    struct spill_segment *seg = malloc(sizeof(*seg));
+    seg->fd = fd;
+    seg->size = 0;
+    seg->live = 0;
+    return seg;
+}
+
+/*
+ * A message of a segment has been read or discarded, once none is left the
+ * segment is closed, or just emptied if still being appended to
+ */
+static void spill_segment_put(struct spill_segment *seg) {
+    if (--seg->live > 0)
+        return;
+    if (seg == spill_active) {
+        if (ftruncate(seg->fd, 0) == 0)
+            seg->size = 0;
+        return;
+    }
+    close(seg->fd);
+    free(seg);
+}
+
+/*
+ * Spill records header, the length of the message, its WAL delivery, its
+ * expiration and where the next message of the same queue is, the files
+ * don't outlive the process so the segment is linked by its address.
+ * Spilled messages have no timer, they're only expired on dequeue, being on
+ * disk they don't hold any memory anyway.
+ */
+struct spill_header {
+    size_t size;
+    long wal_id;
+    time_t expire_at;
+    struct spill_ref next;
+};
+
+/*
+ * Append a message to the active segment as a length-prefixed record and
+ * link it after the last one spilled by the queue, a new segment is started
+ * once the active one is full
+ */
+static int spill_write(struct msg_queue *q, const struct bytestring *msg,
+                       long wal_id, time_t expire_at) {
+    if (!spill_active || spill_active->size >= SPILL_SEGMENT_SIZE) {
+        struct spill_segment *seg = spill_open();
+        if (!seg)
+            return -1;
+        // The full one goes as soon as its messages are all read
+        if (spill_active && spill_active->live == 0) {
+            close(spill_active->fd);
+            free(spill_active);
+        }
+        spill_active = seg;
+    }
+    struct spill_segment *seg = spill_active;
+    struct spill_ref ref = { seg, seg->size };
+    struct spill_header hdr = { msg->size, wal_id, expire_at, { NULL, 0 } };
+    if (pwrite(seg->fd, &hdr, sizeof(hdr), ref.offset) != sizeof(hdr))
+        return -1;
+    if (pwrite(seg->fd, msg->data, msg->size,
+               ref.offset + sizeof(hdr)) != (ssize_t) msg->size)
+        return -1;
+    if (q->spill_nr > 0 &&
+        pwrite(q->spill_tail.segment->fd, &ref, sizeof(ref),
+               q->spill_tail.offset + offsetof(struct spill_header, next))
+        != sizeof(ref))
+        return -1;
+    seg->size += sizeof(hdr) + msg->size;
+    seg->live++;
+    if (q->spill_nr == 0)
+        q->spill_head = ref;
+    q->spill_tail = ref;
+    q->spill_nr++;
+    return 0;
+}
+
+/*
+ * Discard all the messages left in the spill store, only the headers are
+ * read, to release the WAL references and the segments. If some header can't
+ * be read the segments of the messages left stay open, their bytes are
+ * recounted from the messages in memory.
+ */
+static void spill_discard(struct msg_queue *q) {
+    struct spill_header hdr;
+    struct spill_ref ref = q->spill_head;
+    while (q->spill_nr > 0 &&
+           pread(ref.segment->fd, &hdr, sizeof(hdr), ref.offset)
+           == sizeof(hdr)) {
+        wal_unref(hdr.wal_id);
+        spill_segment_put(ref.segment);
+        q->nr--;
+        q->bytes -= hdr.size;
+        q->spill_nr--;
+        ref = hdr.next;
+    }
+    if (q->spill_nr == 0)
+        return;
+    sol_error("Error reading spill file, %lu WAL deliveries not released",
+              q->spill_nr);
+    q->nr -= q->spill_nr;
+    q->spill_nr = 0;
+    q->bytes = 0;
+    for (struct queued_msg *qm = q->head; qm; qm = qm->next)
+        q->bytes += qm->msg->size;
+}
+
+/* Read the next spilled message, NULL on error or if it expired */
+static struct bytestring *spill_read(struct msg_queue *q,
+                                     long *wal_id, time_t now) {
+    struct spill_header hdr;
+    struct spill_ref ref = q->spill_head;
+    if (pread(ref.segment->fd, &hdr, sizeof(hdr), ref.offset) != sizeof(hdr))
+        goto err;
+    struct bytestring *msg = NULL;
+    if (is_expired(hdr.expire_at, now)) {
+        // No need to read the message at all
+        wal_unref(hdr.wal_id);
+        expired_nr++;
+    } else {
+        msg = bytestring_create(hdr.size);
+        if (pread(ref.segment->fd, msg->data, hdr.size,
+                  ref.offset + sizeof(hdr)) != (ssize_t) hdr.size) {
+            bytestring_release(msg);
+            goto err;
+        }
+        *wal_id = hdr.wal_id;
+    }
+    spill_segment_put(ref.segment);
+    q->spill_head = hdr.next;
+    q->spill_nr--;
+    q->nr--;
+    q->bytes -= hdr.size;
+    return msg;
+err:
+    sol_error("Error reading spill file, %lu messages lost", q->spill_nr);
+    spill_discard(q);
+    return NULL;
+}
+
+/*
+ * Dequeue the oldest message still valid, those which are due but not yet
+ * reached by the sweep are expired here.
+ */
+struct bytestring *msg_queue_pop(struct msg_queue *q, long *wal_id) {
+    struct queued_msg *qm;
+    struct bytestring *msg = NULL;
+    time_t now = evloop_now();
+    while ((qm = q->head)) {
+        if (timers_loop)
+            evloop_timer_del(timers_loop, &qm->timer);
+        if (is_expired(qm->expire_at, now)) {
+            queued_msg_expire(&qm->timer);
+            continue;
+        }
+        msg = qm->msg;
+        *wal_id = qm->wal_id;
+        queued_msg_remove(qm);
+        return msg;
+    }
+    while (!msg && q->spill_nr > 0)
+        msg = spill_read(q, wal_id, now);
+    return msg;
+}
+
+int msg_queue_push(struct msg_queue *q, struct bytestring *msg,
+                   long wal_id, time_t expire_at) {
+    int dropped = 0;
+    long dropped_id;
+    struct bytestring *dropped_msg;
+    size_t size = msg->size;
+    /* Make room for the new message according to the configured policy */
+    while (q->nr > 0 && (q->nr + 1 > conf->max_queued_messages ||
+                         q->bytes + size > conf->max_queued_bytes)) {
+        if (conf->queue_policy == DROP_NEWEST)
+            break;
+        // Expired messages found on the way make room as well
+        if (!(dropped_msg = msg_queue_pop(q, &dropped_id)))
+            continue;
+        bytestring_release(dropped_msg);
+        wal_unref(dropped_id);
+        dropped++;
+    }
+    if (q->nr + 1 > conf->max_queued_messages ||
+        q->bytes + size > conf->max_queued_bytes) {
+        bytestring_release(msg);
+        wal_unref(wal_id);
+        return dropped + 1;
+    }
+    if (q->spill_nr > 0 || queued_memory + size > conf->max_memory) {
+        if (spill_write(q, msg, wal_id, expire_at) < 0) {
+            sol_error("Error writing spill file: %s", strerror(errno));
+            bytestring_release(msg);
+            wal_unref(wal_id);
+            return dropped + 1;
+        }
+        bytestring_release(msg);
+    } else {
+        struct queued_msg *qm = malloc(sizeof(*qm));
+        qm->queue = q;
+        qm->msg = msg;
+        qm->wal_id = wal_id;
+        qm->expire_at = expire_at;
+        qm->timer.pprev = NULL;
+        qm->timer.expire = queued_msg_expire;
+        if (expire_at > 0 && timers_loop) {
+            time_t now = evloop_now();
+            evloop_timer_add(timers_loop, &qm->timer,
+                             expire_at > now ? expire_at - now : 0);
+        }
+        queued_msg_link(q, qm);
+        queued_memory += size;
+    }
+    q->nr++;
+    q->bytes += size;
+    return dropped;
+}
+
+void msg_queue_clear(struct msg_queue *q) {
+    struct queued_msg *qm;
+    while ((qm = q->head)) {
+        if (timers_loop)
+            evloop_timer_del(timers_loop, &qm->timer);
+        bytestring_release(qm->msg);
+        wal_unref(qm->wal_id);
+        queued_msg_remove(qm);
+    }
+    if (q->spill_nr > 0)
+        spill_discard(q);
+    q->nr = 0;
+    q->bytes = 0;
+}
+
+size_t msg_queue_memory(void) {
+    return queued_memory;
+}
+
+size_t msg_queue_expired(void) {
+    return expired_nr;
+}
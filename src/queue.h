@@ -0,0 +1,84 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include "pack.h"
+
+/*
+ * FIFO of packed messages waiting to be sent out to a client, bounded by
+ * number of messages and total bytes. Under memory pressure, i.e. when the
+ * messages queued in memory by all the clients exceed the configured max
+ * memory, new messages are appended to the spill store on disk instead. The
+ * spilled messages are always drained after the messages in memory, and once
+ * a queue starts spilling all its new messages go to disk till it's empty
+ * again, this way the ordering is preserved.
+ *
+ * The spill store is shared by all the queues, a sequence of segment files
+ * appended to in turn, where the messages of a queue are chained from one to
+ * the next. A segment is closed once all the messages in it have been read,
+ * so the open files depend on the bytes spilled, not on how many queues.
+ *
+ * Each message carries the id of its WAL delivery, -1 if not logged, the
+ * queue holds the reference on the WAL segment till the message is popped
+ * out, while dropped messages release it right away.
+ *
+ * Messages may have an expiration, on the monotonic clock of the event loop
+ * as given by `evloop_now`, expired ones are discarded on dequeue and swept
+ * in the background by timers of the event loop, one for each message queued
+ * in memory.
+ */
+struct queued_msg;
+
+struct spill_segment;
+
+/* Position of a spilled message, a segment of the store and an offset */
+struct spill_ref {
+    struct spill_segment *segment;
+    off_t offset;
+};
+
+struct msg_queue {
+    /* Messages in memory, oldest first */
+    struct queued_msg *head;
+    struct queued_msg *tail;
+    /* Total number of messages and bytes, both in memory and on disk */
+    size_t nr;
+    size_t bytes;
+    /* Messages in the spill store, the first and the last one */
+    size_t spill_nr;
+    struct spill_ref spill_head;
+    struct spill_ref spill_tail;
+};
+
+struct evloop;
+
+void msg_queue_init(struct msg_queue *);
+
+/* Set the loop arming the expiration timers, without it expiry is lazy only */
+void msg_queue_set_loop(struct evloop *);
+
+/* Release all queued messages, those in the spill store too */
+void msg_queue_clear(struct msg_queue *);
+
+/*
+ * Enqueue a message taking ownership of it, along with its WAL delivery and
+ * expiration time, 0 meaning it never expires. Enforce the configured limits,
+ * return the number of messages dropped by the queue policy
+ */
+int msg_queue_push(struct msg_queue *, struct bytestring *, long, time_t);
+
+/*
+ * Dequeue the oldest message, NULL if the queue is empty, storing its WAL
+ * delivery into the last argument, the reference passes to the caller
+ */
+struct bytestring *msg_queue_pop(struct msg_queue *, long *);
+
+/* Bytes held in memory by all the queues */
+size_t msg_queue_memory(void);
+
+/* Total number of messages expired in all the queues */
+size_t msg_queue_expired(void);
+
+#endif
@@ -0,0 +1,89 @@
+#define _DEFAULT_SOURCE
+#include <string.h>
+#include <sched.h>
+#include "registry.h"
+
+/* Spins on a taken lock before yielding the CPU to its holder */
+#define REGISTRY_SPINS 128
+
+static struct registry_shard *registry_shard(struct registry *r,
+                                             const char *id) {
+    uint64_t hash = hash_keyed(id, strlen(id), &r->key);
+    return &r->shards[hash & (REGISTRY_SHARDS - 1)];
+}
+
+/*
+ * Critical sections are a single HashTable operation, a lock is spun on for
+ * a while, as it's likely to be released sooner than a sleep would take
+ */
+static void shard_lock(struct registry_shard *s) {
+    while (__atomic_exchange_n(&s->lock, true, __ATOMIC_ACQUIRE)) {
+        int spins = 0;
+        while (__atomic_load_n(&s->lock, __ATOMIC_RELAXED))
+            if (++spins == REGISTRY_SPINS) {
+                sched_yield();
+                spins = 0;
+            }
+    }
+}
+
+static void shard_unlock(struct registry_shard *s) {
+    __atomic_store_n(&s->lock, false, __ATOMIC_RELEASE);
+}
+
+void registry_init(struct registry *r,
+                   int (*destructor)(struct hashtable_entry *)) {
+    hash_key_init(&r->key);
+    for (int i = 0; i < REGISTRY_SHARDS; i++) {
+        r->shards[i].lock = false;
+        r->shards[i].table = hashtable_create_keyed(destructor);
+    }
+}
+
+void registry_release(struct registry *r) {
+    for (int i = 0; i < REGISTRY_SHARDS; i++) {
+        hashtable_release(r->shards[i].table);
+        r->shards[i].table = NULL;
+    }
+}
+
+void *registry_get(struct registry *r, const char *id) {
+    struct registry_shard *s = registry_shard(r, id);
+    shard_lock(s);
+    void *val = hashtable_get(s->table, id);
+    shard_unlock(s);
+    return val;
+}
+
+void *registry_get_or_insert(struct registry *r, const char *id, void *val,
+                             bool replace) {
+    struct registry_shard *s = registry_shard(r, id);
+    shard_lock(s);
+    void *prev = hashtable_get(s->table, id);
+    if (!prev || replace)
+        hashtable_put(s->table, id, val);
+    shard_unlock(s);
+    return prev;
+}
+
+int registry_del(struct registry *r, const char *id) {
+    struct registry_shard *s = registry_shard(r, id);
+    shard_lock(s);
+    int rc = hashtable_del(s->table, id);
+    shard_unlock(s);
+    return rc;
+}
+
+int registry_map2(struct registry *r,
+                  int (*func)(struct hashtable_entry *, void *), void *arg) {
+    int rc = HASHTABLE_OK;
+    for (int i = 0; i < REGISTRY_SHARDS && rc == HASHTABLE_OK; i++) {
+        struct registry_shard *s = &r->shards[i];
+        shard_lock(s);
+        // An empty table is an error for hashtable_map2, not for a shard
+        if (hashtable_size(s->table) > 0)
+            rc = hashtable_map2(s->table, func, arg);
+        shard_unlock(s);
+    }
+    return rc;
+}
@@ -0,0 +1,64 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdbool.h>
+#include "hash.h"
+#include "hashtable.h"
+
+/* Number of shards, a power of 2 */
+#define REGISTRY_SHARDS 64
+
+/*
+ * Map of the clients by id, split in shards each with its own HashTable and
+ * its own lock, so that threads serving different connections only contend
+ * on ids falling in the same shard. The shard of an id is picked by a hash
+ * keyed with a secret, crafted ids can't pile up on a single lock.
+ *
+ * Each operation is atomic on its shard, the registry guards the mapping
+ * only: values returned stay valid as long as the caller owns them, i.e.
+ * the thread serving the connection of the client.
+ */
+struct registry_shard {
+    _Alignas(64) bool lock;
+    HashTable *table;
+};
+
+struct registry {
+    struct hash_key key;
+    struct registry_shard shards[REGISTRY_SHARDS];
+};
+
+/*
+ * Create the shards, the destructor is called on the entries removed by
+ * `registry_del` and `registry_release`
+ */
+void registry_init(struct registry *, int (*)(struct hashtable_entry *));
+
+void registry_release(struct registry *);
+
+/* Retrieve the value stored for an id, NULL if there's none */
+void *registry_get(struct registry *, const char *);
+
+/*
+ * Insert a value for an id in a single operation on its shard, return NULL
+ * if the id was free. If it's taken the value already stored is returned,
+ * either left in place, or taken over when `replace` is set, and not
+ * destroyed. The key must be owned by the value inserted.
+ */
+void *registry_get_or_insert(struct registry *, const char *, void *,
+                             bool replace);
+
+/*
+ * Remove the value stored for an id, destroying it with the lock of its
+ * shard held, the destructor must not call back into the registry
+ */
+int registry_del(struct registry *, const char *);
+
+/*
+ * Apply a function to every entry, a shard at a time with its lock held, the
+ * function must not call back into the registry
+ */
+int registry_map2(struct registry *,
+                  int (*)(struct hashtable_entry *, void *), void *);
+
+#endif
@@ -1,10 +1,13 @@
+#define _DEFAULT_SOURCE
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/wait.h>
 #include "network.h"
 #include "mqtt.h"
 #include "util.h"
@@ -13,6 +16,13 @@
 #include "config.h"
 #include "server.h"
 #include "hashtable.h"
+#include "queue.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "ebr.h"
+#include "slab.h"
+#include "arena.h"
+#include "pool.h"
 
 // Seconds in a SOL, easter egg i guess
 static const double SOL_SECONDS = 88775.24;
@@ -45,7 +55,7 @@ static int pubcomp_handler(struct closure *, union mqtt_packet *);
 static int pingreq_handler(struct closure *, union mqtt_packet *);
 
 // Command handler mapped using their position paired with their type
-static handler *handler[15] = {
+static handler *handlers[15] = {
     NULL,
     connect_handler,
     NULL,
@@ -78,13 +88,87 @@ struct connection {
  * - Read incoming bytes from connected clients
  * - Write output bytes to connected clients
  */
-static void on_read(struct evloop *, void *);
-static void on_write(struct evloop *, void *);
+static int on_read(struct closure *);
+static void on_event(struct evloop *, void *);
 static void on_accept(struct evloop *, void *);
 
 // Periodic task callback, will be executed every N seconds defined on the configuration
 static void publish_stats(struct evloop *, void *);
 
+// Periodic task callback, re-send in-flight messages not acknowledged in time
+static void retransmit_inflight(struct evloop *, void *);
+
+/* WAL group commit, releasing the acks of the messages made durable */
+static void commit_wal(struct evloop *, void *);
+
+/* Periodic snapshot of topics and persistent sessions, in a forked child */
+static void snapshot_sessions(struct evloop *, void *);
+
+/* Re-route messages found in the WAL on startup */
+static void replay_record(unsigned char *, size_t, long, void *);
+
+/* Release trie nodes and subscribers retired during a round of events */
+static void reclaim_retired(struct evloop *, void *);
+
+/* Delete a batch of topics left unused, at the end of a round of events */
+static void collect_topics(struct evloop *, void *);
+
+/* Max number of topic slots visited by each round of garbage collection */
+#define TOPIC_GC_BATCH 64
+
+/*
+ * Acknowledgement of a logged message, held back till its WAL record is
+ * durable. Clients are looked up again by id on commit, as they may have
+ * disconnected in the meanwhile.
+ */
+struct deferred_ack {
+    char *client_id;
+    unsigned char packet[MQTT_ACK_LEN];
+};
+
+static List *deferred_acks;
+
+/*
+ * Fields of the packet being handled, decoded packets are done with as soon
+ * as their handler returns, it's reset after each of them
+ */
+static struct arena decode_arena;
+
+/* Initial size of the decode arena, it grows to the largest packet decoded */
+#define DECODE_ARENA_SIZE 16384
+
+/*
+ * Buffer packets are read into, decoded packets point into it, so it's
+ * reused as soon as the handler returns. It fits max_request_size plus the
+ * fixed header, with a remaining length of at most 4 bytes.
+ */
+static unsigned char *recv_buffer;
+
+// Event loop serving the connections, to schedule writes on any of them
+static struct evloop *server_loop;
+
+/*
+ * Write a packet to a connection through its output lanes, arming EPOLLOUT
+ * if the socket can't take it all right now
+ */
+static ssize_t write_packet(struct closure *, const unsigned char *,
+                            size_t, int);
+
+// Re-arm a connection for reading, and for writing if output is pending
+static void rearm_connection(struct evloop *, struct closure *);
+
+// Re-send in-flight messages and drain the queue of a restored session
+static void session_resume(struct sol_client *);
+
+// Detach a client from its connection, releasing it unless persistent
+static void client_detach(struct sol_client *);
+
+// Close a connection and release its closure, leaving its client alone
+static void close_connection(struct closure *);
+
+// Close a client connection, keeping persistent sessions
+static void close_client(struct closure *);
+
 /**
  * Accepts a new incoming connection assigning ip address and socket descriptor to the
  * connection structure pointer passed as argument.
@@ -101,17 +185,76 @@ static int accept_new_client(int fd, struct connection *conn){
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
     if (getpeername(clientsock, (struct sockaddr *) &addr, &addrlen) < 0)
-        return -1;
+        goto err;
     char ip_buff[INET_ADDRSTRLEN + 1];
     if (inet_ntop(AF_INET, &addr.sin_addr, ip_buff, sizeof(ip_buff)) == NULL)
-        return -1;
+        goto err;
     struct sockaddr_in sin;
     socklen_t sinlen = sizeof(sin);
     if (getsockname(fd, (struct sockaddr *) &sin, &sinlen) < 0)
-        return -1;
+        goto err;
     conn->fd = clientsock;
     strcpy(conn->ip, ip_buff);
     return 0;
+err:
+    close(clientsock);
+    return -1;
+}
+
+// Closures of the connections, one per accept
+static struct slab closures = SLAB_INIT("connections", struct closure);
+
+/* Number of connection slots allocated on the first accept */
+#define CONNECTIONS_INITIAL_SIZE 1024
+
+/*
+ * Track a new connection in the slot of its descriptor, which must be a
+ * valid one, return -1 if the table can't grow to fit it
+ */
+static int connections_add(struct connections *conns, struct closure *cb) {
+    if ((size_t) cb->fd >= conns->size) {
+        size_t size = conns->size ? conns->size : CONNECTIONS_INITIAL_SIZE;
+        while (size <= (size_t) cb->fd)
+            size *= 2;
+        struct closure **closures = realloc(conns->closures,
+                                            size * sizeof(*closures));
+        if (!closures)
+            return -1;
+        memset(closures + conns->size, 0,
+               (size - conns->size) * sizeof(*closures));
+        conns->closures = closures;
+        conns->size = size;
+    }
+    conns->closures[cb->fd] = cb;
+    conns->nr++;
+    return 0;
+}
+
+static void closure_release(struct closure *cb) {
+    if (cb->payload)
+        bytestring_release(cb->payload);
+    output_release(&cb->out);
+    slab_free(&closures, cb);
+}
+
+/*
+ * Forget a connection and release its closure, to be called before its
+ * descriptor is closed and handed out again by the kernel
+ */
+static void connections_del(struct connections *conns, struct closure *cb) {
+    conns->closures[cb->fd] = NULL;
+    conns->nr--;
+    closure_release(cb);
+}
+
+/* Release the closures of all the connections still open */
+static void connections_release(struct connections *conns) {
+    for (size_t fd = 0; fd < conns->size && conns->nr > 0; fd++)
+        if (conns->closures[fd])
+            connections_del(conns, conns->closures[fd]);
+    free(conns->closures);
+    conns->closures = NULL;
+    conns->size = 0;
 }
 
 /**
@@ -121,24 +264,34 @@ static int accept_new_client(int fd, struct connection *conn){
 static void on_accept(struct evloop *loop, void *arg) {
     // struct connection *server_conn = arg;
     struct closure *server = arg;
-    struct connection con;
-    accept_new_client(server->fd, &conn);
+    struct connection conn;
+    // rearm server fd to accept new connections, even if this one failed
+    evloop_rearm_callback_read(loop, server);
+    // e.g. EAGAIN on a connection already gone or EMFILE, nothing to track
+    if (accept_new_client(server->fd, &conn) < 0)
+        return;
     // create a client structure to handle his context connection
-    struct closure *client_closure = malloc(sizeof(*client_closure));
-    if (!client_closure)
+    struct closure *client_closure = slab_alloc(&closures);
+    if (!client_closure) {
+        close(conn.fd);
         return;
+    }
     // Populate client structure
     client_closure->fd = conn.fd;
     client_closure->obj = NULL;
     client_closure->payload = NULL;
     client_closure->args = client_closure;
-    client_closure->call = on_read;
-    generate_uuid(client_closure->closure_id);
-    hashtable_put(sol.closures, client_closure->closure_id, client_closure);
+    client_closure->call = on_event;
+    client_closure->events = 0;
+    output_init(&client_closure->out);
+    if (connections_add(&sol.connections, client_closure) < 0) {
+        sol_error("Unable to track connection from %s", conn.ip);
+        slab_free(&closures, client_closure);
+        close(conn.fd);
+        return;
+    }
     // add it to the epoll loop
     evloop_add_callback(loop, client_closure);
-    // rearm server fd to accept new connections
-    evloop_rearm_callback_read(loop, server);
     // record the new client connected
     info.nclients++;
     info.nconnections++;
@@ -165,7 +318,7 @@ static ssize_t recv_packet(int client_fd, unsigned char *buf, char *command) {
         return -ERRCLIENTDC;
     unsigned char byte = *buf;
     buf++;
-    if (DISCONNECT < byte || CONNECT > byte)
+    if (DISCONNECT < (byte >> 4) || CONNECT > (byte >> 4))
         return -ERRPACKETERR;
 
     /**
@@ -195,26 +348,26 @@ static ssize_t recv_packet(int client_fd, unsigned char *buf, char *command) {
         goto exit;
     }
 
-    // Read remaining bytes to complete the packet
-    if ((n = recv_bytes(client_fd, buf + 1, tlen)) < 0)
-        goto err;
+    /*
+     * Read remaining bytes to complete the packet, on failure the caller
+     * tears the connection down, clearing its slot before closing the fd
+     */
+    if ((n = recv_bytes(client_fd, buf + count, tlen)) < 0)
+        return -ERRCLIENTDC;
     nbytes += n;
     *command = byte;
 
 exit:
     return nbytes;
-err:
-    shutdown(client_fd, 0);
-    close(client_fd);
-    return nbytes;
 }
 
-/* Handle incoming requests, after being accepted or after a reply */
-static void on_read(struct evloop *loop, void *arg) {
-    struct closure *cb = arg;
-
+/*
+ * Handle an incoming request, return -1 if the connection got closed on it,
+ * re-arming it is left to the caller
+ */
+static int on_read(struct closure *cb) {
     /* Raw bytes buffer to handle input from client */
-    unsigned char *buffer = malloc(conf->max_request_size);
+    unsigned char *buffer = recv_buffer;
     ssize_t bytes = 0;
     char command = 0;
 
@@ -233,8 +386,10 @@ static void on_read(struct evloop *loop, void *arg) {
      *       connection, explicitly returning an informative error code to the
      *       client connected.
      */
-    if (bytes == -ERRCLIENTDC || bytes == -ERRMAXREQSIZE)
-        goto exit;
+    if (bytes == -ERRMAXREQSIZE)
+        goto errdc;
+    if (bytes == -ERRCLIENTDC)
+        goto dc;
 
     /*
      * If a not correct packet received, we must free the buffer and reset the
@@ -244,61 +399,131 @@ static void on_read(struct evloop *loop, void *arg) {
         goto errdc;
     info.bytes_recv++;
 
+    /*
+     * A connection without a client didn't send its CONNECT yet, no other
+     * packet can be handled for it
+     */
+    union mqtt_header hdr = { .byte = command };
+    if (!cb->obj && hdr.bits.type != CONNECT) {
+        sol_debug("Received packet on a connection without client, closing");
+        goto dc;
+    }
+
     /*
      * Unpack received bytes into a mqtt_packet structure and execute the
-     * correct handler based on the type of the operation.
+     * correct handler based on the type of the operation. Lengths inside the
+     * packet that go past its end, or packets only a broker sends, mean the
+     * client can't be trusted anymore.
      */
     union mqtt_packet packet;
-    unpack_mqtt_packet(buffer, &packet);
-    union mqtt_header hdr = { .byte = command };
+    if (!handlers[hdr.bits.type]
+        || unpack_mqtt_packet(buffer, &packet, &decode_arena) < 0) {
+        arena_reset(&decode_arena);
+        goto errdc;
+    }
 
-    /* Execute command callback */
+    /* Execute command callback, the fields of the packet are gone after it */
     int rc = handlers[hdr.bits.type](cb, &packet);
+    arena_reset(&decode_arena);
     if (rc == REARM_W) {
-        cb->call = on_write;
         /*
-         * Reset handler to read_handler in order to read new incoming data and
-         * EPOLL event for read fds
+         * Replies are control packets, they go out ahead of any PUBLISH
+         * still queued on the connection
          */
-        evloop_rearm_callback_write(loop, cb);
-    } else if (rc == REARM_R) {
-        cb->call = on_read;
-        evloop_rearm_callback_read(loop, cb);
+        struct sol_client *c = cb->obj;
+        if (write_packet(cb, cb->payload->data,
+                         cb->payload->size, OUTPUT_CONTROL) < 0)
+            sol_error("Error writing on socket to client %s: %s",
+                      c ? c->client_id : "-", strerror(errno));
+        bytestring_release(cb->payload);
+        cb->payload = NULL;
+
+        /* A restored session delivers its backlog only after the CONNACK */
+        if (c && c->resume) {
+            c->resume = false;
+            session_resume(c);
+        }
     }
-    // Disconnect packet received
-exit:
-    free(buffer);
-    return;
+    // Disconnect packet received or a double CONNECT
+    return rc == REARM_W || rc == REARM_R ? 0 : -1;
 errdc:
-    free(buffer);
     sol_error("Dropping client");
-    shutdown(cb->fd, 0);
-    close(cb->fd);
-    hashtable_del(sol.clients, ((struct sol_client *) cb->obj)->client_id);
-    hashtable_del(sol.closures, cb->closure_id);
+dc:
+    close_client(cb);
+    return -1;
+}
+
+/*
+ * Close the connection of a client and unregister its closure. Clients with a
+ * persistent session are kept in the global map as offline, their messages
+ * will be queued till they connect back.
+ */
+static void client_detach(struct sol_client *c) {
+    if (c->clean_session) {
+        registry_del(&sol.clients, c->client_id);
+    } else {
+        c->online = false;
+        c->resume = false;
+        c->fd = -1;
+        c->cb = NULL;
+    }
+}
+
+static void close_connection(struct closure *cb) {
+    int fd = cb->fd;
+    evloop_del_callback(server_loop, cb);
+    connections_del(&sol.connections, cb);
+    shutdown(fd, 0);
+    close(fd);
     info.nclients--;
     info.nconnections--;
-    return;
 }
 
-static void on_write(struct evloop *loop, void *arg) {
+static void close_client(struct closure *cb) {
+    struct sol_client *c = cb->obj;
+    if (c)
+        client_detach(c);
+    close_connection(cb);
+}
+
+/*
+ * Events on a client connection, input is read first so that a reply joins
+ * the control lane before the pending output is flushed and overtakes the
+ * PUBLISHes still queued; flushing first lets a client draining its socket
+ * as fast as it's written wait for the whole data lane. An error or a hang
+ * up is read like any input, what's still buffered is handled and then the
+ * read fails or returns 0, closing the client.
+ */
+static void on_event(struct evloop *loop, void *arg) {
     struct closure *cb = arg;
-    ssize_t sent;
-    if ((sent = send_bytes(cb->fd, cb->payload->data, cb->payload->size)) < 0)
-        sol_error("Error writing on socket to client %s: %s",
-                  ((struct sol_client *) cb->obj)->client_id, strerror(errno));
+    if (cb->events & (EPOLLIN | EPOLLERR | EPOLLHUP) && on_read(cb) < 0)
+        return;
+    if (cb->events & EPOLLOUT) {
+        ssize_t sent = output_flush(&cb->out, cb->fd);
+        if (sent < 0) {
+            close_client(cb);
+            return;
+        }
+        info.bytes_sent += sent;
+    }
+    rearm_connection(loop, cb);
+}
 
-    // Update information stats
-    info.bytes_sent += sent;
-    bytestring_release(cb->payload);
-    cb->payload = NULL;
+static ssize_t write_packet(struct closure *cb, const unsigned char *data,
+                            size_t len, int lane) {
+    ssize_t sent = output_write(&cb->out, cb->fd, data, len, lane);
+    if (sent > 0)
+        info.bytes_sent += sent;
+    if (output_pending(&cb->out) > 0)
+        rearm_connection(server_loop, cb);
+    return sent;
+}
 
-    /*
-     * Re-arm callback by setting EPOLL event on EPOLLIN to read fds and
-     * re-assigning the callback `on_read` for the next event
-     */
-    cb->call = on_read;
-    evloop_rearm_callback_read(loop, cb);
+static void rearm_connection(struct evloop *loop, struct closure *cb) {
+    int events = EPOLLIN;
+    if (output_pending(&cb->out) > 0)
+        events |= EPOLLOUT;
+    epoll_mod(loop->epollfd, cb->fd, events, cb);
 }
 
 
@@ -306,7 +531,7 @@ static void on_write(struct evloop *loop, void *arg) {
  * Statistics topics, published every N seconds defined by configuration
  * interval
  */
-#define SYS_TOPICS 14
+#define SYS_TOPICS 24
 
 static const char *sys_topics[SYS_TOPICS] = {
     "$SOL/",
@@ -322,7 +547,17 @@ static const char *sys_topics[SYS_TOPICS] = {
     "$SOL/broker/bytes/received/",
     "$SOL/broker/messages/sent/",
     "$SOL/broker/messages/received/",
-    "$SOL/broker/memory/used"
+    "$SOL/broker/memory/used",
+    "$SOL/broker/messages/expired/",
+    "$SOL/broker/topics/",
+    "$SOL/broker/topics/reclaimed/",
+    "$SOL/broker/topics/nodes/",
+    "$SOL/broker/topics/nodes/reclaimed/",
+    "$SOL/broker/filter/",
+    "$SOL/broker/filter/rejected/",
+    "$SOL/broker/filter/false_positive_rate/",
+    "$SOL/broker/filter/rebuilds/",
+    "$SOL/broker/filter/rebuild_time/"
 };
 
 static void run(struct evloop *loop) {
@@ -336,35 +571,40 @@ static void run(struct evloop *loop) {
  * Cleanup function to be passed in as destructor to the Hashtable for
  * connecting clients
  */
-static int client_destructor(struct hashtable_entry *entry) {
-    if (!entry)
-        return -1;
-    struct sol_client *client = entry->val;
+static void client_release(struct sol_client *client) {
+    sol_wildcard_clear(&sol, client);
+    session_clear(client);
     if (client->client_id)
         free(client->client_id);
-    free(client);
-    return 0;
+    sol_client_free(client);
 }
 
-/*
- * Cleanup function to be passed in as destructor to the Hashtable for
- * registered closures.
- */
-static int closure_destructor(struct hashtable_entry *entry) {
+static int client_destructor(struct hashtable_entry *entry) {
     if (!entry)
         return -1;
-    struct closure *closure = entry->val;
-    if (closure->payload)
-        bytestring_release(closure->payload);
-    free(closure);
+    client_release(entry->val);
     return 0;
 }
 
 int start_server(const char *addr, const char *port) {
+    /*
+     * Every packet is read here, a fixed header of at most 5 bytes plus up to
+     * max_request_size, there's no serving anything without it
+     */
+    recv_buffer = malloc(conf->max_request_size + 1 + 4);
+    if (!recv_buffer) {
+        sol_error("Unable to allocate a receive buffer of %lu bytes: %s",
+                  conf->max_request_size + 1 + 4, strerror(errno));
+        return -1;
+    }
+
     /* Initialize global Sol instance */
     trie_init(&sol.topics);
-    sol.clients = hashtable_create(client_destructor);
-    sol.closures = hashtable_create(closure_destructor);
+    trie_init(&sol.filters);
+    registry_init(&sol.clients, client_destructor);
+    deferred_acks = list_create(NULL);
+    arena_init(&decode_arena, DECODE_ARENA_SIZE);
+    pool_init(conf->hugepages);
 
     struct closure server_closure;
 
@@ -373,12 +613,26 @@ int start_server(const char *addr, const char *port) {
     server_closure.payload = NULL;
     server_closure.args = &server_closure;
     server_closure.call = on_accept;
-    generate_uuid(server_closure.closure_id);
+
+    /*
+     * Restore topics and persistent sessions from the last snapshot, before
+     * anything else so that the WAL replay can route to them
+     */
+    if (conf->snapshot_path[0] != '\0') {
+        int restored = snapshot_load(&sol, conf->snapshot_path);
+        if (restored < 0)
+            sol_error("Unable to load snapshot %s", conf->snapshot_path);
+        else
+            sol_info("Restored %d sessions from %s",
+                     restored, conf->snapshot_path);
+    }
 
     /* Generate stats topics */
     for (int i = 0; i < SYS_TOPICS; i++)
         sol_topic_put(&sol, topic_create(strdup(sys_topics[i])));
     struct evloop *event_loop = evloop_create(EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
+    msg_queue_set_loop(event_loop);
+    server_loop = event_loop;
 
     /* Set socket in EPOLLIN flag mode, ready to read data */
     evloop_add_callback(event_loop, &server_closure);
@@ -391,20 +645,452 @@ int start_server(const char *addr, const char *port) {
         .args = &sys_closure,
         .call = publish_stats
     };
-    generate_uuid(sys_closure.closure_id);
 
     /* Schedule as periodic task to be executed every 5 seconds */
     evloop_add_periodic_task(event_loop, conf->stats_pub_interval,
                              0, &sys_closure);
+
+    /* Retransmission of unacknowledged QoS > 0 messages */
+    struct closure retry_closure = {
+        .fd = 0,
+        .payload = NULL,
+        .args = &retry_closure,
+        .call = retransmit_inflight
+    };
+    evloop_add_periodic_task(event_loop, conf->retry_interval,
+                             0, &retry_closure);
+
+    /*
+     * Open the WAL, re-routing messages not yet delivered before a crash, and
+     * schedule the group commit, either at the end of each round of events or
+     * every commit window
+     */
+    struct closure wal_closure = {
+        .fd = 0,
+        .payload = NULL,
+        .args = &wal_closure,
+        .call = commit_wal
+    };
+
+    struct closure snapshot_closure = {
+        .fd = 0,
+        .payload = NULL,
+        .args = &snapshot_closure,
+        .call = snapshot_sessions
+    };
+    if (conf->snapshot_path[0] != '\0')
+        evloop_add_periodic_task(event_loop, conf->snapshot_interval,
+                                 0, &snapshot_closure);
+
+    /*
+     * Topics without subscribers are swept a batch at a time at the end of
+     * each round of events, deleted once unused for long enough
+     */
+    struct closure gc_closure = {
+        .fd = 0,
+        .payload = NULL,
+        .args = &gc_closure,
+        .call = collect_topics
+    };
+    evloop_add_iteration_task(event_loop, &gc_closure);
+
+    /*
+     * Memory unlinked from the topics is reclaimed at the end of each round
+     * of events, the loop being the only reader it's never kept waiting
+     */
+    struct closure reclaim_closure = {
+        .fd = 0,
+        .payload = NULL,
+        .args = &reclaim_closure,
+        .call = reclaim_retired
+    };
+    evloop_add_iteration_task(event_loop, &reclaim_closure);
+
+    if (conf->wal_path[0] != '\0') {
+        if (wal_init(conf->wal_path, conf->wal_segment_size,
+                     replay_record, NULL) < 0)
+            sol_error("WAL disabled, QoS > 0 messages won't survive a crash");
+        else if (conf->wal_commit_window == 0)
+            evloop_add_iteration_task(event_loop, &wal_closure);
+        else
+            evloop_add_periodic_task(event_loop,
+                                     conf->wal_commit_window / 1000,
+                                     (conf->wal_commit_window % 1000) * 1000000,
+                                     &wal_closure);
+    }
     sol_info("Server start");
     info.start_time = time(NULL);
     run(event_loop);
-    hashtable_release(sol.clients);
-    hashtable_release(sol.closures);
+    commit_wal(event_loop, NULL);
+    wal_close();
+    if (conf->snapshot_path[0] != '\0') {
+        // A last synchronous snapshot, nothing else is running now
+        snapshot_sessions(NULL, NULL);
+        if (snapshot_save(&sol, conf->snapshot_path) < 0)
+            sol_error("Error saving snapshot: %s", strerror(errno));
+    }
+    list_release(deferred_acks, 0);
+    arena_release(&decode_arena);
+    free(recv_buffer);
+    registry_release(&sol.clients);
+    connections_release(&sol.connections);
+    pool_release();
     sol_info("Sol v%s exiting", VERSION);
     return 0;
 }
 
+/*
+ * Pack a PUBLISH packet into a bytestring sized on the exact length of the
+ * packet, ready to be sent out or stored in an in-flight window
+ */
+static struct bytestring *pack_publish(const union mqtt_packet *pkt) {
+    return pack_mqtt_packet(pkt, PUBLISH);
+}
+
+/*
+ * Overwrite the packet id of an already packed PUBLISH, each subscriber
+ * session hands out its own ids, so the same packed message can't be shared
+ */
+static void set_publish_pkt_id(struct bytestring *packet,
+                               unsigned short pkt_id) {
+    const unsigned char *ptr = packet->data + 1;
+    mqtt_decode_length(&ptr);
+    uint16_t topiclen = unpack_u16(&ptr);
+    unsigned char *pkt_id_ptr = (unsigned char *) ptr + topiclen;
+    pack_u16(&pkt_id_ptr, pkt_id);
+}
+
+/*
+ * PUBLISH packets take the data lane, bounded by max_output_bytes as a slow
+ * subscriber would otherwise pile up output without limits; messages dropped
+ * here are still tracked if QoS > 0 and will be retransmitted. PUBRELs re-sent
+ * from the in-flight window are control packets.
+ */
+static void write_publish(struct sol_client *sc,
+                          const struct bytestring *packet) {
+    union mqtt_header hdr = { .byte = *packet->data };
+    int lane = hdr.bits.type == PUBLISH ? OUTPUT_DATA : OUTPUT_CONTROL;
+    if (lane == OUTPUT_DATA
+        && output_pending(&sc->cb->out) > conf->max_output_bytes) {
+        sol_debug("Output of %s backed up, dropping PUBLISH", sc->client_id);
+        return;
+    }
+    if (write_packet(sc->cb, packet->data, packet->size, lane) < 0)
+        sol_error("Error publishing to %s: %s",
+                  sc->client_id, strerror(errno));
+    info.messages_sent++;
+}
+
+static void track_publish(struct inflight_msg *msg,
+                          struct bytestring *packet, long wal_id) {
+    union mqtt_header hdr = { .byte = *packet->data };
+    set_publish_pkt_id(packet, msg->pkt_id);
+    msg->qos = hdr.bits.qos;
+    msg->sent_at = time(NULL);
+    msg->wal_id = wal_id;
+    msg->packet = packet;
+}
+
+/*
+ * Send a packed PUBLISH to a client, taking ownership of the packet. QoS > 0
+ * messages get a packet id from the in-flight window of the client session
+ * and are retained till acknowledged, if the window is full they're queued.
+ * Each one of them holds a reference on the WAL segment storing the message,
+ * by its delivery id if it was logged, keeping the segment alive till the
+ * delivery completes.
+ * The expiration only applies while the message waits in the queue.
+ */
+static void send_publish(struct sol_client *sc, struct bytestring *packet,
+                         long wal_id, time_t expire_at) {
+    union mqtt_header hdr = { .byte = *packet->data };
+    if (hdr.bits.qos == AT_MOST_ONCE) {
+        // Offline clients only get QoS > 0 messages queued
+        if (sc->online)
+            write_publish(sc, packet);
+        bytestring_release(packet);
+        return;
+    }
+    if (!sc->session.inflight)
+        sc->session.inflight = inflight_create(conf->max_inflight);
+    struct inflight *w = sc->session.inflight;
+    struct inflight_msg *msg = NULL;
+    wal_ref(wal_id);
+    // Nothing can overtake messages already waiting for a free slot
+    if (!sc->online || w->pending.nr > 0 || !(msg = inflight_acquire(w))) {
+        int dropped = msg_queue_push(&w->pending, packet,
+                                     wal_id, expire_at);
+        if (dropped > 0)
+            sol_debug("Queue of %s full, %d messages dropped",
+                      sc->client_id, dropped);
+        return;
+    }
+    track_publish(msg, packet, wal_id);
+    write_publish(sc, packet);
+}
+
+/*
+ * Send queued messages as long as there are free slots in the window, the
+ * rest will follow as acks come back, this way even a long backlog never
+ * blocks the loop
+ */
+static void drain_pending(struct sol_client *sc) {
+    struct inflight *w = sc->session.inflight;
+    struct bytestring *packet;
+    long wal_id;
+    while (w && sc->online && w->nr < w->size &&
+           (packet = msg_queue_pop(&w->pending, &wal_id))) {
+        track_publish(inflight_acquire(w), packet, wal_id);
+        write_publish(sc, packet);
+    }
+}
+
+struct retransmit_ctx {
+    struct sol_client *client;
+    time_t deadline;
+};
+
+/*
+ * Re-send a message in-flight since before the deadline, a PUBLISH goes out
+ * with DUP flag set, while QoS 2 messages already received by the client
+ * store the PUBREL to be re-sent as is.
+ */
+static void retransmit_msg(struct inflight_msg *msg, void *arg) {
+    struct retransmit_ctx *ctx = arg;
+    if (msg->sent_at > ctx->deadline)
+        return;
+    union mqtt_header *hdr = (union mqtt_header *) msg->packet->data;
+    if (hdr->bits.type == PUBLISH) {
+        hdr->bits.dup = 1;
+        sol_debug("Re-sending PUBLISH to %s (d1, q%u, m%u)",
+                  ctx->client->client_id, msg->qos, msg->pkt_id);
+    } else {
+        sol_debug("Re-sending PUBREL to %s (m%u)",
+                  ctx->client->client_id, msg->pkt_id);
+    }
+    msg->sent_at = time(NULL);
+    write_publish(ctx->client, msg->packet);
+}
+
+/*
+ * Retransmit all messages of a client session sent before a deadline, on
+ * reconnection the deadline is the current time, effectively re-sending
+ * every unacknowledged message.
+ */
+static void session_retransmit(struct sol_client *sc, time_t deadline) {
+    struct retransmit_ctx ctx = { .client = sc, .deadline = deadline };
+    inflight_map(sc->session.inflight, retransmit_msg, &ctx);
+}
+
+static int retransmit_client(struct hashtable_entry *entry, void *arg) {
+    struct sol_client *c = entry->val;
+    if (c->online)
+        session_retransmit(c, *(time_t *) arg);
+    return HASHTABLE_OK;
+}
+
+static void session_resume(struct sol_client *sc) {
+    session_retransmit(sc, time(NULL));
+    drain_pending(sc);
+}
+
+static void retransmit_inflight(struct evloop *loop, void *args) {
+    (void) loop;
+    (void) args;
+    time_t deadline = time(NULL) - conf->retry_interval;
+    registry_map2(&sol.clients, retransmit_client, &deadline);
+}
+
+/*
+ * Deliveries worth logging, the ones surviving a restart, only persistent
+ * sessions are restored from the snapshot
+ */
+static inline bool logged_delivery(const struct subscriber *sub) {
+    return sub->qos > AT_MOST_ONCE && !sub->client->clean_session;
+}
+
+/*
+ * Forward a PUBLISH to all the subscribers of a topic, each one receiving it
+ * with its own QoS. Logged deliveries take the ids following the one of the
+ * message in the WAL, in the order the subscribers are visited.
+ */
+static void route_publish(struct topic *t,
+                          union mqtt_packet *pkt, long wal_id) {
+    time_t expire_at = t->expiry > 0 ? evloop_now() + t->expiry : 0;
+    struct subscriber *sub = t->subscribers;
+    long delivery = wal_id;
+    for (; sub; sub = sub->next) {
+        struct sol_client *sc = sub->client;
+        long id = wal_id >= 0 && logged_delivery(sub) ? ++delivery : -1;
+
+        /* Update QoS according to subscriber's one */
+        pkt->publish.header.bits.qos = sub->qos;
+        sol_debug("Sending PUBLISH to %s (d%i, q%u, r%i, m%u, %s, ... (%lu bytes))",
+                  sc->client_id,
+                  pkt->publish.header.bits.dup,
+                  pkt->publish.header.bits.qos,
+                  pkt->publish.header.bits.retain,
+                  pkt->publish.pkt_id,
+                  pkt->publish.topic,
+                  pkt->publish.payloadlen);
+        send_publish(sc, pack_publish(pkt), id, expire_at);
+    }
+}
+
+/*
+ * Pack a PUBLISH as a WAL record, followed by the recipients of its logged
+ * deliveries, each one as QoS and client id, NULL if there's none
+ */
+static struct bytestring *pack_record(const struct topic *t,
+                                      const union mqtt_packet *pkt,
+                                      size_t *nr) {
+    size_t len = 0;
+    const struct subscriber *sub;
+    *nr = 0;
+    for (sub = t->subscribers; sub; sub = sub->next) {
+        if (!logged_delivery(sub))
+            continue;
+        len += sizeof(uint8_t) + sizeof(uint16_t)
+            + strlen(sub->client->client_id);
+        (*nr)++;
+    }
+    if (*nr == 0)
+        return NULL;
+    struct bytestring *packet = pack_publish(pkt);
+    struct bytestring *record = bytestring_create(packet->size + len);
+    unsigned char *ptr = record->data;
+    pack_bytes(&ptr, packet->data, packet->size);
+    bytestring_release(packet);
+    for (sub = t->subscribers; sub; sub = sub->next) {
+        if (!logged_delivery(sub))
+            continue;
+        size_t idlen = strlen(sub->client->client_id);
+        *ptr++ = sub->qos;
+        pack_u16(&ptr, idlen);
+        pack_bytes(&ptr, (const uint8_t *) sub->client->client_id, idlen);
+    }
+    return record;
+}
+
+static void send_deferred_ack(struct deferred_ack *ack) {
+    struct sol_client *c = registry_get(&sol.clients, ack->client_id);
+    if (c && c->online) {
+        if (write_packet(c->cb, ack->packet,
+                         MQTT_ACK_LEN, OUTPUT_CONTROL) < 0)
+            sol_error("Error acknowledging %s: %s",
+                      c->client_id, strerror(errno));
+    }
+    free(ack->client_id);
+    free(ack);
+}
+
+/*
+ * Group commit, all the records appended since the last commit are synced
+ * with a single fdatasync and then the acks held back are sent out. On
+ * failure acks are dropped, publishers will re-send the messages. Deliveries
+ * settled in the meantime are logged too, even with no message to commit.
+ */
+static void commit_wal(struct evloop *loop, void *args) {
+    (void) loop;
+    (void) args;
+    bool durable = wal_commit() == 0;
+    struct deferred_ack *ack;
+    while ((ack = list_pop(deferred_acks))) {
+        if (durable) {
+            send_deferred_ack(ack);
+        } else {
+            free(ack->client_id);
+            free(ack);
+        }
+    }
+}
+
+static void reclaim_retired(struct evloop *loop, void *args) {
+    (void) loop;
+    (void) args;
+    if (ebr_pending() > 0)
+        ebr_collect();
+}
+
+static void collect_topics(struct evloop *loop, void *args) {
+    (void) loop;
+    (void) args;
+    size_t reclaimed = sol_topic_gc(&sol, conf->topic_gc_idle, TOPIC_GC_BATCH);
+    if (reclaimed > 0)
+        sol_debug("Deleted %lu unused topics", reclaimed);
+}
+
+/*
+ * Re-send a message logged before a restart to the recipients whose delivery
+ * wasn't settled yet, as long as their session was restored, clients that
+ * subscribed afterwards never get it
+ */
+static void replay_record(unsigned char *data,
+                          size_t len, long wal_id, void *arg) {
+    (void) arg;
+    const unsigned char *ptr = data + 1;
+    const unsigned char *end = data + len;
+    ptr += mqtt_decode_length(&ptr);
+    union mqtt_packet pkt;
+    if (unpack_mqtt_packet(data, &pkt, &decode_arena) < 0) {
+        sol_warning("Skipping malformed message %ld in the WAL", wal_id);
+        arena_reset(&decode_arena);
+        return;
+    }
+    struct topic *t = sol_topic_get(&sol, (const char *) pkt.publish.topic);
+    time_t expire_at = t && t->expiry > 0 ? evloop_now() + t->expiry : 0;
+    for (long id = wal_id + 1; end - ptr >= 3; id++) {
+        unsigned char qos = *ptr++;
+        uint16_t idlen = unpack_u16(&ptr);
+        if (end - ptr < idlen)
+            break;
+        char *client_id = arena_alloc(&decode_arena, idlen + 1);
+        memcpy(client_id, ptr, idlen);
+        client_id[idlen] = '\0';
+        ptr += idlen;
+        struct sol_client *sc;
+        if (wal_settled(id) || !(sc = registry_get(&sol.clients, client_id)))
+            continue;
+        pkt.publish.header.bits.qos = qos;
+        send_publish(sc, pack_publish(&pkt), id, expire_at);
+    }
+    arena_reset(&decode_arena);
+}
+
+// Pid of the child writing the last snapshot, 0 if none is running
+static pid_t snapshot_pid = 0;
+
+/*
+ * Snapshots are written by a forked child, it works on a copy-on-write image of
+ * the memory frozen at fork time, so the loop never stalls, no matter how
+ * many subscriptions there are. Only one snapshot runs at a time, the child is
+ * reaped on the next tick. Called with a NULL loop it just waits for the
+ * running child, if any.
+ */
+static void snapshot_sessions(struct evloop *loop, void *args) {
+    (void) args;
+    int status;
+    if (snapshot_pid > 0) {
+        pid_t pid = waitpid(snapshot_pid, &status, loop ? WNOHANG : 0);
+        if (pid == 0)
+            return;
+        if (pid == snapshot_pid &&
+            (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+            sol_error("Snapshot to %s failed", conf->snapshot_path);
+        snapshot_pid = 0;
+    }
+    if (!loop)
+        return;
+    pid_t pid = fork();
+    if (pid < 0) {
+        sol_error("Unable to fork for snapshot: %s", strerror(errno));
+    } else if (pid == 0) {
+        _exit(snapshot_save(&sol, conf->snapshot_path) == 0 ? 0 : 1);
+    } else {
+        snapshot_pid = pid;
+        sol_debug("Snapshot started (pid %d)", pid);
+    }
+}
+
 static void publish_message(unsigned short pkt_id,
                             unsigned short topiclen,
                             const char *topic,
@@ -425,46 +1111,21 @@ static void publish_message(unsigned short pkt_id,
                                                  payloadlen,
                                                  payload);
     pkt.publish = *p;
-    size_t len;
-    unsigned char *packed;
 
     /* Send payload through TCP to all subscribed clients of the topic */
-    struct list_node *cur = t->subscribers->head;
-    size_t sent = 0L;
-    for (; cur; cur = cur->next) {
-        sol_debug("Sending PUBLISH (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
+    struct subscriber *sub = t->subscribers;
+    for (; sub; sub = sub->next) {
+        sol_debug("Sending PUBLISH (d%i, q%u, r%i, m%u, %s, ... (%lu bytes))",
                   pkt.publish.header.bits.dup,
                   pkt.publish.header.bits.qos,
                   pkt.publish.header.bits.retain,
                   pkt.publish.pkt_id,
                   pkt.publish.topic,
                   pkt.publish.payloadlen);
-        len = MQTT_HEADER_LEN + sizeof(uint16_t) +
-            pkt.publish.topiclen + pkt.publish.payloadlen;
-        struct subscriber *sub = cur->data;
-        struct sol_client *sc = sub->client;
 
         /* Update QoS according to subscriber's one */
         pkt.publish.header.bits.qos = sub->qos;
-        if (pkt.publish.header.bits.qos > AT_MOST_ONCE)
-            len += sizeof(uint16_t);
-        int remaininglen_offset = 0;
-        if ((len - 1) > 0x200000)
-            remaininglen_offset = 3;
-        else if ((len - 1) > 0x4000)
-            remaininglen_offset = 2;
-        else if ((len - 1) > 0x80)
-            remaininglen_offset = 1;
-        len += remaininglen_offset;
-        packed = pack_mqtt_packet(&pkt, PUBLISH);
-        if ((sent = send_bytes(sc->fd, packed, len)) < 0)
-            sol_error("Error publishing to %s: %s",
-                      sc->client_id, strerror(errno));
-
-        // Update information stats
-        info.bytes_sent += sent;
-        info.messages_sent++;
-        free(packed);
+        send_publish(sub->client, pack_publish(&pkt), -1, 0);
     }
     free(p);
 }
@@ -473,7 +1134,17 @@ static void publish_message(unsigned short pkt_id,
  * Publish statistics periodic task, it will be called once every N config
  * defined seconds, it publish some information on predefined topics
  */
+/* Publish a value on a stats topic, creating the topic the first time */
+static void publish_stat(const char *topic, const char *value) {
+    if (!sol_topic_get(&sol, topic))
+        sol_topic_put(&sol, topic_create(strdup(topic)));
+    publish_message(0, strlen(topic), topic,
+                    strlen(value), (unsigned char *) value);
+}
+
 static void publish_stats(struct evloop *loop, void *args) {
+    (void) loop;
+    (void) args;
     char cclients[number_len(info.nclients) + 1];
     sprintf(cclients, "%d", info.nclients);
     char bsent[number_len(info.bytes_sent) + 1];
@@ -482,6 +1153,28 @@ static void publish_stats(struct evloop *loop, void *args) {
     sprintf(msent, "%lld", info.messages_sent);
     char mrecv[number_len(info.messages_recv) + 1];
     sprintf(mrecv, "%lld", info.messages_recv);
+    char mexpired[number_len(msg_queue_expired()) + 1];
+    sprintf(mexpired, "%lu", msg_queue_expired());
+    char topics[number_len(trie_size(&sol.topics)) + 1];
+    sprintf(topics, "%lu", trie_size(&sol.topics));
+    char treclaimed[number_len(sol.topic_gc.topics) + 1];
+    sprintf(treclaimed, "%lu", sol.topic_gc.topics);
+    char nodes[number_len(trie_nodes()) + 1];
+    sprintf(nodes, "%lu", trie_nodes());
+    char nreclaimed[number_len(sol.topic_gc.nodes) + 1];
+    sprintf(nreclaimed, "%lu", sol.topic_gc.nodes);
+    struct topic_filter *f = &sol.topic_filter;
+    char frejected[number_len(f->rejected) + 1];
+    sprintf(frejected, "%lu", f->rejected);
+    // Share of the publishes without subscribers passing the filter
+    size_t negatives = f->rejected + f->false_positives;
+    char fprate[16];
+    sprintf(fprate, "%.4f", negatives > 0 ?
+            (double) f->false_positives / negatives : 0.0);
+    char frebuilds[number_len(f->rebuilds) + 1];
+    sprintf(frebuilds, "%lu", f->rebuilds);
+    char frtime[number_len(f->rebuild_usec) + 1];
+    sprintf(frtime, "%ld", f->rebuild_usec);
     long long uptime = time(NULL) - info.start_time;
     char utime[number_len(uptime) + 1];
     sprintf(utime, "%lld", uptime);
@@ -500,27 +1193,66 @@ static void publish_stats(struct evloop *loop, void *args) {
                     strlen(msent), (unsigned char *) &msent);
     publish_message(0, strlen(sys_topics[12]), sys_topics[12],
                     strlen(mrecv), (unsigned char *) &mrecv);
+    publish_message(0, strlen(sys_topics[14]), sys_topics[14],
+                    strlen(mexpired), (unsigned char *) &mexpired);
+    publish_message(0, strlen(sys_topics[15]), sys_topics[15],
+                    strlen(topics), (unsigned char *) &topics);
+    publish_message(0, strlen(sys_topics[16]), sys_topics[16],
+                    strlen(treclaimed), (unsigned char *) &treclaimed);
+    publish_message(0, strlen(sys_topics[17]), sys_topics[17],
+                    strlen(nodes), (unsigned char *) &nodes);
+    publish_message(0, strlen(sys_topics[18]), sys_topics[18],
+                    strlen(nreclaimed), (unsigned char *) &nreclaimed);
+    publish_message(0, strlen(sys_topics[20]), sys_topics[20],
+                    strlen(frejected), (unsigned char *) &frejected);
+    publish_message(0, strlen(sys_topics[21]), sys_topics[21],
+                    strlen(fprate), (unsigned char *) &fprate);
+    publish_message(0, strlen(sys_topics[22]), sys_topics[22],
+                    strlen(frebuilds), (unsigned char *) &frebuilds);
+    publish_message(0, strlen(sys_topics[23]), sys_topics[23],
+                    strlen(frtime), (unsigned char *) &frtime);
+    // Objects in use and memory held by each slab
+    for (struct slab *s = slab_list(); s; s = s->next) {
+        char topic[64], value[32];
+        snprintf(topic, sizeof(topic),
+                 "$SOL/broker/memory/%s/objects/", s->name);
+        snprintf(value, sizeof(value), "%zu", s->stats.in_use);
+        publish_stat(topic, value);
+        snprintf(topic, sizeof(topic), "$SOL/broker/memory/%s/bytes/", s->name);
+        snprintf(value, sizeof(value), "%zu", slab_bytes(s));
+        publish_stat(topic, value);
+    }
+    // Buffers in use and memory held by each size class, huge ones last
+    const struct pool_stats *ps = pool_stats();
+    for (int i = 0; i <= POOL_CLASSES; i++) {
+        char class[24], topic[64], value[32];
+        if (ps[i].size > 0)
+            snprintf(class, sizeof(class), "%zu", ps[i].size);
+        else
+            snprintf(class, sizeof(class), "huge");
+        snprintf(topic, sizeof(topic),
+                 "$SOL/broker/memory/buffers/%s/objects/", class);
+        snprintf(value, sizeof(value), "%zu", ps[i].in_use);
+        publish_stat(topic, value);
+        snprintf(topic, sizeof(topic),
+                 "$SOL/broker/memory/buffers/%s/bytes/", class);
+        snprintf(value, sizeof(value), "%zu", ps[i].bytes);
+        publish_stat(topic, value);
+    }
 }
 
 static int connect_handler(struct closure *cb, union mqtt_packet *pkt) {
+    const char *cid = (const char *) pkt->connect.payload.client_id;
+    bool clean_session = pkt->connect.bits.clean_session;
 
-    // TODO just return error_code and handle it on `on_read`
-    if (hashtable_exists(sol.clients,
-                         (const char *) pkt->connect.payload.client_id)) {
-        // Already connected client, 2 CONNECT packet should be interpreted as
-        // a violation of the protocol, causing disconnection of the client
+    if (cb->obj) {
+        // A second CONNECT on the same connection is a violation of the
+        // protocol, causing the disconnection of the client
 
         sol_info("Received double CONNECT from %s, disconnecting client",
                  pkt->connect.payload.client_id);
 
-        close(cb->fd);
-        hashtable_del(sol.clients, (const char *) pkt->connect.payload.client_id);
-        hashtable_del(sol.closures, cb->closure_id);
-
-        // Update stats
-        info.nclients--;
-        info.nconnections--;
-
+        close_client(cb);
         return -REARM_W;
     }
     sol_info("New client connected as %s (c%i, k%u)",
@@ -529,37 +1261,83 @@ static int connect_handler(struct closure *cb, union mqtt_packet *pkt) {
              pkt->connect.payload.keepalive);
 
     /*
-     * Add the new connected client to the global map, if it is already
-     * connected, kick him out accordingly to the MQTT v3.1.1 specs.
+     * The lookup of the id and the insertion of the new client are a single
+     * operation on the registry: a clean session takes the place of any
+     * client with the same id, a persistent one keeps it to be restored
      */
-    struct sol_client *new_client = malloc(sizeof(*new_client));
-    new_client->fd = cb->fd;
-    const char *cid = (const char *) pkt->connect.payload.client_id;
-    new_client->client_id = strdup(cid);
-    hashtable_put(sol.clients, cid, new_client);
+    struct sol_client *c = sol_client_alloc();
+    c->fd = cb->fd;
+    c->cb = cb;
+    c->client_id = strdup(cid);
+    c->online = true;
+    c->clean_session = clean_session;
+    c->resume = false;
+    c->last_topic.id = TOPIC_ID_NONE;
+    c->last_topic.hash = 0;
+    c->session.subscriptions = NULL;
+    c->session.index = NULL;
+    c->session.wildcards = NULL;
+    c->session.filters = NULL;
+    c->session.inflight = NULL;
+    c->session.received = NULL;
+    struct sol_client *prev = registry_get_or_insert(&sol.clients,
+                                                     c->client_id, c,
+                                                     clean_session);
+    if (prev && prev->online) {
+        /*
+         * The id is taken over by a new connection, as by MQTT v3.1.1 specs
+         * the previous one is closed right away. Events of this same round
+         * still pending for it are dropped.
+         */
+        sol_info("Client %s connected again, closing its previous connection",
+                 pkt->connect.payload.client_id);
+        prev->cb->obj = NULL;
+        close_connection(prev->cb);
+        prev->online = false;
+        prev->fd = -1;
+        prev->cb = NULL;
+    }
+
+    unsigned char session_present = 0;
+    if (prev && !clean_session) {
+        free(c->client_id);
+        sol_client_free(c);
+        c = prev;
+        if (c->clean_session) {
+            // Taken over from a clean session, nothing of it is restored
+            sol_wildcard_clear(&sol, c);
+            session_clear(c);
+            c->clean_session = false;
+            c->last_topic.id = TOPIC_ID_NONE;
+        } else {
+            /*
+             * Restore the persistent session, subscriptions are still in
+             * place while in-flight and queued messages will be sent after
+             * the CONNACK
+             */
+            c->resume = true;
+            session_present = 1;
+        }
+        c->fd = cb->fd;
+        c->cb = cb;
+        c->online = true;
+    } else if (prev) {
+        // A clean session discards the previous one
+        client_release(prev);
+    }
 
     /* Substitute fd on callback with closure */
-    cb->obj = new_client;
+    cb->obj = c;
 
     /* Respond with a connack */
     union mqtt_packet *response = malloc(sizeof(*response));
     unsigned char byte = CONNACK_BYTE;
-
-    // TODO check for session already present
-
-    if (pkt->connect.bits.clean_session == false)
-        new_client->session.subscriptions = list_create(NULL);
-
-    unsigned char session_present = 0;
     unsigned char connect_flags = 0 | (session_present & 0x1) << 0;
     unsigned char rc = 0;  // 0 means connection accepted
 
     response->connack = *mqtt_packet_connack(byte, connect_flags, rc);
 
-    cb->payload = bytestring_create(MQTT_ACK_LEN);
-    unsigned char *p = pack_mqtt_packet(response, CONNACK);
-    memcpy(cb->payload->data, p, MQTT_ACK_LEN);
-    free(p);
+    cb->payload = pack_mqtt_packet(response, CONNACK);
 
     sol_debug("Sending CONNACK to %s (%u, %u)",
               pkt->connect.payload.client_id,
@@ -571,36 +1349,17 @@ static int connect_handler(struct closure *cb, union mqtt_packet *pkt) {
 }
 
 static int disconnect_handler(struct closure *cb, union mqtt_packet *pkt) {
+    (void) pkt;
     // TODO just return error_code and handle it on `on_read`
     /* Handle disconnection request from client */
     struct sol_client *c = cb->obj;
     sol_debug("Received DISCONNECT from %s", c->client_id);
-    close(c->fd);
-    hashtable_del(sol.clients, c->client_id);
-    hashtable_del(sol.closures, cb->closure_id);
-    // Update stats
-    info.nclients--;
-    info.nconnections--;
-    // TODO remove from all topic where it subscribed
+    close_client(cb);
     return -REARM_W;
 }
 
-/* Recursive auxiliary function to subscribe to all children of a given topic */
-static void recursive_subscription(struct trie_node *node, void *arg) {
-    if (!node || !node->data)
-        return;
-    struct list_node *child = node->children->head;
-    for (; child; child = child->next)
-        recursive_subscription(child->data, arg);
-    struct topic *t = node->data;
-    struct subscriber *s = arg;
-    t->subscribers = list_push(t->subscribers, s);
-}
-
 static int subscribe_handler(struct closure *cb, union mqtt_packet *pkt) {
     struct sol_client *c = cb->obj;
-    bool wildcard = false;
-    bool alloced = false;
 
     /*
      * We respond to the subscription request with SUBACK and a list of QoS in
@@ -611,52 +1370,40 @@ static int subscribe_handler(struct closure *cb, union mqtt_packet *pkt) {
     /* Subscribe packets contains a list of topics and QoS tuples */
     for (unsigned i = 0; i < pkt->subscribe.tuples_len; i++) {
         sol_debug("Received SUBSCRIBE from %s", c->client_id);
+        const char *topic = (const char *) pkt->subscribe.tuples[i].topic;
+        unsigned qos = pkt->subscribe.tuples[i].qos;
+        sol_debug("\t%s (QoS %i)", topic, qos);
+        rcs[i] = qos;
+        /*
+         * Wildcards subscribe to the matching topics, those already known and
+         * those to come, no topic is created for the filter itself
+         */
+        if (strpbrk(topic, "+#")) {
+            sol_wildcard_add(&sol, topic, c, qos);
+            continue;
+        }
         /*
          * Check if the topic exists already or in case create it and store in
          * the global map
          */
-        char *topic = (char *) pkt->subscribe.tuples[i].topic;
-        sol_debug("\t%s (QoS %i)", topic, pkt->subscribe.tuples[i].qos);
-        /* Recursive subscribe to all children topics if the topic ends with "/#" */
-        if (topic[pkt->subscribe.tuples[i].topic_len - 1] == '#' &&
-            topic[pkt->subscribe.tuples[i].topic_len - 2] == '/') {
-            topic = remove_occur(topic, '#');
-            wildcard = true;
-        } else if (topic[pkt->subscribe.tuples[i].topic_len - 1] != '/') {
-            topic = append_string((char *) pkt->subscribe.tuples[i].topic, "/", 1);
-            alloced = true;
-        }
         struct topic *t = sol_topic_get(&sol, topic);
-
-        // TODO check for callback correctly set to obj
         if (!t) {
-            t = topic_create(strdup(topic));
+            t = topic_create(topic_name(topic, strlen(topic)));
             sol_topic_put(&sol, t);
-        } else if (wildcard == true) {
-            struct subscriber *sub = malloc(sizeof(*sub));
-            sub->client = cb->obj;
-            sub->qos = pkt->subscribe.tuples[i].qos;
-            trie_prefix_map_tuple(&sol.topics, topic,
-                                  recursive_subscription, sub);
         }
-
-        // Clean session true for now
-        topic_add_subscriber(t, cb->obj, pkt->subscribe.tuples[i].qos, true);
-        if (alloced)
-            free(topic);
-        rcs[i] = pkt->subscribe.tuples[i].qos;
+        // Subscribing again to a topic just updates the QoS
+        struct subscriber *sub = session_subscription(c, t);
+        if (sub)
+            sub->qos = qos;
+        else
+            topic_add_subscriber(t, c, qos);
     }
     struct mqtt_suback *suback = mqtt_packet_suback(SUBACK_BYTE,
                                                     pkt->subscribe.pkt_id,
                                                     rcs,
                                                     pkt->subscribe.tuples_len);
-    mqtt_packet_release(pkt, SUBSCRIBE);
     pkt->suback = *suback;
-    unsigned char *packed = pack_mqtt_packet(pkt, SUBACK);
-    size_t len = MQTT_HEADER_LEN + sizeof(uint16_t) + pkt->subscribe.tuples_len;
-    cb->payload = bytestring_create(len);
-    memcpy(cb->payload->data, packed, len);
-    free(packed);
+    cb->payload = pack_mqtt_packet(pkt, SUBACK);
     mqtt_packet_release(pkt, SUBACK);
     free(suback);
     sol_debug("Sending SUBACK to %s", c->client_id);
@@ -666,18 +1413,34 @@ static int subscribe_handler(struct closure *cb, union mqtt_packet *pkt) {
 static int unsubscribe_handler(struct closure *cb, union mqtt_packet *pkt) {
     struct sol_client *c = cb->obj;
     sol_debug("Received UNSUBSCRIBE from %s", c->client_id);
-    pkt->ack = *mqtt_packet_ack(UNSUBACK_BYTE, pkt->unsubscribe.pkt_id);
-    unsigned char *packed = pack_mqtt_packet(pkt, UNSUBACK);
-    cb->payload = bytestring_create(MQTT_ACK_LEN);
-    memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-    free(packed);
+    /*
+     * Filters the client isn't subscribed to are ignored, the UNSUBACK is
+     * sent all the same as required by MQTT specs
+     */
+    for (unsigned i = 0; i < pkt->unsubscribe.tuples_len; i++) {
+        const char *topic = (const char *) pkt->unsubscribe.tuples[i].topic;
+        sol_debug("\t%s", topic);
+        if (strpbrk(topic, "+#")) {
+            sol_wildcard_del(&sol, topic, c);
+            continue;
+        }
+        struct topic *t = sol_topic_get(&sol, topic);
+        struct subscriber *sub = t ? session_subscription(c, t) : NULL;
+        // The topic is left to the collector once without subscribers
+        if (sub)
+            topic_del_subscriber(sub);
+    }
+    struct mqtt_ack *unsuback = mqtt_packet_ack(UNSUBACK_BYTE,
+                                                pkt->unsubscribe.pkt_id);
+    pkt->ack = *unsuback;
+    cb->payload = pack_mqtt_packet(pkt, UNSUBACK);
     sol_debug("Sending UNSUBACK to %s", c->client_id);
     return REARM_W;
 }
 
 static int publish_handler(struct closure *cb, union mqtt_packet *pkt) {
     struct sol_client *c = cb->obj;
-    sol_debug("Received PUBLISH from %s (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
+    sol_debug("Received PUBLISH from %s (d%i, q%u, r%i, m%u, %s, ... (%lu bytes))",
               c->client_id,
               pkt->publish.header.bits.dup,
               pkt->publish.header.bits.qos,
@@ -686,97 +1449,102 @@ static int publish_handler(struct closure *cb, union mqtt_packet *pkt) {
               pkt->publish.topic,
               pkt->publish.payloadlen);
     info.messages_recv++;
-    char *topic = (char *) pkt->publish.topic;
-    bool alloced = false;
+    const char *topic = (const char *) pkt->publish.topic;
     unsigned char qos = pkt->publish.header.bits.qos;
 
     /*
-     * For convenience we assure that all topics ends with a '/', indicating a
-     * hierarchical level
+     * A QoS 2 packet id still waiting for its PUBREL means that the message
+     * is a retransmission, already forwarded to subscribers, the client only
+     * needs a new PUBREC
      */
-    if (topic[pkt->publish.topiclen - 1] != '/') {
-        topic = append_string((char *) pkt->publish.topic, "/", 1);
-        alloced = true;
+    if (qos == EXACTLY_ONCE) {
+        if (!c->session.received)
+            c->session.received = pktid_set_create();
+        if (!pktid_set_add(c->session.received, pkt->publish.pkt_id)) {
+            sol_debug("Discarding duplicate PUBLISH from %s (m%u)",
+                      c->client_id, pkt->publish.pkt_id);
+            goto ack;
+        }
     }
 
     /*
-     * Retrieve the topic from the global map, if it wasn't created before,
-     * create a new one with the name selected
+     * Topics passing neither as known nor as matching a wildcard subscription
+     * have no subscribers, the message is just acknowledged
      */
-    struct topic *t = sol_topic_get(&sol, topic);
+    int filter = sol_topic_filter(&sol, topic, pkt->publish.topiclen);
+    if (filter == TOPIC_FILTER_NONE)
+        goto ack;
+
+    /*
+     * Retrieve the topic from the global map, starting from the last one the
+     * client published to, if it wasn't created before and it may match a
+     * wildcard subscription, create a new one with the name ending with a
+     * '/', indicating a hierarchical level
+     */
+    struct topic *t = sol_topic_lookup(&sol, &c->last_topic,
+                                       topic, pkt->publish.topiclen);
+    if (!t || !t->subscribers)
+        sol.topic_filter.false_positives++;
+    if (!t && filter == TOPIC_FILTER_TOPIC)
+        goto ack;
     if (!t) {
-        t = topic_create(strdup(topic));
+        t = topic_create(topic_name(topic, pkt->publish.topiclen));
         sol_topic_put(&sol, t);
+        c->last_topic.id = t->id;
+    } else {
+        // Keeps the topic off the garbage collection while in use
+        t->last_used = time(NULL);
     }
 
-    // Not the best way to handle this
-    if (alloced == true)
-        free(topic);
-    size_t publen;
-    unsigned char *pub;
-    struct list_node *cur = t->subscribers->head;
-    for (; cur; cur = cur->next) {
-        publen = MQTT_HEADER_LEN + sizeof(uint16_t) +
-            pkt->publish.topiclen + pkt->publish.payloadlen;
-        struct subscriber *sub = cur->data;
-        struct sol_client *sc = sub->client;
-
-        /* Update QoS according to subscriber's one */
-        pkt->publish.header.bits.qos = sub->qos;
-        if (pkt->publish.header.bits.qos > AT_MOST_ONCE)
-            publen += sizeof(uint16_t);
-        int remaininglen_offset = 0;
-        if ((publen - 1) > 0x200000)
-            remaininglen_offset = 3;
-        else if ((publen - 1) > 0x4000)
-            remaininglen_offset = 2;
-        else if ((publen - 1) > 0x80)
-            remaininglen_offset = 1;
-        publen += remaininglen_offset;
-        pub = pack_mqtt_packet(pkt, PUBLISH);
-        ssize_t sent;
-        if ((sent = send_bytes(sc->fd, pub, publen)) < 0)
-            sol_error("Error publishing to %s: %s",
-                      sc->client_id, strerror(errno));
-
-        // Update information stats
-        info.bytes_sent += sent;
-        sol_debug("Sending PUBLISH to %s (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
-                  sc->client_id,
-                  pkt->publish.header.bits.dup,
-                  pkt->publish.header.bits.qos,
-                  pkt->publish.header.bits.retain,
-                  pkt->publish.pkt_id,
-                  pkt->publish.topic,
-                  pkt->publish.payloadlen);
-        info.messages_sent++;
-        free(pub);
-    }
-
-    // TODO free publish
-    if (qos == AT_LEAST_ONCE) {
-        mqtt_puback *puback = mqtt_packet_ack(PUBACK_BYTE, pkt->publish.pkt_id);
-        mqtt_packet_release(pkt, PUBLISH);
-        pkt->ack = *puback;
-        unsigned char *packed = pack_mqtt_packet(pkt, PUBACK);
-        cb->payload = bytestring_create(MQTT_ACK_LEN);
-        memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-        free(packed);
-        sol_debug("Sending PUBACK to %s", c->client_id);
-        return REARM_W;
-    } else if (qos == EXACTLY_ONCE) {
-        // TODO add to a hashtable to track PUBREC clients last
-        mqtt_pubrec *pubrec = mqtt_packet_ack(PUBREC_BYTE, pkt->publish.pkt_id);
-        mqtt_packet_release(pkt, PUBLISH);
-        pkt->ack = *pubrec;
-        unsigned char *packed = pack_mqtt_packet(pkt, PUBREC);
-        cb->payload = bytestring_create(MQTT_ACK_LEN);
-        memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-        free(packed);
-        sol_debug("Sending PUBREC to %s", c->client_id);
+    /*
+     * Log QoS > 0 messages with deliveries to persistent sessions before
+     * routing them, the ack will be sent only once the record is durable.
+     * Routing doesn't wait for the commit though, subscribers may get a
+     * message that a crash loses before it's durable, the publisher will
+     * re-send it as it wasn't acknowledged, to them it's a duplicate.
+     */
+    long wal_id = -1;
+    size_t deliveries = 0;
+    struct bytestring *record = NULL;
+    if (qos > AT_MOST_ONCE && wal_enabled() &&
+        (record = pack_record(t, pkt, &deliveries))) {
+        wal_id = wal_append(record->data, record->size, deliveries);
+        bytestring_release(record);
+        if (wal_id < 0) {
+            sol_error("Error logging PUBLISH from %s (m%u), not acknowledged",
+                      c->client_id, pkt->publish.pkt_id);
+            if (qos == EXACTLY_ONCE)
+                pktid_set_del(c->session.received, pkt->publish.pkt_id);
+            return REARM_R;
+        }
+    }
+    route_publish(t, pkt, wal_id);
+
+ack:
+    if (qos > AT_MOST_ONCE) {
+        unsigned char type = qos == AT_LEAST_ONCE ? PUBACK : PUBREC;
+        struct mqtt_ack *ack_pkt = mqtt_packet_ack(qos == AT_LEAST_ONCE ?
+                                                   PUBACK_BYTE : PUBREC_BYTE,
+                                                   pkt->publish.pkt_id);
+        pkt->ack = *ack_pkt;
+        struct bytestring *packed = pack_mqtt_packet(pkt, type);
+        /*
+         * Held back while there are records waiting for a commit, even for
+         * duplicates, this way acks never overtake each other
+         */
+        if (wal_uncommitted() > 0) {
+            struct deferred_ack *dack = malloc(sizeof(*dack));
+            dack->client_id = strdup(c->client_id);
+            memcpy(dack->packet, packed->data, MQTT_ACK_LEN);
+            list_push_back(deferred_acks, dack);
+            bytestring_release(packed);
+            return REARM_R;
+        }
+        cb->payload = packed;
+        sol_debug("Sending %s to %s",
+                  type == PUBACK ? "PUBACK" : "PUBREC", c->client_id);
         return REARM_W;
     }
-    mqtt_packet_release(pkt, PUBLISH);
     /*
      * We're in the case of AT_MOST_ONCE QoS level, we don't need to sent out
      * any byte, it's a fire-and-forget.
@@ -784,44 +1552,90 @@ static int publish_handler(struct closure *cb, union mqtt_packet *pkt) {
     return REARM_R;
 }
 
+/*
+ * Whether the PUBREC of an in-flight QoS 2 message was received, the PUBREL
+ * being stored in place of the PUBLISH from then on
+ */
+static bool inflight_released(const struct inflight_msg *msg) {
+    union mqtt_header hdr = { .byte = *msg->packet->data };
+    return hdr.bits.type == PUBREL;
+}
+
+/*
+ * Acks not matching the state of the message they refer to are ignored, a
+ * PUBACK only completes a QoS 1 delivery, a PUBCOMP a QoS 2 one whose PUBREC
+ * was received, neither the slot nor the WAL reference go before
+ */
 static int puback_handler(struct closure *cb, union mqtt_packet *pkt) {
-    sol_debug("Received PUBACK from %s",
-              ((struct sol_client *) cb->obj)->client_id);
-    // TODO Remove from pending PUBACK clients map
+    struct sol_client *c = cb->obj;
+    sol_debug("Received PUBACK from %s", c->client_id);
+    struct inflight_msg *msg = inflight_get(c->session.inflight,
+                                            pkt->ack.pkt_id);
+    if (!msg || msg->qos != AT_LEAST_ONCE) {
+        sol_warning("Unexpected PUBACK from %s (m%u)",
+                    c->client_id, pkt->ack.pkt_id);
+        return REARM_R;
+    }
+    inflight_ack(c->session.inflight, pkt->ack.pkt_id);
+    drain_pending(c);
     return REARM_R;
 }
 
 static int pubrec_handler(struct closure *cb, union mqtt_packet *pkt) {
     struct sol_client *c = cb->obj;
     sol_debug("Received PUBREC from %s", c->client_id);
-    mqtt_pubrel *pubrel = mqtt_packet_ack(PUBREL_BYTE, pkt->publish.pkt_id);
+    mqtt_pubrel *pubrel = mqtt_packet_ack(PUBREL_BYTE, pkt->ack.pkt_id);
     pkt->ack = *pubrel;
-    unsigned char *packed = pack_mqtt_packet(pkt, PUBREC);
-    cb->payload = bytestring_create(MQTT_ACK_LEN);
-    memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-    free(packed);
+    struct bytestring *packed = pack_mqtt_packet(pkt, PUBREL);
+    /*
+     * The message has been received, the in-flight slot is retained till the
+     * PUBCOMP, storing the PUBREL in place of the PUBLISH for retransmissions
+     */
+    struct inflight_msg *msg = inflight_get(c->session.inflight,
+                                            pkt->ack.pkt_id);
+    if (msg && msg->qos == EXACTLY_ONCE) {
+        bytestring_release(msg->packet);
+        msg->packet = bytestring_create(MQTT_ACK_LEN);
+        memcpy(msg->packet->data, packed->data, MQTT_ACK_LEN);
+        msg->sent_at = time(NULL);
+    } else {
+        sol_warning("Unexpected PUBREC from %s (m%u)",
+                    c->client_id, pkt->ack.pkt_id);
+    }
+    cb->payload = packed;
     sol_debug("Sending PUBREL to %s", c->client_id);
     return REARM_W;
 }
 
 static int pubrel_handler(struct closure *cb, union mqtt_packet *pkt) {
-    sol_debug("Received PUBREL from %s",
-              ((struct sol_client *) cb->obj)->client_id);
-    mqtt_pubcomp *pubcomp = mqtt_packet_ack(PUBCOMP_BYTE, pkt->publish.pkt_id);
+    struct sol_client *c = cb->obj;
+    sol_debug("Received PUBREL from %s", c->client_id);
+    /*
+     * Release the packet id, from now on a PUBLISH with the same id is a new
+     * message. PUBCOMP is sent anyway, the PUBREL may be a retransmission of
+     * an already released id.
+     */
+    pktid_set_del(c->session.received, pkt->ack.pkt_id);
+    mqtt_pubcomp *pubcomp = mqtt_packet_ack(PUBCOMP_BYTE, pkt->ack.pkt_id);
     pkt->ack = *pubcomp;
-    unsigned char *packed = pack_mqtt_packet(pkt, PUBCOMP);
-    cb->payload = bytestring_create(MQTT_ACK_LEN);
-    memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-    free(packed);
+    cb->payload = pack_mqtt_packet(pkt, PUBCOMP);
     sol_debug("Sending PUBCOMP to %s",
               ((struct sol_client *) cb->obj)->client_id);
     return REARM_W;
 }
 
 static int pubcomp_handler(struct closure *cb, union mqtt_packet *pkt) {
-    sol_debug("Received PUBCOMP from %s",
-              ((struct sol_client *) cb->obj)->client_id);
-    // TODO Remove from pending PUBACK clients map
+    struct sol_client *c = cb->obj;
+    sol_debug("Received PUBCOMP from %s", c->client_id);
+    struct inflight_msg *msg = inflight_get(c->session.inflight,
+                                            pkt->ack.pkt_id);
+    if (!msg || msg->qos != EXACTLY_ONCE || !inflight_released(msg)) {
+        sol_warning("Unexpected PUBCOMP from %s (m%u)",
+                    c->client_id, pkt->ack.pkt_id);
+        return REARM_R;
+    }
+    inflight_ack(c->session.inflight, pkt->ack.pkt_id);
+    drain_pending(c);
     return REARM_R;
 }
 
@@ -829,10 +1643,7 @@ static int pingreq_handler(struct closure *cb, union mqtt_packet *pkt) {
     sol_debug("Received PINGREQ from %s",
               ((struct sol_client *) cb->obj)->client_id);
     pkt->header = *mqtt_packet_header(PINGRESP_BYTE);
-    unsigned char *packed = pack_mqtt_packet(pkt, PINGRESP);
-    cb->payload = bytestring_create(MQTT_HEADER_LEN);
-    memcpy(cb->payload->data, packed, MQTT_HEADER_LEN);
-    free(packed);
+    cb->payload = pack_mqtt_packet(pkt, PINGRESP);
     sol_debug("Sending PINGRESP to %s",
               ((struct sol_client *) cb->obj)->client_id);
     return REARM_W;
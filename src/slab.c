@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <stdalign.h>
+#include "slab.h"
+
+/* Size of the chunks objects are carved from, a malloc each */
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+#define ALIGN(size, a)  (((size) + (a) - 1) & ~((size_t) (a) - 1))
+
+/* Chunks are linked through a header aligned as any object */
+struct slab_chunk {
+    struct slab_chunk *next;
+    alignas(max_align_t) char objs[];
+};
+
+static struct slab *slabs;
+
+static void *slab_grow(struct slab *s) {
+    struct slab_chunk *c = malloc(SLAB_CHUNK_SIZE);
+    if (!c)
+        return NULL;
+    if (!s->chunks) {
+        // Freed objects hold the free list link
+        if (s->size < sizeof(void *))
+            s->size = sizeof(void *);
+        s->size = ALIGN(s->size, alignof(max_align_t));
+        s->next = slabs;
+        slabs = s;
+    }
+    c->next = s->chunks;
+    s->chunks = c;
+    s->stats.chunks++;
+    s->bump = c->objs;
+    s->end = (char *) c + SLAB_CHUNK_SIZE;
+    return c;
+}
+
+void *slab_alloc(struct slab *s) {
+    void *obj = s->free;
+    if (obj) {
+        s->free = *(void **) obj;
+    } else {
+        if ((size_t) (s->end - s->bump) < s->size && !slab_grow(s))
+            return NULL;
+        obj = s->bump;
+        s->bump += s->size;
+    }
+    s->stats.allocs++;
+    s->stats.in_use++;
+    return obj;
+}
+
+void slab_free(struct slab *s, void *obj) {
+    *(void **) obj = s->free;
+    s->free = obj;
+    s->stats.frees++;
+    s->stats.in_use--;
+}
+
+void slab_release(struct slab *s) {
+    while (s->chunks) {
+        struct slab_chunk *c = s->chunks;
+        s->chunks = c->next;
+        free(c);
+    }
+    s->free = s->bump = s->end = NULL;
+    s->stats.in_use = 0;
+    s->stats.chunks = 0;
+    struct slab **p = &slabs;
+    while (*p && *p != s)
+        p = &(*p)->next;
+    if (*p)
+        *p = s->next;
+    s->next = NULL;
+}
+
+size_t slab_bytes(const struct slab *s) {
+    return s->stats.chunks * SLAB_CHUNK_SIZE;
+}
+
+struct slab *slab_list(void) {
+    return slabs;
+}
@@ -0,0 +1,56 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Allocator of objects of a single type, carved out of chunks of a fixed
+ * size. A free object is pushed on a free list threaded through its first
+ * word, an allocation pops it back or bumps a pointer in the last chunk,
+ * only a new chunk goes through malloc. Chunks are kept till the slab is
+ * released, objects of the same type reuse the same memory without
+ * fragmenting the heap.
+ *
+ * A slab belongs to the thread owning the structures of its objects, the
+ * event loop one, with no locking: frees running as EBR destructors run in
+ * the same writer context.
+ */
+struct slab_stats {
+    size_t allocs;
+    size_t frees;
+    size_t in_use;
+    size_t chunks;
+};
+
+struct slab_chunk;
+
+struct slab {
+    const char *name;
+    size_t size;
+    void *free;
+    char *bump;
+    char *end;
+    struct slab_chunk *chunks;
+    struct slab_stats stats;
+    /* Next slab in use, linked on the allocation of the first chunk */
+    struct slab *next;
+};
+
+/* Initializer of a slab of objects of a type */
+#define SLAB_INIT(name, type) { (name), sizeof(type), NULL, NULL, NULL, \
+                                NULL, { 0, 0, 0, 0 }, NULL }
+
+void *slab_alloc(struct slab *);
+
+void slab_free(struct slab *, void *);
+
+/* Release all the chunks, objects still in use are gone with them */
+void slab_release(struct slab *);
+
+/* Bytes of memory held by the chunks of a slab */
+size_t slab_bytes(const struct slab *);
+
+/* First of the slabs in use, the others follow through `next` */
+struct slab *slab_list(void);
+
+#endif
@@ -0,0 +1,331 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "pack.h"
+#include "hashtable.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC   "SOLSNAP"
+#define SNAPSHOT_VERSION 2
+
+/* Magic, version and the two counters */
+#define SNAPSHOT_HEADER_LEN (sizeof(SNAPSHOT_MAGIC) + sizeof(uint32_t) * 2)
+
+/* Topics re-created on every start, never saved */
+#define SYS_PREFIX "$SOL/"
+
+struct snapshot_ctx {
+    FILE *fp;
+    /* Persistent clients sorted by address, a client index is its position */
+    struct sol_client **clients;
+    size_t nr_clients;
+    size_t cap;
+    uint32_t nr_topics;
+    int err;
+};
+
+static void write_u8(struct snapshot_ctx *ctx, uint8_t val) {
+    if (fputc(val, ctx->fp) == EOF)
+        ctx->err = -1;
+}
+
+static void write_u16(struct snapshot_ctx *ctx, uint16_t val) {
+    unsigned char buf[sizeof(uint16_t)], *ptr = buf;
+    pack_u16(&ptr, val);
+    if (fwrite(buf, sizeof(buf), 1, ctx->fp) != 1)
+        ctx->err = -1;
+}
+
+static void write_u32(struct snapshot_ctx *ctx, uint32_t val) {
+    unsigned char buf[sizeof(uint32_t)], *ptr = buf;
+    pack_u32(&ptr, val);
+    if (fwrite(buf, sizeof(buf), 1, ctx->fp) != 1)
+        ctx->err = -1;
+}
+
+static void write_string(struct snapshot_ctx *ctx, const char *str) {
+    uint16_t len = strlen(str);
+    write_u16(ctx, len);
+    if (len > 0 && fwrite(str, len, 1, ctx->fp) != 1)
+        ctx->err = -1;
+}
+
+static int collect_client(struct hashtable_entry *entry, void *arg) {
+    struct snapshot_ctx *ctx = arg;
+    struct sol_client *c = entry->val;
+    if (c->clean_session)
+        return HASHTABLE_OK;
+    if (ctx->nr_clients == ctx->cap) {
+        ctx->cap = ctx->cap ? ctx->cap * 2 : 64;
+        ctx->clients = realloc(ctx->clients, ctx->cap * sizeof(*ctx->clients));
+    }
+    ctx->clients[ctx->nr_clients++] = c;
+    return HASHTABLE_OK;
+}
+
+static int compare_ptr(const void *a, const void *b) {
+    uintptr_t pa = (uintptr_t) *(struct sol_client * const *) a;
+    uintptr_t pb = (uintptr_t) *(struct sol_client * const *) b;
+    return (pa > pb) - (pa < pb);
+}
+
+static long client_index(const struct snapshot_ctx *ctx,
+                         struct sol_client *c) {
+    struct sol_client **found = bsearch(&c, ctx->clients, ctx->nr_clients,
+                                        sizeof(*ctx->clients), compare_ptr);
+    return found ? found - ctx->clients : -1;
+}
+
+static void write_client(struct snapshot_ctx *ctx, struct sol_client *c) {
+    write_string(ctx, c->client_id);
+    struct pktid_set *received = c->session.received;
+    write_u16(ctx, received ? received->nr : 0);
+    if (!received)
+        return;
+    for (unsigned i = 0; i < received->size; i++)
+        if (received->ids[i] != 0)
+            write_u16(ctx, received->ids[i]);
+}
+
+static void write_wildcards(struct snapshot_ctx *ctx, struct sol_client *c) {
+    uint16_t nr = 0;
+    struct wildcard *w;
+    for (w = c->session.wildcards; w; w = w->client_next)
+        nr++;
+    write_u16(ctx, nr);
+    for (w = c->session.wildcards; w; w = w->client_next) {
+        write_string(ctx, w->filter);
+        write_u8(ctx, w->qos);
+    }
+}
+
+static void write_topic(struct trie_node *node, void *arg) {
+    struct snapshot_ctx *ctx = arg;
+    struct topic *t = node->data;
+    if (!t || strncmp(t->name, SYS_PREFIX, sizeof(SYS_PREFIX) - 1) == 0)
+        return;
+    /*
+     * Subscribers with a clean session aren't indexed, they're skipped, as
+     * those made for a wildcard, which is saved with its client
+     */
+    uint32_t nr = 0;
+    struct subscriber *sub;
+    for (sub = t->subscribers; sub; sub = sub->next)
+        if (!sub->wildcard && client_index(ctx, sub->client) >= 0)
+            nr++;
+    write_string(ctx, t->name);
+    write_u32(ctx, nr);
+    for (sub = t->subscribers; sub; sub = sub->next) {
+        long index = sub->wildcard ? -1 : client_index(ctx, sub->client);
+        if (index < 0)
+            continue;
+        write_u32(ctx, index);
+        write_u8(ctx, sub->qos);
+    }
+    ctx->nr_topics++;
+}
+
+static void write_header(struct snapshot_ctx *ctx) {
+    if (fwrite(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1, 1, ctx->fp) != 1)
+        ctx->err = -1;
+    write_u8(ctx, SNAPSHOT_VERSION);
+    write_u32(ctx, ctx->nr_clients);
+    write_u32(ctx, ctx->nr_topics);
+}
+
+int snapshot_save(struct sol *sol, const char *path) {
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    struct snapshot_ctx ctx = { .fp = fopen(tmp_path, "w") };
+    if (!ctx.fp)
+        return -1;
+    registry_map2(&sol->clients, collect_client, &ctx);
+    if (ctx.nr_clients > 0)
+        qsort(ctx.clients, ctx.nr_clients,
+              sizeof(*ctx.clients), compare_ptr);
+    // The number of topics is known only at the end, the header is rewritten
+    write_header(&ctx);
+    for (size_t i = 0; i < ctx.nr_clients; i++) {
+        write_client(&ctx, ctx.clients[i]);
+        write_wildcards(&ctx, ctx.clients[i]);
+    }
+    trie_prefix_map_tuple(&sol->topics, NULL, write_topic, &ctx);
+    rewind(ctx.fp);
+    write_header(&ctx);
+    if (fflush(ctx.fp) != 0 || fsync(fileno(ctx.fp)) < 0)
+        ctx.err = -1;
+    fclose(ctx.fp);
+    free(ctx.clients);
+    if (ctx.err < 0 || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Bounds checked cursor over the mapped file */
+struct reader {
+    const uint8_t *ptr;
+    const uint8_t *end;
+};
+
+static bool has(const struct reader *r, size_t len) {
+    return (size_t) (r->end - r->ptr) >= len;
+}
+
+static char *read_string(struct reader *r) {
+    if (!has(r, sizeof(uint16_t)))
+        return NULL;
+    uint16_t len = unpack_u16(&r->ptr);
+    if (!has(r, len))
+        return NULL;
+    char *str = strndup((const char *) r->ptr, len);
+    r->ptr += len;
+    return str;
+}
+
+static struct sol_client *read_client(struct reader *r) {
+    char *client_id = read_string(r);
+    if (!client_id || !has(r, sizeof(uint16_t))) {
+        free(client_id);
+        return NULL;
+    }
+    uint16_t nr_received = unpack_u16(&r->ptr);
+    if (!has(r, nr_received * sizeof(uint16_t))) {
+        free(client_id);
+        return NULL;
+    }
+    struct sol_client *c = sol_client_alloc();
+    c->client_id = client_id;
+    c->fd = -1;
+    c->cb = NULL;
+    c->online = false;
+    c->clean_session = false;
+    c->resume = false;
+    c->last_topic.id = TOPIC_ID_NONE;
+    c->last_topic.hash = 0;
+    c->session.subscriptions = NULL;
+    c->session.index = NULL;
+    c->session.wildcards = NULL;
+    c->session.filters = NULL;
+    c->session.inflight = NULL;
+    c->session.received = NULL;
+    if (nr_received > 0)
+        c->session.received = pktid_set_create();
+    for (uint16_t i = 0; i < nr_received; i++)
+        pktid_set_add(c->session.received, unpack_u16(&r->ptr));
+    return c;
+}
+
+/*
+ * Subscribe a restored client to its wildcards, topics restored afterwards
+ * are matched against them as they're put back
+ */
+static int read_wildcards(struct sol *sol, struct reader *r,
+                          struct sol_client *c) {
+    if (!has(r, sizeof(uint16_t)))
+        return -1;
+    uint16_t nr = unpack_u16(&r->ptr);
+    for (uint16_t i = 0; i < nr; i++) {
+        char *filter = read_string(r);
+        if (!filter || !has(r, 1)) {
+            free(filter);
+            return -1;
+        }
+        sol_wildcard_add(sol, filter, c, *r->ptr++);
+        free(filter);
+    }
+    return 0;
+}
+
+static int read_topic(struct sol *sol, struct reader *r,
+                      struct sol_client **clients, uint32_t nr_clients) {
+    char *name = read_string(r);
+    if (!name || !has(r, sizeof(uint32_t))) {
+        free(name);
+        return -1;
+    }
+    uint32_t nr_subs = unpack_u32(&r->ptr);
+    if (!has(r, (size_t) nr_subs * (sizeof(uint32_t) + 1))) {
+        free(name);
+        return -1;
+    }
+    struct topic *t = sol_topic_get(sol, name);
+    if (!t) {
+        t = topic_create(name);
+        sol_topic_put(sol, t);
+    } else {
+        free(name);
+    }
+    for (uint32_t i = 0; i < nr_subs; i++) {
+        uint32_t index = unpack_u32(&r->ptr);
+        uint8_t qos = *r->ptr++;
+        if (index < nr_clients)
+            topic_add_subscriber(t, clients[index], qos);
+    }
+    return 0;
+}
+
+int snapshot_load(struct sol *sol, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || (size_t) sb.st_size < SNAPSHOT_HEADER_LEN) {
+        close(fd);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+    struct reader r = { .ptr = map, .end = map + sb.st_size };
+    int rc = -1;
+    uint32_t nr_clients = 0, loaded = 0;
+    struct sol_client **clients = NULL;
+    uint8_t version = r.ptr[sizeof(SNAPSHOT_MAGIC) - 1];
+    if (memcmp(r.ptr, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) != 0 ||
+        version < 1 || version > SNAPSHOT_VERSION)
+        goto exit;
+    r.ptr += sizeof(SNAPSHOT_MAGIC);
+    nr_clients = unpack_u32(&r.ptr);
+    uint32_t nr_topics = unpack_u32(&r.ptr);
+    /*
+     * A client takes at least its id length and its number of received ids,
+     * a count that doesn't fit in what's left of the file is corrupted
+     */
+    if (nr_clients > (size_t) (r.end - r.ptr) / (sizeof(uint16_t) * 2))
+        goto exit;
+    clients = malloc(nr_clients * sizeof(*clients));
+    if (nr_clients > 0 && !clients)
+        goto exit;
+    for (; loaded < nr_clients; loaded++) {
+        if (!(clients[loaded] = read_client(&r)))
+            goto exit;
+        registry_get_or_insert(&sol->clients, clients[loaded]->client_id,
+                               clients[loaded], false);
+        if (version > 1 && read_wildcards(sol, &r, clients[loaded]) < 0) {
+            loaded++;
+            goto exit;
+        }
+    }
+    for (uint32_t i = 0; i < nr_topics; i++)
+        if (read_topic(sol, &r, clients, nr_clients) < 0)
+            goto exit;
+    rc = nr_clients;
+exit:
+    // A truncated snapshot keeps whatever was restored before the error
+    if (rc < 0)
+        sol_error("Corrupted snapshot %s, %u sessions restored", path, loaded);
+    free(clients);
+    munmap(map, sb.st_size);
+    return rc;
+}
@@ -0,0 +1,40 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "core.h"
+
+/*
+ * Binary snapshot of the topics and of the persistent sessions, allowing a
+ * restart without every client having to subscribe again. Clean sessions are
+ * left out, they wouldn't survive a reconnection anyway.
+ *
+ * All integers are big-endian, strings are length-prefixed:
+ *
+ * | magic "SOLSNAP" | version u8 | nr clients u32 | nr topics u32 |
+ * | clients: id len u16 | id | nr received u16 | received pkt ids u16 ... |
+ * |          nr wildcards u16 | filter len u16 | filter | qos u8 ... |
+ * | topics: name len u16 | name | nr subscribers u32 |
+ * |         subscribers: client index u32 | qos u8 ... |
+ *
+ * Subscribers refer to clients by their position in the file, on load they
+ * are fixed up to pointers through an array of the restored clients. Those
+ * made for a wildcard aren't saved with the topics, the wildcard is restored
+ * instead and subscribes again to the topics it matches. Version 1 snapshots,
+ * without wildcards, are still read.
+ */
+
+/*
+ * Write a snapshot to a temporary file renamed over the path once complete,
+ * meant to be run in a forked child, the state being a copy-on-write view
+ * frozen at fork time, return -1 on error
+ */
+int snapshot_save(struct sol *, const char *);
+
+/*
+ * Restore topics and offline persistent sessions from a snapshot, mapping it
+ * in memory with a single mmap, return the number of restored clients or -1
+ * on error
+ */
+int snapshot_load(struct sol *, const char *);
+
+#endif
@@ -45,7 +45,7 @@ int main (int argc, char **argv) {
     sol_log_init(conf->logpath);
     // Print configuration
     config_print();
-    start_server(conf->hostname, conf->port);
+    int rc = start_server(conf->hostname, conf->port);
     sol_log_close();
-    return 0;
+    return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
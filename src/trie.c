@@ -1,96 +1,564 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include "list.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ebr.h"
+#include "hash.h"
 #include "trie.h"
 
-static struct list_node *merge_tnode_list(struct list_node *list1,
-                                          struct list_node *list2) {
-    struct list_node dummy_head = { NULL, NULL }, *tail = &dummy_head;
-    while (list1 && list2) {
-        /* cast to cluster_node */
-        char chr1 = ((struct trie_node *) list1->data)->chr;
-        char chr2 = ((struct trie_node *) list2->data)->chr;
-
-        struct list_node **min = chr1 <= chr2 ? &list1 : &list2;
-        struct list_node *next = (*min)->next;
-        tail = tail->next = *min;
-        *min = next;
-    }
-    tail->next = list1 ? list1 : list2;
-    return dummy_head.next;
+/*
+ * Children of a node. In the style of the adaptive radix tree, small nodes
+ * have room for 4 or 16 children, with an array of 16 byte tags beside the
+ * pointers, each holding 7 bits of the hash of the first level of a child or
+ * marking an empty slot. The tags are matched against a hash all at once and
+ * only the candidates are compared. Past 16 children the pointers become an
+ * open-addressing table with linear probing, where the first probe is almost
+ * always the one, reading a single slot.
+ *
+ * Readers may walk the tree while a writer modifies it. Small sets are
+ * copy-on-write, at most 16 pointers are copied and the new set replaces the
+ * old one, tables are updated in place, storing a new child in a free slot
+ * and marking removed ones with a tombstone, so that probe sequences are
+ * never broken under a reader.
+ */
+#define TRIE_NODE4       4
+#define TRIE_NODE16      16
+#define TAG_EMPTY        0x80
+#define TAG(hash)        ((uint8_t) ((hash) >> 25))
+
+static char tombstone;
+#define TOMBSTONE        ((struct trie_node *) &tombstone)
+
+struct trie_children {
+    uint32_t size;
+    uint32_t nr;
+    /* Slots of a table taken by children or tombstones */
+    uint32_t used;
+    uint8_t tags[TRIE_NODE16];
+    struct trie_node *nodes[];
+};
+
+/*
+ * Pointers to children sets, children and data are published by the writer
+ * with release stores and read with acquire loads, whatever they point to is
+ * fully initialised before and never modified after, but the slots of tables.
+ * Unlinked memory is retired and reclaimed through the epochs.
+ */
+#define LOAD(ptr)           __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define PUBLISH(ptr, val)   __atomic_store_n(&(ptr), (val), __ATOMIC_RELEASE)
+
+/*
+ * Global table of interned levels, shared by all the tries, open addressing
+ * with linear probing, it grows doubling its size
+ */
+static struct {
+    struct trie_level **slots;
+    size_t size;
+    size_t nr;
+} levels;
+
+/* Nodes linked in all the tries, counted by the writer */
+static size_t nodes_nr;
+
+/* Levels are short, the CRC32C is the cheapest to get over them */
+static uint32_t level_hash(const char *str, size_t len) {
+    return hash_crc32c(str, len, 0);
+}
+
+/*
+ * Split the next level out of a key, return its length and move the key
+ * past the separator. A trailing '/' terminates the last level, it does not
+ * start a new empty one.
+ */
+static size_t next_level(const char **key, const char **level) {
+    const char *p = *key;
+    *level = p;
+    while (*p && *p != '/')
+        p++;
+    size_t len = p - *level;
+    *key = *p == '/' ? p + 1 : p;
+    return len;
 }
 
-struct list_node *merge_sort_tnode(struct list_node *head) {
-    struct list_node *list1 = head;
-    if (!list1 || !list1->next)
-        return list1;
-    /* find the middle */
-    struct list_node *list2 = bisect_list(list1);
-    return merge_tnode_list(merge_sort_tnode(list1), merge_sort_tnode(list2));
+static bool level_eq(const struct trie_level *l, uint32_t hash,
+                     const char *str, size_t len) {
+    return l->hash == hash && l->len == len && memcmp(l->str, str, len) == 0;
 }
 
-/* Search for a given node based on a comparison of char stored in structure
- * and a value, O(n) at worst
+/*
+ * Backward shift deletion for linear probing, entries following the removed
+ * slot are moved back unless already at or past their home position, no
+ * tombstones needed
  */
-static struct list_node *linear_search(const List *list, int value) {
-    if (!list || list->len == 0)
+#define TABLE_REMOVE(slots, size, i, hash_of) do {                          \
+    size_t mask_ = (size) - 1, j_ = (i), k_;                                \
+    for (;;) {                                                              \
+        j_ = (j_ + 1) & mask_;                                              \
+        if (!(slots)[j_])                                                   \
+            break;                                                          \
+        k_ = hash_of((slots)[j_]) & mask_;                                  \
+        if ((j_ > (i) && (k_ <= (i) || k_ > j_)) ||                         \
+            (j_ < (i) && k_ <= (i) && k_ > j_)) {                           \
+            (slots)[(i)] = (slots)[j_];                                     \
+            (i) = j_;                                                       \
+        }                                                                   \
+    }                                                                       \
+    (slots)[(i)] = NULL;                                                    \
+} while (0)
+
+#define LEVEL_HASH(l) ((l)->hash)
+#define CHILD_HASH(n) ((n)->levels[0]->hash)
+
+static void levels_put(struct trie_level *l) {
+    size_t i = l->hash & (levels.size - 1);
+    while (levels.slots[i])
+        i = (i + 1) & (levels.size - 1);
+    levels.slots[i] = l;
+}
+
+static void levels_grow(void) {
+    struct trie_level **old = levels.slots;
+    size_t old_size = levels.size;
+    levels.size = old_size ? old_size * 2 : 64;
+    levels.slots = calloc(levels.size, sizeof(*levels.slots));
+    for (size_t i = 0; i < old_size; i++)
+        if (old[i])
+            levels_put(old[i]);
+    free(old);
+}
+
+/* Return the interned copy of a level, adding it if not already known */
+static const struct trie_level *level_intern(const char *str,
+                                             size_t len, uint32_t hash) {
+    if (levels.size > 0) {
+        size_t i = hash & (levels.size - 1);
+        for (; levels.slots[i]; i = (i + 1) & (levels.size - 1)) {
+            if (level_eq(levels.slots[i], hash, str, len)) {
+                levels.slots[i]->refs++;
+                return levels.slots[i];
+            }
+        }
+    }
+    if ((levels.nr + 1) * 4 > levels.size * 3)
+        levels_grow();
+    struct trie_level *l = malloc(sizeof(*l) + len + 1);
+    l->hash = hash;
+    l->refs = 1;
+    l->len = len;
+    memcpy(l->str, str, len);
+    l->str[len] = '\0';
+    levels_put(l);
+    levels.nr++;
+    return l;
+}
+
+static void level_release(const struct trie_level *l) {
+    if (!l)
+        return;
+    size_t i = l->hash & (levels.size - 1);
+    while (levels.slots[i] != l)
+        i = (i + 1) & (levels.size - 1);
+    if (--levels.slots[i]->refs > 0)
+        return;
+    TABLE_REMOVE(levels.slots, levels.size, i, LEVEL_HASH);
+    levels.nr--;
+    free((void *) l);
+}
+
+/* Bitmask of the tags of a small node equal to a given byte */
+static unsigned tags_match(const uint8_t *tags, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i keys = _mm_loadu_si128((const __m128i *) tags);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(keys, _mm_set1_epi8(byte)));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < TRIE_NODE16; i++)
+        if (tags[i] == byte)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/* Bitmask of the empty slots of a small node, only those have the top bit */
+static unsigned tags_match_empty(const uint8_t *tags) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) tags));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < TRIE_NODE16; i++)
+        if (tags[i] & TAG_EMPTY)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+static struct trie_children *children_create(uint32_t size) {
+    struct trie_children *c =
+        malloc(sizeof(*c) + size * sizeof(struct trie_node *));
+    c->size = size;
+    c->nr = 0;
+    c->used = 0;
+    memset(c->tags, TAG_EMPTY, sizeof(c->tags));
+    if (size > TRIE_NODE16)
+        memset(c->nodes, 0, size * sizeof(struct trie_node *));
+    return c;
+}
+
+static struct trie_node *trie_node_child(const struct trie_node *node,
+                                         const char *str, size_t len,
+                                         uint32_t hash) {
+    const struct trie_children *c = LOAD(node->children);
+    struct trie_node *child;
+    if (!c)
+        return NULL;
+    if (c->size <= TRIE_NODE16) {
+        // Pointers of a node16 span more cache lines, load them meanwhile
+        if (c->size == TRIE_NODE16) {
+            __builtin_prefetch(c->nodes + TRIE_NODE16 / 2 - 2);
+            __builtin_prefetch(c->nodes + TRIE_NODE16 - 2);
+        }
+        unsigned mask = tags_match(c->tags, TAG(hash));
+        for (; mask; mask &= mask - 1) {
+            child = LOAD(c->nodes[__builtin_ctz(mask)]);
+            if (level_eq(child->levels[0], hash, str, len))
+                return child;
+        }
         return NULL;
-    for (struct list_node *cur = list->head; cur != NULL; cur = cur->next) {
-        if (((struct trie_node *) cur->data)->chr == value)
-            return cur;
-        else if (((struct trie_node *) cur->data)->chr > value)
-            break;
     }
+    size_t mask = c->size - 1;
+    for (size_t i = hash & mask; (child = LOAD(c->nodes[i]));
+         i = (i + 1) & mask)
+        if (child != TOMBSTONE && level_eq(child->levels[0], hash, str, len))
+            return child;
     return NULL;
 }
 
-/* Auxiliary comparison function, uses on list searches, this one compare the
- * char field stored in each struct trie_node structure contained in each node of the
- * list.
+/* Slot of a child, located by its hash and then compared by pointer */
+static uint32_t children_slot(const struct trie_children *c,
+                              const struct trie_node *child) {
+    uint32_t hash = CHILD_HASH(child);
+    uint32_t i;
+    if (c->size <= TRIE_NODE16) {
+        unsigned mask = tags_match(c->tags, TAG(hash));
+        while (c->nodes[i = __builtin_ctz(mask)] != child)
+            mask &= mask - 1;
+        return i;
+    }
+    uint32_t mask = c->size - 1;
+    for (i = hash & mask; c->nodes[i] != child; i = (i + 1) & mask)
+        ;
+    return i;
+}
+
+/*
+ * Store a child in the first free slot of a set with room for it, a small
+ * set must not be published yet, in a table it's visible once stored
+ */
+static void children_put(struct trie_children *c, struct trie_node *child) {
+    uint32_t hash = CHILD_HASH(child);
+    uint32_t i;
+    if (c->size <= TRIE_NODE16) {
+        // A node4 uses just the first 4 tags
+        i = __builtin_ctz(tags_match_empty(c->tags));
+        c->tags[i] = TAG(hash);
+        c->nodes[i] = child;
+    } else {
+        uint32_t mask = c->size - 1;
+        for (i = hash & mask; c->nodes[i] && c->nodes[i] != TOMBSTONE;
+             i = (i + 1) & mask)
+            ;
+        if (!c->nodes[i])
+            c->used++;
+        PUBLISH(c->nodes[i], child);
+    }
+    c->nr++;
+}
+
+/*
+ * Next child of a set starting from slot *i, NULL when there are no more.
+ * Readers must load the set of a node once and iterate it, like
+ *
+ *   const struct trie_children *c = LOAD(node->children);
+ *   for (uint32_t i = 0; (child = children_next(c, &i)); )
  */
-static int with_char(void *arg1, void *arg2) {
-    struct trie_node *tn1 = ((struct list_node *) arg1)->data;
-    struct trie_node *tn2 = ((struct list_node *) arg2)->data;
-    if (tn1->chr == tn2->chr)
-        return 0;
-    return -1;
+static struct trie_node *children_next(const struct trie_children *c,
+                                       uint32_t *i) {
+    struct trie_node *child;
+    if (!c)
+        return NULL;
+    bool small = c->size <= TRIE_NODE16;
+    for (; *i < c->size; (*i)++) {
+        if (small && (c->tags[*i] & TAG_EMPTY))
+            continue;
+        child = LOAD(c->nodes[*i]);
+        if (child && child != TOMBSTONE) {
+            (*i)++;
+            return child;
+        }
+    }
+    return NULL;
+}
+
+/* Copy the children of a set, but one to leave out, to a new one */
+static struct trie_children *children_copy(const struct trie_children *old,
+                                           uint32_t size,
+                                           const struct trie_node *skip) {
+    struct trie_children *c = children_create(size);
+    struct trie_node *child;
+    for (uint32_t i = 0; (child = children_next(old, &i)); )
+        if (child != skip)
+            children_put(c, child);
+    return c;
 }
 
-// Check for children in a struct trie_node, if a node has no children is considered
-// free
-static bool trie_is_free_node(const struct trie_node *node) {
-    return node->children->len == 0 ? true : false;
+/* Replace the children of a node, retiring the old set */
+static void trie_node_set_children(struct trie_node *node,
+                                   struct trie_children *c) {
+    struct trie_children *old = node->children;
+    PUBLISH(node->children, c);
+    if (old)
+        ebr_retire(old, free);
 }
 
-static struct trie_node *trie_node_find(const struct trie_node *node,
-                                        const char *prefix) {
-    struct trie_node *retnode = (struct trie_node *) node;
+static uint32_t trie_node_children_nr(const struct trie_node *node) {
+    return node->children ? node->children->nr : 0;
+}
 
-    // Move to the end of the prefix first
-    for (; *prefix; prefix++) {
-        // O(n), the best we can have
-        struct list_node *child = linear_search(retnode->children, *prefix);
+static void trie_node_add_child(struct trie_node *node,
+                                struct trie_node *child) {
+    struct trie_children *c = node->children;
+    uint32_t size = c ? c->size : 0;
+    if (size > TRIE_NODE16 && (c->used + 1) * 4 <= size * 3) {
+        // Keep the load of tables, tombstones included, under 3/4
+        children_put(c, child);
+        return;
+    }
+    if (size == 0) {
+        size = TRIE_NODE4;
+    } else if (size <= TRIE_NODE16) {
+        // Small nodes grow 4 -> 16 -> first table size when full
+        if (c->nr == size)
+            size = size * 4 > TRIE_NODE16 ? TRIE_NODE16 * 2 : size * 4;
+    } else if ((c->nr + 1) * 2 > size) {
+        // A table full of tombstones is rebuilt, doubled if half live
+        size *= 2;
+    }
+    struct trie_children *new = children_copy(c, size, NULL);
+    children_put(new, child);
+    trie_node_set_children(node, new);
+}
 
-        // No key with the full prefix in the trie
-        if (!child)
-            return NULL;
-        retnode = child->data;
+static void trie_node_del_child(struct trie_node *node,
+                                struct trie_node *child) {
+    struct trie_children *c = node->children;
+    uint32_t size = c->size;
+    if (c->nr == 1) {
+        trie_node_set_children(node, NULL);
+        return;
     }
-    return retnode;
+    if (size > TRIE_NODE16 && (c->nr - 1) * 4 > size) {
+        PUBLISH(c->nodes[children_slot(c, child)], TOMBSTONE);
+        c->nr--;
+        return;
+    }
+    // Shrink back to a smaller node when mostly empty
+    if (size == TRIE_NODE16 && c->nr - 1 <= TRIE_NODE4 / 2)
+        size = TRIE_NODE4;
+    else if (size > TRIE_NODE16)
+        size /= 2;
+    trie_node_set_children(node, children_copy(c, size, child));
 }
 
-// Returns new trie node (initialized to NULL)
-struct trie_node *trie_create_node(char c) {
-    struct trie_node *new_node = malloc(sizeof(*new_node));
+/* Swap a child for a node starting with the same level, so the same slot */
+static void trie_node_replace_child(struct trie_node *node,
+                                    struct trie_node *child,
+                                    struct trie_node *other) {
+    struct trie_children *c = node->children;
+    PUBLISH(c->nodes[children_slot(c, child)], other);
+}
+
+// Returns new trie node (initialized to NULL) with room for its label
+static struct trie_node *trie_create_node(uint32_t levels_nr) {
+    struct trie_node *new_node =
+        malloc(sizeof(*new_node) + levels_nr * sizeof(*new_node->levels));
     if (new_node) {
-        new_node->chr = c;
+        new_node->children = NULL;
         new_node->data = NULL;
-        new_node->children = list_create(NULL);
+        new_node->levels_nr = levels_nr;
+        nodes_nr++;
     }
     return new_node;
 }
 
+/* Create a node labelled with all the levels left in a key */
+static struct trie_node *trie_create_leaf(const char *key) {
+    const char *level, *p = key;
+    uint32_t n = 0;
+    size_t len;
+    for (; *p; n++)
+        next_level(&p, &level);
+    struct trie_node *leaf = trie_create_node(n);
+    for (uint32_t i = 0; i < n; i++) {
+        len = next_level(&key, &level);
+        leaf->levels[i] = level_intern(level, len, level_hash(level, len));
+    }
+    return leaf;
+}
+
+/* Release a single node and its references to the levels */
+static void trie_node_release(void *ptr) {
+    struct trie_node *node = ptr;
+    for (uint32_t i = 0; i < node->levels_nr; i++)
+        level_release(node->levels[i]);
+    free(node);
+}
+
+/* Release a whole subtree, its keys already accounted out of the trie */
+static void trie_subtree_release(void *ptr) {
+    size_t size = 0;
+    trie_node_free(ptr, &size);
+}
+
+/* Release a set of children and their subtrees */
+static void children_release(void *ptr) {
+    struct trie_node *child;
+    for (uint32_t i = 0; (child = children_next(ptr, &i)); )
+        trie_subtree_release(child);
+    free(ptr);
+}
+
+/* Count the keys stored in a subtree, adding up its nodes as well */
+static size_t trie_node_count(const struct trie_node *node, size_t *nodes) {
+    struct trie_node *child;
+    size_t count = node->data ? 1 : 0;
+    (*nodes)++;
+    for (uint32_t i = 0; (child = children_next(node->children, &i)); )
+        count += trie_node_count(child, nodes);
+    return count;
+}
+
+/*
+ * Split the label of a node after `pos` levels, the first part goes to a new
+ * node taking its place under the parent, with a copy of the old node,
+ * keeping the rest of the label, its children and data, as its only child.
+ * Return the new node.
+ */
+static struct trie_node *trie_node_split(struct trie_node *parent,
+                                         struct trie_node *node,
+                                         uint32_t pos) {
+    struct trie_node *head = trie_create_node(pos);
+    struct trie_node *tail = trie_create_node(node->levels_nr - pos);
+    memcpy(head->levels, node->levels, pos * sizeof(*node->levels));
+    memcpy(tail->levels, node->levels + pos,
+           tail->levels_nr * sizeof(*node->levels));
+    tail->children = node->children;
+    tail->data = node->data;
+    trie_node_add_child(head, tail);
+    trie_node_replace_child(parent, node, head);
+    // The levels and the children now belong to the new nodes
+    ebr_retire(node, free);
+    nodes_nr--;
+    return head;
+}
+
+/*
+ * Merge a node without data with its only child, the opposite of a split, a
+ * new node carries the whole label, with the children and data of the child,
+ * and takes the place of the node
+ */
+static void trie_node_merge(struct trie_node *parent, struct trie_node *node) {
+    uint32_t i = 0;
+    struct trie_node *child = children_next(node->children, &i);
+    struct trie_node *merged =
+        trie_create_node(node->levels_nr + child->levels_nr);
+    memcpy(merged->levels, node->levels,
+           node->levels_nr * sizeof(*node->levels));
+    memcpy(merged->levels + node->levels_nr, child->levels,
+           child->levels_nr * sizeof(*child->levels));
+    merged->children = child->children;
+    merged->data = child->data;
+    trie_node_replace_child(parent, node, merged);
+    ebr_retire(node->children, free);
+    ebr_retire(node, free);
+    ebr_retire(child, free);
+    nodes_nr -= 2;
+}
+
+/*
+ * Restore the shape of the tree after a node lost its data or its subtree,
+ * nodes left without data and children are removed, nodes left without data
+ * and with a single child are merged with it. The root is never touched.
+ */
+static void trie_node_prune(struct trie_node *grandparent,
+                            struct trie_node *parent,
+                            struct trie_node *node) {
+    if (!parent || node->data)
+        return;
+    if (!node->children) {
+        trie_node_del_child(parent, node);
+        ebr_retire(node, trie_node_release);
+        nodes_nr--;
+        node = parent;
+        parent = grandparent;
+        if (!parent || node->data)
+            return;
+    }
+    if (trie_node_children_nr(node) == 1)
+        trie_node_merge(parent, node);
+}
+
+/*
+ * Position reached walking a key down the tree, the node, how many levels of
+ * its label were matched and the two nodes above it. On a mismatch `key`
+ * points to the remaining levels, starting with the one not matched.
+ */
+struct trie_cursor {
+    struct trie_node *grandparent;
+    struct trie_node *parent;
+    struct trie_node *node;
+    uint32_t pos;
+    const char *key;
+};
+
+/*
+ * Walk a key level by level, comparing against the label of the current node
+ * till exhausted and then looking up the child starting with the next level.
+ * Return true if all the levels of the key have been matched.
+ */
+static bool trie_walk(const struct trie_node *root, const char *key,
+                      struct trie_cursor *c) {
+    const char *level, *rest;
+    size_t len;
+    uint32_t hash;
+    struct trie_node *child;
+    c->grandparent = c->parent = NULL;
+    c->node = (struct trie_node *) root;
+    c->pos = 0;
+    c->key = key;
+    while (*c->key) {
+        rest = c->key;
+        len = next_level(&rest, &level);
+        hash = level_hash(level, len);
+        if (c->pos < c->node->levels_nr) {
+            if (!level_eq(c->node->levels[c->pos], hash, level, len))
+                return false;
+            c->pos++;
+        } else {
+            child = trie_node_child(c->node, level, len, hash);
+            if (!child)
+                return false;
+            c->grandparent = c->parent;
+            c->parent = c->node;
+            c->node = child;
+            c->pos = 1;
+        }
+        c->key = rest;
+    }
+    return true;
+}
+
 // Returns new Trie, with a NULL root and 0 size
 Trie *trie_create(void) {
     Trie *trie = malloc(sizeof(*trie));
@@ -99,7 +567,7 @@ Trie *trie_create(void) {
 }
 
 void trie_init(Trie *trie) {
-    trie->root = trie_create_node(' ');
+    trie->root = trie_create_node(0);
     trie->size = 0;
 }
 
@@ -107,48 +575,33 @@ size_t trie_size(const Trie *trie) {
     return trie->size;
 }
 
+size_t trie_nodes(void) {
+    return nodes_nr;
+}
+
 /*
  * If not present, inserts key into trie, if the key is prefix of trie node,
  * just marks leaf node by assigning the new data pointer. Returns a pointer
  * to the new inserted data.
  *
  * Being a Trie, it should guarantees O(m) performance for insertion on the
- * worst case, where `m` is the length of the key.
+ * worst case, where `m` is the number of levels of the key.
  */
 static void *trie_node_insert(struct trie_node *root, const char *key,
                               const void *data, size_t *size) {
-    struct trie_node *cursor = root;
-    struct trie_node *cur_node = NULL;
-    struct list_node *tmp = NULL;
-
-    // Iterate through the key char by char
-    for (; *key; key++) {
-        /*
-         * We can use a linear search as on a linked list O(n) is the best find
-         * algorithm we can use, as binary search would have the same if not
-         * worse performance by not having direct access to node like in an
-         * array.
-         *
-         * Anyway we expect to have an average O(n/2) -> O(n) cause at every
-         * insertion the list is sorted so we expect to find our char in the
-         * middle on average.
-         *
-         * As a future improvement it's advisable to substitute list with a
-         * B-tree or RBTree to improve searching complexity to O(logn) at best,
-         * avg and worst while maintaining O(n) space complexity, but it really
-         * depends also on the size of the alphabet.
-         */
-        tmp = linear_search(cursor->children, *key);
-        // No match, we add a new node and sort the list with the new added link
-        if (!tmp) {
-            cur_node = trie_create_node(*key);
-            cursor->children = list_push(cursor->children, cur_node);
-            cursor->children->head = merge_sort_tnode(cursor->children->head);
-        } else {
-            // Match found, no need to sort the list, the child already exists
-            cur_node = tmp->data;
-        }
-        cursor = cur_node;
+    struct trie_cursor c;
+    bool found = trie_walk(root, key, &c);
+    struct trie_node *node = c.node;
+
+    // The key ends or diverges in the middle of a label
+    if (c.pos < node->levels_nr)
+        node = trie_node_split(c.parent, node, c.pos);
+
+    // The levels left all go in the label of a single new node
+    if (!found) {
+        struct trie_node *leaf = trie_create_leaf(c.key);
+        trie_node_add_child(node, leaf);
+        node = leaf;
     }
 
     /*
@@ -156,75 +609,10 @@ static void *trie_node_insert(struct trie_node *root, const char *key,
      * change the trie size, otherwise 1 means that we added a new node,
      * effectively changing the size
      */
-    if (!cursor->data)
+    if (!node->data)
         (*size)++;
-    cursor->data = (void *) data;
-    return cursor->data;
-}
-
-/*
- * Private function, iterate recursively through the trie structure starting
- * from a given node, deleting the target value
- */
-static bool trie_node_recursive_delete(struct trie_node *node, const char *key,
-                                       size_t *size, bool *found) {
-    if (!node)
-        return false;
-
-    // Base case
-    if (*key == '\0') {
-        if (node->data) {
-            // Update found flag
-            *found = true;
-
-            // Free resources, covering the case of a sub-prefix
-            if (node->data) {
-                free(node->data);
-                node->data = NULL;
-            }
-            free(node->data);
-            node->data = NULL;
-            if (*size > 0)
-                (*size)--;
-
-            // If empty, node to be deleted
-            return trie_is_free_node(node);
-        }
-    } else {
-
-        // O(n), the best we can have
-        struct list_node *cur = linear_search(node->children, *key);
-        if (!cur)
-            return false;
-        struct trie_node *child = cur->data;
-        if (trie_node_recursive_delete(child, key + 1, size, found)) {
-            // Messy solution, requiring probably avoidable allocations
-            struct trie_node t = {*key, NULL, NULL};
-            struct list_node tmp = {&t, NULL};
-            list_remove(node->children, &tmp, with_char);
-
-            // last node marked, delete it
-            trie_node_free(child, size);
-
-            // recursively climb up, and delete eligible nodes
-            return (!node->data && trie_is_free_node(node));
-        }
-    }
-    return false;
-}
-
-/*
- * Returns true if key is present in trie, else false. Also for lookup the
- * big-O runtime is guaranteed O(m) with `m` as length of the key.
- */
-static bool trie_node_search(const struct trie_node *root,
-                             const char *key, void **ret) {
-    // Walk the trie till the end of the key
-    struct trie_node *cursor = trie_node_find(root, key);
-    *ret = (cursor && cursor->data) ? cursor->data : NULL;
-
-    // Return false if no complete key found, true otherwise
-    return !*ret ? false : true;
+    PUBLISH(node->data, (void *) data);
+    return node->data;
 }
 
 /*
@@ -239,63 +627,82 @@ void *trie_insert(Trie *trie, const char *key, const void *data) {
 
 bool trie_delete(Trie *trie, const char *key) {
     assert(trie && key);
-    bool found = false;
-    if (strlen(key) > 0)
-        trie_node_recursive_delete(trie->root, key, &(trie->size), &found);
-    return found;
+    struct trie_cursor c;
+    if (strlen(key) == 0 || !trie_walk(trie->root, key, &c)
+        || c.pos < c.node->levels_nr || !c.node->data)
+        return false;
+    void *data = c.node->data;
+    PUBLISH(c.node->data, NULL);
+    ebr_retire(data, free);
+    if (trie->size > 0)
+        trie->size--;
+    trie_node_prune(c.grandparent, c.parent, c.node);
+    return true;
 }
 
+/*
+ * Returns true if key is present in trie, else false. Also for lookup the
+ * big-O runtime is guaranteed O(m) with `m` as number of levels of the key.
+ */
 bool trie_find(const Trie *trie, const char *key, void **ret) {
     assert(trie && key);
-    return trie_node_search(trie->root, key, ret);
+    struct trie_cursor c;
+    if (trie_walk(trie->root, key, &c) && c.pos == c.node->levels_nr)
+        *ret = LOAD(c.node->data);
+    else
+        *ret = NULL;
+
+    // Return false if no complete key found, true otherwise
+    return !*ret ? false : true;
 }
 
 /*
  * Remove and delete all keys matching a given prefix in the trie
- * e.g. hello*
- * - hello
- * hellot
- * helloworld
- * hello
+ * e.g. sensors/#
+ * - sensors
+ * - sensors/temperature
+ * - sensors/temperature/kitchen
  */
 void trie_prefix_delete(Trie *trie, const char *prefix) {
     assert(trie && prefix);
-    // Walk the trie till the end of the key
-    struct trie_node *cursor = trie_node_find(trie->root, prefix);
+    struct trie_cursor c;
 
     // No complete key found
-    if (!cursor)
+    if (!trie_walk(trie->root, prefix, &c))
         return;
 
-    // Simply remove the key if it has no children, no need to clear the list
-    if (cursor->children->len == 0) {
-        trie_delete(trie, prefix);
-        return;
-    }
-    struct list_node *cur = cursor->children->head;
-    // Clear out all possible sub-paths
-    for (; cur; cur = cur->next) {
-        trie_node_free(cur->data, &(trie->size));
-        cur->data = NULL;
+    /*
+     * The whole subtree goes, it may end in the middle of a label, unlinked
+     * at once and released when no reader can be walking it anymore
+     */
+    size_t nodes = 0;
+    size_t count = trie_node_count(c.node, &nodes);
+    if (!c.parent) {
+        struct trie_children *children = c.node->children;
+        count -= c.node->data ? 1 : 0;
+        nodes--;
+        PUBLISH(c.node->children, NULL);
+        if (children)
+            ebr_retire(children, children_release);
+    } else {
+        trie_node_del_child(c.parent, c.node);
+        ebr_retire(c.node, trie_subtree_release);
+        if (c.grandparent && !c.parent->data &&
+            trie_node_children_nr(c.parent) == 1)
+            trie_node_merge(c.grandparent, c.parent);
     }
-
-    // Set the current node (the one storing the last character of the prefix)
-    // as a leaf and delete the prefix key as well
-    trie_delete(trie, prefix);
-    list_clear(cursor->children, 1);
+    trie->size = trie->size > count ? trie->size - count : 0;
+    nodes_nr -= nodes;
 }
 
 /* Iterate through children of each node starting from a given node, applying
    a defined function which take a struct trie_node as argument */
 static void trie_prefix_map_func2(struct trie_node *node,
                                   void (*mapfunc)(struct trie_node *, void *), void *arg) {
-    if (trie_is_free_node(node)) {
-        mapfunc(node, arg);
-        return;
-    }
-    struct list_node *child = node->children->head;
-    for (; child; child = child->next)
-        trie_prefix_map_func2(child->data, mapfunc, arg);
+    const struct trie_children *c = LOAD(node->children);
+    struct trie_node *child;
+    for (uint32_t i = 0; (child = children_next(c, &i)); )
+        trie_prefix_map_func2(child, mapfunc, arg);
     mapfunc(node, arg);
 }
 
@@ -307,21 +714,111 @@ static void trie_prefix_map_func2(struct trie_node *node,
 void trie_prefix_map_tuple(Trie *trie, const char *prefix,
                            void (*mapfunc)(struct trie_node *, void *), void *arg) {
     assert(trie);
+    struct trie_cursor c;
     if (!prefix) {
         trie_prefix_map_func2(trie->root, mapfunc, arg);
     } else {
-        // Walk the trie till the end of the key
-        struct trie_node *node = trie_node_find(trie->root, prefix);
-
-        // No complete key found
-        if (!node)
+        // Walk the trie till the end of the key, no complete key found
+        if (!trie_walk(trie->root, prefix, &c))
             return;
 
         // Check all possible sub-paths and add to count where there is a leaf
+        trie_prefix_map_func2(c.node, mapfunc, arg);
+    }
+}
+
+/*
+ * Match the levels of a filter starting from `pos` levels into the label of
+ * a node, literal levels follow a single path while "+" fans out on all the
+ * children once the label is exhausted
+ */
+static void trie_node_match(struct trie_node *node, uint32_t pos,
+                            const char *filter,
+                            void (*mapfunc)(struct trie_node *, void *),
+                            void *arg) {
+    if (!*filter) {
+        if (pos == node->levels_nr)
+            mapfunc(node, arg);
+        return;
+    }
+    const char *level;
+    size_t len = next_level(&filter, &level);
+    if (len == 1 && *level == '#') {
         trie_prefix_map_func2(node, mapfunc, arg);
+    } else if (pos < node->levels_nr) {
+        if ((len == 1 && *level == '+') ||
+            level_eq(node->levels[pos], level_hash(level, len), level, len))
+            trie_node_match(node, pos + 1, filter, mapfunc, arg);
+    } else if (len == 1 && *level == '+') {
+        const struct trie_children *c = LOAD(node->children);
+        struct trie_node *child;
+        for (uint32_t i = 0; (child = children_next(c, &i)); )
+            trie_node_match(child, 1, filter, mapfunc, arg);
+    } else {
+        struct trie_node *child =
+            trie_node_child(node, level, len, level_hash(level, len));
+        if (child)
+            trie_node_match(child, 1, filter, mapfunc, arg);
     }
 }
 
+void trie_match(Trie *trie, const char *filter,
+                void (*mapfunc)(struct trie_node *, void *), void *arg) {
+    assert(trie && filter);
+    trie_node_match(trie->root, 0, filter, mapfunc, arg);
+}
+
+/*
+ * The reverse of a match, the keys of the tree are filters and the levels of
+ * a topic name, starting from `pos` levels into the label of a node, are
+ * followed down the literal child, the "+" child and, matching whatever is
+ * left of the name, a "#" one
+ */
+static void trie_node_match_topic(struct trie_node *node, uint32_t pos,
+                                  const char *topic,
+                                  void (*mapfunc)(struct trie_node *, void *),
+                                  void *arg) {
+    const char *level;
+    size_t len;
+    if (pos < node->levels_nr) {
+        const struct trie_level *l = node->levels[pos];
+        if (l->len == 1 && l->str[0] == '#') {
+            if (pos + 1 == node->levels_nr)
+                mapfunc(node, arg);
+            return;
+        }
+        if (!*topic)
+            return;
+        len = next_level(&topic, &level);
+        if ((l->len == 1 && l->str[0] == '+') ||
+            level_eq(l, level_hash(level, len), level, len))
+            trie_node_match_topic(node, pos + 1, topic, mapfunc, arg);
+        return;
+    }
+    if (!*topic)
+        mapfunc(node, arg);
+    struct trie_node *multi = trie_node_child(node, "#", 1, level_hash("#", 1));
+    if (multi && multi->levels_nr == 1)
+        mapfunc(multi, arg);
+    if (!*topic)
+        return;
+    len = next_level(&topic, &level);
+    struct trie_node *single =
+        trie_node_child(node, "+", 1, level_hash("+", 1));
+    struct trie_node *child =
+        trie_node_child(node, level, len, level_hash(level, len));
+    if (single)
+        trie_node_match_topic(single, 1, topic, mapfunc, arg);
+    if (child && child != single)
+        trie_node_match_topic(child, 1, topic, mapfunc, arg);
+}
+
+void trie_match_topic(Trie *trie, const char *topic,
+                      void (*mapfunc)(struct trie_node *, void *), void *arg) {
+    assert(trie && topic);
+    trie_node_match_topic(trie->root, 0, topic, mapfunc, arg);
+}
+
 /* Release memory of a node while updating size of the trie */
 void trie_node_free(struct trie_node *node, size_t *size) {
 
@@ -330,32 +827,30 @@ void trie_node_free(struct trie_node *node, size_t *size) {
         return;
 
     // Recursive call to all children of the node
-    if (node->children) {
-        struct list_node *cur = node->children->head;
-        for (; cur; cur = cur->next)
-            trie_node_free(cur->data, size);
-        list_release(node->children, 0);
-        node->children = NULL;
-    }
+    struct trie_node *child;
+    for (uint32_t i = 0; (child = children_next(node->children, &i)); )
+        trie_node_free(child, size);
+    free(node->children);
 
     // Release memory on data stored on the node
     if (node->data) {
         free(node->data);
         if (*size > 0)
             (*size)--;
-    } else if (node->data) {
-        free(node->data);
-        if (*size > 0)
-            (*size)--;
     }
 
-    // Release the node itself
+    // Release the node itself and its references to the levels
+    for (uint32_t i = 0; i < node->levels_nr; i++)
+        level_release(node->levels[i]);
     free(node);
 }
 
 void trie_release(Trie *trie) {
     if (!trie)
         return;
+    size_t nodes = 0;
+    trie_node_count(trie->root, &nodes);
+    nodes_nr -= nodes;
     trie_node_free(trie->root, &(trie->size));
     free(trie);
 }
@@ -2,34 +2,57 @@
 #define TRIE_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
-#include "list.h"
 
 typedef struct trie Trie;
 
 /*
- * Trie node, it contains a fixed size array (every node can have at max the
- * alphabet length size of children), a flag defining if the node represent
- * the end of a word and then if it contains a value defined by data.
+ * Interned topic level, the string between two '/' separators. Each distinct
+ * level is stored once and shared by all the nodes labelled with it, e.g.
+ * "temperature" under a million device ids costs a single allocation.
+ */
+struct trie_level {
+    uint32_t hash;
+    unsigned refs;
+    size_t len;
+    char str[];
+};
+
+/*
+ * Trie node of a path-compressed (radix) tree of topic levels. Each node is
+ * labelled with the run of levels leading to it from its parent, stored
+ * inline, so chains of levels with a single child, like the tail of a
+ * device topic, take one node instead of one per level. Edges are split on
+ * insertion when a key diverges in the middle of a label and merged back on
+ * deletion. Children are keyed by the first level of their label, in an
+ * adaptive set growing from 4 to 16 slots and then to a hash table. A node
+ * with data represents the end of a topic.
  */
 struct trie_node {
-    char chr;
-    List *children;
+    struct trie_children *children;
     void *data;
+    uint32_t levels_nr;
+    const struct trie_level *levels[];
 };
 
 /*
  * Trie ADT, it is formed by a root struct trie_node, and the total size of the
- * Trie
+ * Trie.
+ *
+ * Lookups (`trie_find`, `trie_match`, `trie_prefix_map_tuple`) take no locks
+ * and can run on other threads while the tree is being modified, inside an
+ * epoch read-side section (see ebr.h). Modifications never free memory in
+ * place, replaced nodes, children sets and deleted data are retired and
+ * released by `ebr_collect`. There's one writer at a time, modifications of
+ * all tries and `ebr_collect` must be serialised by the caller, levels being
+ * interned in a table shared by all of them.
  */
 struct trie {
     struct trie_node *root;
     size_t size;
 };
 
-// Returns new trie node (initialized to NULLs)
-struct trie_node *trie_create_node(char);
-
 // Returns a new Trie, which is formed by a root node and a size
 struct trie *trie_create(void);
 
@@ -38,20 +61,24 @@ void trie_init(Trie *);
 // Return the size of the trie
 size_t trie_size(const Trie *);
 
+// Return the number of nodes linked in all the tries
+size_t trie_nodes(void);
+
 /*
- * The leaf represents the node with the associated data
- *           .
- *          / \
- *         h   s: s -> value
- *        / \
- *       e   k: hk -> value
- *      /
- *     l: hel -> value
+ * Keys are split in levels on '/', a trailing '/' just terminates the last
+ * level, so "a/b/" and "a/b" map to the same key
+ *             .
+ *           /   \
+ *          a     sensors/kitchen -> value
+ *        /   \
+ *      b/d    c -> value
+ *       |
+ *     value
  *
- * Here we got 3 <key:value> pairs:
- * - s   -> value
- * - hk  -> value
- * - hel -> value
+ * Here we got 3 <key:value> pairs, the inner node "a" holds no value:
+ * - sensors/kitchen -> value
+ * - a/c             -> value
+ * - a/b/d           -> value
  */
 void *trie_insert(Trie *, const char *, const void *);
 
@@ -78,4 +105,20 @@ void trie_prefix_delete(Trie *, const char *);
 void trie_prefix_map_tuple(Trie *, const char *,
                            void (*mapfunc)(struct trie_node *, void *), void *);
 
+/*
+ * Apply a given function to all nodes matching a topic filter, where a "+"
+ * level matches any single level and a trailing "#" matches the parent level
+ * and everything below it. Literal levels cost a single lookup each.
+ */
+void trie_match(Trie *, const char *,
+                void (*mapfunc)(struct trie_node *, void *), void *);
+
+/*
+ * Apply a given function to all nodes of a trie of topic filters matching a
+ * topic name, visiting only the literal, "+" and "#" children of the nodes on
+ * its path instead of testing every filter stored.
+ */
+void trie_match_topic(Trie *, const char *,
+                      void (*mapfunc)(struct trie_node *, void *), void *);
+
 #endif
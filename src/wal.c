@@ -0,0 +1,510 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "hash.h"
+#include "pack.h"
+#include "wal.h"
+
+/* Record header: crc32c, length, sequence number and number of deliveries */
+#define WAL_HEADER_LEN (sizeof(uint32_t) * 3 + sizeof(uint64_t))
+
+/* Max number of settled segments kept aside to be recycled */
+#define WAL_MAX_FREE 4
+
+struct wal_segment {
+    long id;
+    int fd;
+    size_t refs;
+    /* Sequence number of the first record, ids of deliveries follow it */
+    uint64_t first;
+};
+
+/*
+ * WAL state, live segments have contiguous ids starting from the one of the
+ * first in the array, the last one being the segment records are appended
+ * to. Settled segments are moved to the free list with a temporary name and
+ * reused on the next roll.
+ *
+ * Deliveries settled since the last commit are buffered in `settled` and
+ * logged as a single settlement record on the next commit, while on startup
+ * `replay_settled` holds, sorted, all the settled deliveries found in the log.
+ */
+static struct {
+    bool enabled;
+    char path[0xFF];
+    size_t segment_size;
+    uint64_t seq;
+    struct wal_segment *segments;
+    size_t nr;
+    size_t cap;
+    off_t offset;
+    unsigned char *buf;
+    size_t buflen;
+    size_t bufcap;
+    size_t uncommitted;
+    uint64_t *settled;
+    size_t settled_nr;
+    size_t settled_cap;
+    uint64_t *replay_settled;
+    size_t replay_settled_nr;
+    int free_fds[WAL_MAX_FREE];
+    int free_nr;
+    int free_seq;
+} wal;
+
+static void segment_path(char *path, long id) {
+    snprintf(path, PATH_MAX, "%s/sol-%010ld.wal", wal.path, id);
+}
+
+/*
+ * Find the segment storing the record of a delivery, the last one starting
+ * before it, empty segments share the first sequence number of the next one
+ */
+static struct wal_segment *segment_get(long id) {
+    if (id < 0 || wal.nr == 0 || (uint64_t) id < wal.segments[0].first)
+        return NULL;
+    size_t lo = 0, hi = wal.nr;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (wal.segments[mid].first <= (uint64_t) id)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &wal.segments[lo];
+}
+
+static struct wal_segment *segment_push(long id, int fd) {
+    if (wal.nr == wal.cap) {
+        wal.cap = wal.cap ? wal.cap * 2 : 4;
+        wal.segments = realloc(wal.segments, wal.cap * sizeof(*wal.segments));
+    }
+    struct wal_segment *seg = &wal.segments[wal.nr++];
+    seg->id = id;
+    seg->fd = fd;
+    seg->refs = 0;
+    seg->first = wal.seq;
+    return seg;
+}
+
+/*
+ * Open a new segment file, reusing a recycled one if available. Stale records
+ * left in a recycled file are never replayed, as their sequence numbers are
+ * lower than the ones of the new records.
+ */
+static int segment_open(long id) {
+    char path[PATH_MAX];
+    segment_path(path, id);
+    if (wal.free_nr > 0) {
+        int fd = wal.free_fds[--wal.free_nr];
+        char free_path[PATH_MAX];
+        snprintf(free_path, sizeof(free_path), "%s/sol-free-%d.wal",
+                 wal.path, fd);
+        if (rename(free_path, path) == 0)
+            return fd;
+        close(fd);
+    }
+    return open(path, O_RDWR | O_CREAT, 0600);
+}
+
+/* Move the oldest settled segments aside, keeping at most WAL_MAX_FREE */
+static void segments_recycle(void) {
+    char path[PATH_MAX];
+    size_t n = 0;
+    // The last segment is the active one, never recycled
+    while (n < wal.nr - 1 && wal.segments[n].refs == 0) {
+        struct wal_segment *seg = &wal.segments[n++];
+        segment_path(path, seg->id);
+        if (wal.free_nr < WAL_MAX_FREE) {
+            char free_path[PATH_MAX];
+            snprintf(free_path, sizeof(free_path), "%s/sol-free-%d.wal",
+                     wal.path, seg->fd);
+            if (rename(path, free_path) == 0) {
+                wal.free_fds[wal.free_nr++] = seg->fd;
+                continue;
+            }
+        }
+        unlink(path);
+        close(seg->fd);
+    }
+    if (n > 0) {
+        memmove(wal.segments, wal.segments + n,
+                (wal.nr - n) * sizeof(*wal.segments));
+        wal.nr -= n;
+    }
+}
+
+/*
+ * Write out buffered records on the active segment, syncing it to disk only
+ * if asked to, settlement records alone can be lost in a crash, at worst the
+ * deliveries they settle are replayed again
+ */
+static int segment_flush(bool sync) {
+    struct wal_segment *seg = &wal.segments[wal.nr - 1];
+    size_t written = 0;
+    ssize_t n;
+    while (written < wal.buflen) {
+        n = pwrite(seg->fd, wal.buf + written,
+                   wal.buflen - written, wal.offset + written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
+    }
+    if (sync && fdatasync(seg->fd) < 0)
+        return -1;
+    wal.offset += wal.buflen;
+    wal.buflen = 0;
+    return 0;
+}
+
+/*
+ * Roll over a new segment if a record doesn't fit in the active one, syncing
+ * the full one first
+ */
+static int segment_roll(size_t len) {
+    size_t reclen = WAL_HEADER_LEN + len;
+    if (wal.offset + wal.buflen == 0 ||
+        wal.offset + wal.buflen + reclen <= wal.segment_size)
+        return 0;
+    if (segment_flush(true) < 0)
+        return -1;
+    long id = wal.segments[wal.nr - 1].id + 1;
+    int fd = segment_open(id);
+    if (fd < 0)
+        return -1;
+    segment_push(id, fd);
+    wal.offset = 0;
+    segments_recycle();
+    return 0;
+}
+
+/*
+ * Buffer a record, packing its header, a settlement record has no deliveries
+ * and carries the ids of the deliveries it settles
+ */
+static void record_append(const unsigned char *data, size_t len, uint32_t nr) {
+    size_t reclen = WAL_HEADER_LEN + len;
+    if (wal.buflen + reclen > wal.bufcap) {
+        wal.bufcap = (wal.buflen + reclen) * 2;
+        wal.buf = realloc(wal.buf, wal.bufcap);
+    }
+    unsigned char *record = wal.buf + wal.buflen;
+    unsigned char *ptr = record + sizeof(uint32_t);
+    pack_u32(&ptr, len);
+    pack_u32(&ptr, wal.seq >> 32);
+    pack_u32(&ptr, wal.seq & 0xFFFFFFFF);
+    pack_u32(&ptr, nr);
+    memcpy(ptr, data, len);
+    ptr = record;
+    pack_u32(&ptr, hash_crc32c(record + sizeof(uint32_t) * 2,
+                               len + sizeof(uint64_t) + sizeof(uint32_t), 0));
+    wal.buflen += reclen;
+    // Each delivery takes the sequence number following its record
+    wal.seq += 1 + nr;
+}
+
+/* Log the deliveries settled since the last call as a single record */
+static void settled_append(void) {
+    if (wal.settled_nr == 0)
+        return;
+    size_t len = wal.settled_nr * sizeof(uint64_t);
+    unsigned char *data = malloc(len), *ptr = data;
+    for (size_t i = 0; i < wal.settled_nr; i++) {
+        pack_u32(&ptr, wal.settled[i] >> 32);
+        pack_u32(&ptr, wal.settled[i] & 0xFFFFFFFF);
+    }
+    record_append(data, len, 0);
+    free(data);
+    wal.settled_nr = 0;
+}
+
+static void settled_push(uint64_t id) {
+    if (wal.settled_nr == wal.settled_cap) {
+        wal.settled_cap = wal.settled_cap ? wal.settled_cap * 2 : 64;
+        wal.settled = realloc(wal.settled,
+                              wal.settled_cap * sizeof(*wal.settled));
+    }
+    wal.settled[wal.settled_nr++] = id;
+}
+
+/* Called on each valid record read back, with its header fields */
+typedef void record_func(struct wal_segment *, unsigned char *,
+                         uint32_t, uint64_t, uint32_t, void *);
+
+/*
+ * Read the valid records of a segment, stopping at the first torn or
+ * corrupted one, or at the first belonging to a previous use of the file,
+ * i.e. with a sequence number lower than the expected one.
+ */
+static void segment_read(struct wal_segment *seg, uint64_t next,
+                         record_func *fn, void *arg) {
+    unsigned char header[WAL_HEADER_LEN];
+    unsigned char *record = NULL;
+    size_t cap = 0;
+    off_t offset = 0;
+    while (pread(seg->fd, header,
+                 WAL_HEADER_LEN, offset) == WAL_HEADER_LEN) {
+        const uint8_t *ptr = header;
+        uint32_t crc = unpack_u32(&ptr);
+        uint32_t len = unpack_u32(&ptr);
+        uint64_t seq = (uint64_t) unpack_u32(&ptr) << 32;
+        seq |= unpack_u32(&ptr);
+        uint32_t nr = unpack_u32(&ptr);
+        if (seq < next)
+            break;
+        size_t meta = sizeof(uint64_t) + sizeof(uint32_t);
+        if (len + meta > cap) {
+            cap = len + meta;
+            record = realloc(record, cap);
+        }
+        // The checksum covers the sequence number, the deliveries and the data
+        memcpy(record, header + sizeof(uint32_t) * 2, meta);
+        if (pread(seg->fd, record + meta, len,
+                  offset + WAL_HEADER_LEN) != (ssize_t) len)
+            break;
+        if (hash_crc32c(record, len + meta, 0) != crc)
+            break;
+        next = seq + 1 + nr;
+        fn(seg, record + meta, len, seq, nr, arg);
+        offset += WAL_HEADER_LEN + len;
+    }
+    free(record);
+}
+
+/* First pass, find out the sequence numbers and the settled deliveries */
+static void scan_record(struct wal_segment *seg, unsigned char *data,
+                        uint32_t len, uint64_t seq, uint32_t nr, void *arg) {
+    (void) arg;
+    if (seq + 1 + nr > wal.seq)
+        wal.seq = seq + 1 + nr;
+    if (seg->first == UINT64_MAX)
+        seg->first = seq;
+    if (nr > 0)
+        return;
+    const uint8_t *ptr = data;
+    for (uint32_t i = 0; i < len / sizeof(uint64_t); i++) {
+        uint64_t id = (uint64_t) unpack_u32(&ptr) << 32;
+        id |= unpack_u32(&ptr);
+        settled_push(id);
+    }
+}
+
+struct replay_ctx {
+    wal_replay_func *replay;
+    void *arg;
+};
+
+/* Second pass, hand the messages over, settlement records are done with */
+static void replay_record(struct wal_segment *seg, unsigned char *data,
+                          uint32_t len, uint64_t seq, uint32_t nr, void *arg) {
+    (void) seg;
+    struct replay_ctx *ctx = arg;
+    if (nr > 0)
+        ctx->replay(data, len, seq, ctx->arg);
+}
+
+static int compare_ids(const void *a, const void *b) {
+    long ida = *(const long *) a, idb = *(const long *) b;
+    return (ida > idb) - (ida < idb);
+}
+
+static int compare_seqs(const void *a, const void *b) {
+    uint64_t sa = *(const uint64_t *) a, sb = *(const uint64_t *) b;
+    return (sa > sb) - (sa < sb);
+}
+
+/*
+ * Collect the ids of the live segments sorted, removing leftover free ones,
+ * return -1 if the directory can't be read
+ */
+static int segments_scan(long **ids, size_t *nr) {
+    DIR *dir = opendir(wal.path);
+    if (!dir)
+        return -1;
+    struct dirent *entry;
+    long id;
+    size_t cap = 0;
+    char path[PATH_MAX];
+    *ids = NULL;
+    *nr = 0;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "sol-free-", 9) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", wal.path, entry->d_name);
+            unlink(path);
+        } else if (sscanf(entry->d_name, "sol-%ld.wal", &id) == 1) {
+            if (*nr == cap) {
+                cap = cap ? cap * 2 : 8;
+                *ids = realloc(*ids, cap * sizeof(long));
+            }
+            (*ids)[(*nr)++] = id;
+        }
+    }
+    closedir(dir);
+    if (*nr > 0)
+        qsort(*ids, *nr, sizeof(long), compare_ids);
+    return 0;
+}
+
+int wal_init(const char *path, size_t segment_size,
+             wal_replay_func *replay, void *arg) {
+    snprintf(wal.path, sizeof(wal.path), "%s", path);
+    wal.segment_size = segment_size;
+    wal.seq = 0;
+    size_t nr = 0;
+    long *ids = NULL;
+    if ((mkdir(path, 0700) < 0 && errno != EEXIST) ||
+        segments_scan(&ids, &nr) < 0) {
+        sol_error("Unable to open WAL directory %s: %s", path, strerror(errno));
+        return -1;
+    }
+    wal.enabled = true;
+    /*
+     * Segments are contiguous, a gap means that older segments were
+     * recycled while newer ones were still referenced, the records before it
+     * are all settled already.
+     */
+    for (size_t i = 0; i < nr; i++) {
+        char seg_path[PATH_MAX];
+        segment_path(seg_path, ids[i]);
+        int fd = open(seg_path, O_RDWR);
+        if (fd < 0)
+            continue;
+        if (wal.nr > 0 && ids[i] != wal.segments[wal.nr - 1].id + 1) {
+            for (size_t j = 0; j < wal.nr; j++)
+                wal.segments[j].refs = 0;
+            segments_recycle();
+            // The active segment is never recycled, it goes by hand
+            segment_path(seg_path, wal.segments[0].id);
+            unlink(seg_path);
+            close(wal.segments[0].fd);
+            wal.nr = 0;
+        }
+        segment_push(ids[i], fd);
+    }
+    long next_id = wal.nr > 0 ? wal.segments[wal.nr - 1].id + 1 : 0;
+    free(ids);
+    /*
+     * Replay in two passes, as the deliveries of a message are settled by
+     * records following it, once all of them are known, the messages are
+     * replayed and each delivery can be checked with `wal_settled`
+     */
+    for (size_t i = 0; i < wal.nr; i++) {
+        wal.segments[i].first = UINT64_MAX;
+        segment_read(&wal.segments[i], wal.seq, scan_record, NULL);
+        if (wal.segments[i].first == UINT64_MAX)
+            wal.segments[i].first = wal.seq;
+    }
+    if (wal.settled_nr > 0)
+        qsort(wal.settled, wal.settled_nr, sizeof(*wal.settled), compare_seqs);
+    // Deliveries settled while replaying are logged again, they go aside
+    wal.replay_settled = wal.settled;
+    wal.replay_settled_nr = wal.settled_nr;
+    wal.settled = NULL;
+    wal.settled_nr = wal.settled_cap = 0;
+    struct replay_ctx ctx = { replay, arg };
+    for (size_t i = 0; i < wal.nr; i++)
+        segment_read(&wal.segments[i], wal.segments[i].first,
+                     replay_record, &ctx);
+    free(wal.replay_settled);
+    wal.replay_settled = NULL;
+    wal.replay_settled_nr = 0;
+    // Always start appending on a fresh segment
+    int fd = segment_open(next_id);
+    if (fd < 0) {
+        sol_error("Unable to create WAL segment: %s", strerror(errno));
+        wal.enabled = false;
+        return -1;
+    }
+    segment_push(next_id, fd);
+    wal.offset = 0;
+    segments_recycle();
+    sol_info("WAL opened in %s, %lu segments live", path, wal.nr);
+    return 0;
+}
+
+void wal_close(void) {
+    if (!wal.enabled)
+        return;
+    wal_commit();
+    for (size_t i = 0; i < wal.nr; i++)
+        close(wal.segments[i].fd);
+    for (int i = 0; i < wal.free_nr; i++)
+        close(wal.free_fds[i]);
+    free(wal.segments);
+    free(wal.buf);
+    free(wal.settled);
+    wal.segments = NULL;
+    wal.nr = wal.cap = 0;
+    wal.settled = NULL;
+    wal.settled_nr = wal.settled_cap = 0;
+    wal.enabled = false;
+}
+
+bool wal_enabled(void) {
+    return wal.enabled;
+}
+
+long wal_append(const unsigned char *data, size_t len, size_t nr) {
+    if (!wal.enabled || nr == 0 || segment_roll(len) < 0)
+        return -1;
+    long seq = wal.seq;
+    record_append(data, len, nr);
+    wal.uncommitted++;
+    return seq;
+}
+
+int wal_commit(void) {
+    if (!wal.enabled)
+        return 0;
+    if (wal.settled_nr > 0 &&
+        segment_roll(wal.settled_nr * sizeof(uint64_t)) < 0) {
+        sol_error("Error committing WAL: %s", strerror(errno));
+        return -1;
+    }
+    settled_append();
+    if (wal.buflen == 0)
+        return 0;
+    if (segment_flush(wal.uncommitted > 0) < 0) {
+        sol_error("Error committing WAL: %s", strerror(errno));
+        return -1;
+    }
+    wal.uncommitted = 0;
+    return 0;
+}
+
+size_t wal_uncommitted(void) {
+    return wal.uncommitted;
+}
+
+void wal_ref(long id) {
+    struct wal_segment *seg = segment_get(id);
+    if (seg)
+        seg->refs++;
+}
+
+void wal_unref(long id) {
+    struct wal_segment *seg = segment_get(id);
+    if (!seg || seg->refs == 0)
+        return;
+    settled_push(id);
+    if (--seg->refs == 0 && seg == &wal.segments[0])
+        segments_recycle();
+}
+
+bool wal_settled(long id) {
+    if (wal.replay_settled_nr == 0)
+        return false;
+    return bsearch(&(uint64_t) { id }, wal.replay_settled,
+                   wal.replay_settled_nr, sizeof(uint64_t),
+                   compare_seqs) != NULL;
+}
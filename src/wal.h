@@ -0,0 +1,72 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Write-ahead log of QoS > 0 messages, an append-only sequence of segment
+ * files storing checksummed records, each one being a message along with the
+ * number of its deliveries.
+ *
+ * Records are buffered in memory by `wal_append` and made durable in groups
+ * by `wal_commit`, with a single write and fdatasync for all the records
+ * appended since the previous commit.
+ *
+ * Records have increasing sequence numbers, the deliveries of a message take
+ * the ones following its record, so that each delivery has its own id. Every
+ * delivery holds a reference on the segment storing the message, released
+ * once it's settled, i.e. acknowledged or discarded. Released deliveries are
+ * logged too, in settlement records written on commit, and skipped on
+ * replay. Once all the references of the oldest segments are released, those
+ * segments are recycled for new records instead of creating new files.
+ *
+ * There's a single WAL instance per process, all functions are no-op till
+ * `wal_init` is called, so that callers don't need to care if it's enabled.
+ */
+
+/*
+ * Callback called for each valid message on startup, with its sequence number,
+ * the message may be modified in place, it is discarded after the call
+ */
+typedef void wal_replay_func(unsigned char *, size_t, long, void *);
+
+/*
+ * Open the WAL in a directory, replaying all the records still stored in
+ * live segments through the callback, return -1 on error
+ */
+int wal_init(const char *, size_t, wal_replay_func *, void *);
+void wal_close(void);
+bool wal_enabled(void);
+
+/*
+ * Append a message with a number of deliveries, at least one, it will be
+ * durable only after the next `wal_commit`, return its sequence number or -1
+ * on error, the id of the n-th delivery being the sequence number plus n
+ */
+long wal_append(const unsigned char *, size_t, size_t);
+
+/*
+ * Write and sync all appended messages, along with the deliveries settled so
+ * far, return -1 on error
+ */
+int wal_commit(void);
+
+/* Number of appended messages waiting for a commit */
+size_t wal_uncommitted(void);
+
+/*
+ * Acquire and release a reference on the segment storing the message of a
+ * delivery, by its id, -1 is ignored. A release settles the delivery.
+ */
+void wal_ref(long);
+void wal_unref(long);
+
+/*
+ * Tell if a delivery was settled before a restart, only meaningful while
+ * replaying, from the callback passed to `wal_init`
+ */
+bool wal_settled(long);
+
+#endif
@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "ebr.h"
+#include "trie.h"
+
+/*
+ * Stress test of the lock-free readers of the trie, threads looking up and
+ * matching keys inside read-side sections while a writer inserts, deletes
+ * and deletes whole prefixes, reclaiming the memory unlinked every few
+ * operations. Readers check each value they reach against the key they got
+ * it from, a value released under a reader shows up as a mismatch, or as a
+ * use after free in a build with the address sanitizer.
+ */
+
+#define READERS     8
+#define GROUPS      64
+#define KEYS        (GROUPS * 64)
+#define WRITES      400000
+#define MAGIC       0x736f6c7472696521ULL
+
+struct value {
+    uint64_t magic;
+    unsigned key;
+};
+
+static Trie *trie;
+static bool done;
+static size_t errors;
+static size_t lookups;
+
+static void key_of(unsigned i, char *buf, size_t size) {
+    snprintf(buf, size, "k/%u/%u/", i / 64, i % 64);
+}
+
+static bool value_check(const struct value *v, unsigned key) {
+    return v->magic == MAGIC && v->key == key;
+}
+
+static void match_check(struct trie_node *node, void *arg) {
+    const struct value *v = __atomic_load_n(&node->data, __ATOMIC_ACQUIRE);
+    (void) arg;
+    if (v && (v->magic != MAGIC || v->key >= KEYS))
+        __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+}
+
+static void *reader(void *arg) {
+    unsigned seed = (unsigned) (uintptr_t) arg;
+    size_t n = 0;
+    char key[32];
+    void *data;
+    ebr_register();
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        unsigned i = rand_r(&seed) % KEYS;
+        ebr_enter();
+        if (n % 16 == 0) {
+            snprintf(key, sizeof(key), "k/+/%u", i % 64);
+            trie_match(trie, key, match_check, NULL);
+        } else {
+            key_of(i, key, sizeof(key));
+            if (trie_find(trie, key, &data) && !value_check(data, i))
+                __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+        }
+        ebr_exit();
+        n++;
+    }
+    ebr_unregister();
+    __atomic_fetch_add(&lookups, n, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int main(void) {
+    pthread_t readers[READERS];
+    static bool present[KEYS];
+    unsigned seed = 1;
+    char key[32];
+    trie = trie_create();
+    for (uintptr_t t = 0; t < READERS; t++)
+        pthread_create(&readers[t], NULL, reader, (void *) (t + 1));
+    for (size_t n = 0; n < WRITES; n++) {
+        unsigned i = rand_r(&seed) % KEYS;
+        if (n % 1000 == 999) {
+            // A whole group goes at once, as expired topics do
+            snprintf(key, sizeof(key), "k/%u", i / 64);
+            trie_prefix_delete(trie, key);
+            for (unsigned j = i / 64 * 64; j < i / 64 * 64 + 64; j++)
+                present[j] = false;
+        } else if (present[i]) {
+            key_of(i, key, sizeof(key));
+            trie_delete(trie, key);
+            present[i] = false;
+        } else {
+            struct value *v = malloc(sizeof(*v));
+            v->magic = MAGIC;
+            v->key = i;
+            key_of(i, key, sizeof(key));
+            trie_insert(trie, key, v);
+            present[i] = true;
+        }
+        if (n % 64 == 0)
+            ebr_collect();
+    }
+    __atomic_store_n(&done, true, __ATOMIC_RELAXED);
+    for (int t = 0; t < READERS; t++)
+        pthread_join(readers[t], NULL);
+
+    size_t expected = 0;
+    for (unsigned i = 0; i < KEYS; i++) {
+        void *data;
+        key_of(i, key, sizeof(key));
+        if (present[i] != trie_find(trie, key, &data))
+            errors++;
+        expected += present[i];
+    }
+    if (trie_size(trie) != expected)
+        errors++;
+    while (ebr_pending() > 0)
+        ebr_collect();
+    trie_release(trie);
+
+    printf("%zu writes, %zu reads by %d readers, %zu errors\n",
+           (size_t) WRITES, lookups, READERS, errors);
+    return errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}